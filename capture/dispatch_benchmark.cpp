@@ -0,0 +1,298 @@
+// HOW TO BUILD:
+// g++ -std=c++17 -O2 -Wall -I include -o dispatch_benchmark dispatch_benchmark.cpp src/Ring.cpp -pthread
+//
+// HOW TO USE:
+// ./dispatch_benchmark [frames=N] [fps=F] [agc_every=N] [pool=N] [disk_us=N]
+//
+// Measures what the camera thread spends handing each frame to the other threads in
+// libusb_callback(): taking a frame from the pool, queueing it for the AGC (every agc_every
+// frames), the preview thread (when it has taken the last one) and the disk thread. The same
+// dispatch is timed with the mutex + condition variable + std::deque queues capture used to have
+// and with the lock-free rings from Ring.h. Consumer threads behave like the real ones and return
+// frames to the pool when they drop the last reference; disk_us adds busy work per frame to the disk
+// consumer. fps=0 dispatches back to back.
+
+// C
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// C++
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// BSD
+#include <err.h>
+
+#include "Ring.h"
+
+
+struct Item
+{
+    std::atomic_int refs = 0;
+};
+
+
+static int64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t)ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+
+// The queues capture used before the rings: one std::deque per consumer behind a mutex, with a
+// condition variable to wake the consumer
+class DequeQueue
+{
+public:
+    explicit DequeQueue(size_t) {}
+
+    bool push(Item *item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        deque_.push_front(item);
+        lock.unlock();
+        cv_.notify_one();
+        return true;
+    }
+
+    bool pop(Item *&item)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (deque_.empty())
+        {
+            return false;
+        }
+        item = deque_.back();
+        deque_.pop_back();
+        return true;
+    }
+
+    template <typename Predicate>
+    void waitNotEmpty(Predicate stop)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]{return !deque_.empty() || stop();});
+    }
+
+    bool empty()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return deque_.empty();
+    }
+
+    void notify() { cv_.notify_all(); }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Item *> deque_;
+};
+
+
+struct Options
+{
+    int frames = 20'000;
+    double fps = 2'000.0;
+    int agc_every = 10;
+    size_t pool = 64;
+    int disk_us = 0;
+};
+
+
+struct Result
+{
+    std::vector<int64_t> dispatch_ns;
+    int pool_exhaustions = 0;
+};
+
+
+template <typename Fifo, typename PoolFifo>
+static Result run(const Options &opt)
+{
+    std::vector<Item> items(opt.pool);
+    PoolFifo pool(opt.pool);
+    Fifo to_disk(opt.pool);
+    Fifo to_agc(opt.pool);
+    Fifo to_preview(1);
+    std::atomic_bool stop = false;
+    auto stopping = [&]{return (bool)stop;};
+
+    for (auto &item : items)
+    {
+        pool.push(&item);
+    }
+
+    auto release = [&](Item *item)
+    {
+        if (--item->refs == 0)
+        {
+            pool.push(item);
+        }
+    };
+
+    auto consumer = [&](Fifo &fifo, int busy_us)
+    {
+        while (true)
+        {
+            fifo.waitNotEmpty(stopping);
+            Item *item;
+            if (!fifo.pop(item))
+            {
+                if (stop)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (busy_us > 0)
+            {
+                int64_t until = now_ns() + busy_us * 1'000LL;
+                while (now_ns() < until) {}
+            }
+            release(item);
+        }
+    };
+
+    std::thread disk_thread(consumer, std::ref(to_disk), opt.disk_us);
+    std::thread agc_thread(consumer, std::ref(to_agc), 0);
+    std::thread preview_thread(consumer, std::ref(to_preview), 0);
+
+    Result result;
+    result.dispatch_ns.reserve(opt.frames);
+    int64_t period_ns = (opt.fps > 0.0) ? (int64_t)(1e9 / opt.fps) : 0;
+    int64_t next_ns = now_ns();
+    for (int i = 0; i < opt.frames; i++)
+    {
+        if (period_ns > 0)
+        {
+            next_ns += period_ns;
+            while (now_ns() < next_ns) {}
+        }
+
+        int64_t start_ns = now_ns();
+
+        Item *item;
+        if (!pool.pop(item))
+        {
+            result.pool_exhaustions++;
+            do
+            {
+                pool.waitNotEmpty(stopping);
+            } while (!pool.pop(item));
+        }
+        item->refs = 1;
+        if (i % opt.agc_every == 0)
+        {
+            item->refs++;
+            to_agc.push(item);
+        }
+        if (to_preview.empty())
+        {
+            item->refs++;
+            to_preview.push(item);
+        }
+        to_disk.push(item);
+
+        result.dispatch_ns.push_back(now_ns() - start_ns);
+    }
+
+    stop = true;
+    to_disk.notify();
+    to_agc.notify();
+    to_preview.notify();
+    disk_thread.join();
+    agc_thread.join();
+    preview_thread.join();
+    return result;
+}
+
+
+static void report(const char *name, Result result)
+{
+    auto &ns = result.dispatch_ns;
+    std::sort(ns.begin(), ns.end());
+    double mean = 0.0;
+    for (auto v : ns)
+    {
+        mean += v;
+    }
+    mean /= ns.size();
+    auto pct = [&](double p){return ns[std::min(ns.size() - 1, (size_t)(p * ns.size()))];};
+    printf(
+        "%-12s %10.0f %10ld %10ld %10ld %10ld %12d\n",
+        name,
+        mean,
+        (long)pct(0.50),
+        (long)pct(0.99),
+        (long)pct(0.999),
+        (long)ns.back(),
+        result.pool_exhaustions
+    );
+}
+
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "frames=", 7) == 0)
+        {
+            opt.frames = std::stoi(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "fps=", 4) == 0)
+        {
+            opt.fps = std::stod(argv[i] + 4);
+        }
+        else if (strncmp(argv[i], "agc_every=", 10) == 0)
+        {
+            opt.agc_every = std::max(1, std::stoi(argv[i] + 10));
+        }
+        else if (strncmp(argv[i], "pool=", 5) == 0)
+        {
+            opt.pool = std::max(4, std::stoi(argv[i] + 5));
+        }
+        else if (strncmp(argv[i], "disk_us=", 8) == 0)
+        {
+            opt.disk_us = std::stoi(argv[i] + 8);
+        }
+        else
+        {
+            errx(
+                1,
+                "Usage: %s [frames=N] [fps=F] [agc_every=N] [pool=N] [disk_us=N]",
+                argv[0]
+            );
+        }
+    }
+    if (opt.frames < 1)
+    {
+        errx(1, "frames must be at least 1");
+    }
+
+    printf(
+        "%d frames at %.0f FPS, AGC every %d frames, pool of %zu, %d us of disk work per frame\n",
+        opt.frames,
+        opt.fps,
+        opt.agc_every,
+        opt.pool,
+        opt.disk_us
+    );
+    printf(
+        "%-12s %10s %10s %10s %10s %10s %12s\n",
+        "queues", "mean [ns]", "p50 [ns]", "p99 [ns]", "p99.9 [ns]", "max [ns]", "exhaustions"
+    );
+    report("deque+mutex", run<DequeQueue, DequeQueue>(opt));
+    report("rings", run<SpscRing<Item *>, MpscRing<Item *>>(opt));
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// One step of a control sequence sent to the camera to start or stop streaming
+struct ControlStep
+{
+    enum Op
+    {
+        RESET,       // libusb_reset_device()
+        CLEAR_HALT,  // libusb_clear_halt() on the bulk endpoint
+        WRITE,       // Vendor OUT request (0x40) with no data stage
+        SET_BITS,    // Read a one-byte register (0xc0 request), write it back with mask bits set
+        CLEAR_BITS,  // Read a one-byte register (0xc0 request), write it back with mask bits cleared
+    };
+
+    Op op;
+
+    // bRequest of the vendor request. For SET_BITS and CLEAR_BITS this is the write request and
+    // read_request is used to read the current register value first.
+    uint8_t request;
+    uint8_t read_request;
+
+    // wValue and wIndex of the vendor request. For SET_BITS and CLEAR_BITS, value is the register
+    // address and the register contents are written in wIndex.
+    uint16_t value;
+    uint16_t index;
+    uint8_t mask;
+
+    unsigned int timeout_ms;
+};
+
+
+/*
+ * Everything the custom libusb streaming path needs to know about a particular camera model. The
+ * descriptors themselves are in CAMERA_MODELS in CameraModel.cpp; supporting another model with
+ * the same frame delivery scheme only requires adding an entry there.
+ */
+struct CameraModel
+{
+    const char *name;
+
+    // USB product IDs covered by this descriptor (vendor ID is always ZWO_VID)
+    std::vector<uint16_t> product_ids;
+
+    // Endpoint that frame data arrives on
+    uint8_t bulk_endpoint;
+
+    // Sent before the first bulk transfer is submitted and after the last one completes
+    std::vector<ControlStep> start_sequence;
+    std::vector<ControlStep> stop_sequence;
+
+    // Big-endian words found at sync_start_offset from the start of every valid frame and in the
+    // last two bytes of every valid frame
+    uint16_t sync_start;
+    uint16_t sync_end;
+    size_t sync_start_offset;
+
+    // Little-endian 16-bit frame counter at index_offset from the start of the frame, and the
+    // largest step between consecutive frames that is still considered normal
+    size_t index_offset;
+    int index_increment_max;
+};
+
+
+constexpr uint16_t ZWO_VID = 0x03c3;
+
+extern const std::vector<CameraModel> CAMERA_MODELS;
+
+// Returns nullptr if the product ID is not described in CAMERA_MODELS
+const CameraModel *find_camera_model(uint16_t vid, uint16_t pid);
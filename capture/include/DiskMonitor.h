@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include <sys/types.h>
+
+struct Pipeline;
+
+
+/*
+ * Keeps an eye on the filesystems a pipeline records to from a low-priority thread of its own, so
+ * that the disk thread never has to make a system call to find out whether there is room for the
+ * next frame. Once a second it samples each filesystem's free space and, where the filesystem sits
+ * on a block device, the device's write statistics from /sys/dev/block/<major>:<minor>/stat. From
+ * the rate at which free space is being used up it predicts how long recording can go on, warns
+ * well before the disk fills up, and clears spaceOk() once less than the minimum is left. Every
+ * half minute it logs free space, time left, write bandwidth, average write latency and the
+ * device queue depth.
+ */
+class DiskMonitor
+{
+public:
+    // Watch the filesystems holding each of paths (files or directories). A file is watched through
+    // its directory, since SER files that never got a frame are deleted when closed. Samples once
+    // before returning so that spaceOk() is meaningful straight away.
+    DiskMonitor(Pipeline &pipeline, const std::vector<std::string> &paths);
+
+    // Stops the thread
+    ~DiskMonitor();
+
+    // Explicit: no copy or move construction or assignment
+    DiskMonitor(const DiskMonitor&)            = delete;
+    DiskMonitor(DiskMonitor&&)                 = delete;
+    DiskMonitor& operator=(const DiskMonitor&) = delete;
+    DiskMonitor& operator=(DiskMonitor&&)      = delete;
+
+    // False once any of the filesystems is nearly full, or can no longer be checked. Cheap enough
+    // to call for every frame.
+    bool spaceOk() const { return space_ok_.load(std::memory_order_relaxed); }
+
+    // Predicted seconds until the first of the filesystems is full at the current rate of use;
+    // infinity while nothing is being written
+    double secondsLeft() const { return seconds_left_.load(std::memory_order_relaxed); }
+
+private:
+    // A filesystem being watched and what was seen at the last sample
+    struct Volume
+    {
+        // Directory on the filesystem
+        std::string path;
+        dev_t dev = 0;
+
+        // Block device statistics file, or empty if there is none (tmpfs, btrfs, NFS...)
+        std::string stat_path;
+
+        int64_t free_bytes = -1;
+        uint64_t sectors_written = 0;
+        uint64_t writes_completed = 0;
+        uint64_t ms_writing = 0;
+
+        // Smoothed rate at which free space is being used up, in bytes per second
+        double use_rate = 0.0;
+
+        // Most recent device figures for the log
+        double write_bandwidth = 0.0;
+        double write_latency_ms = 0.0;
+        uint64_t in_flight = 0;
+
+        // Index into the list of warnings already given about time left
+        size_t warnings_given = 0;
+
+        // Whether statvfs failed last time, so that a failure is logged once rather than every
+        // sample
+        bool failing = false;
+    };
+
+    void run();
+    void sample(double dt, bool log_now);
+
+    std::shared_ptr<spdlog::logger> log_;
+    std::vector<Volume> volumes_;
+    std::atomic_bool space_ok_ = true;
+    std::atomic<double> seconds_left_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
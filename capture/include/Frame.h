@@ -2,11 +2,59 @@
 #include <cstddef>
 #include <mutex>
 #include <atomic>
+#include <string>
+#include <vector>
+
+struct libusb_device_handle;
+struct CameraModel;
+class FrameArena;
+struct Pipeline;
+
+// Recorded by the camera thread when the USB transfer carrying a frame completes
+struct FrameMetadata
+{
+    // Transfer completion time from CLOCK_MONOTONIC_RAW, for measuring intervals between frames
+    int64_t monotonic_raw_ns = 0;
+
+    // Transfer completion time from CLOCK_REALTIME (nanoseconds since the Unix epoch, UTC)
+    int64_t utc_ns = 0;
+
+    // Frame index embedded in the frame by the camera
+    uint16_t sensor_index = 0;
+
+    // Camera settings most recently applied by the control thread when the transfer completed
+    int gain = 0;
+    int exposure_us = 0;
+
+    // libusb_transfer_status of the transfer and the number of bytes it actually received
+    int transfer_status = 0;
+    int actual_length = 0;
+
+    // Region of interest the frame was captured with, in binned sensor pixels. Set when the
+    // transfer is submitted; the image occupies the first width * height bytes of the buffer.
+    int width = 0;
+    int height = 0;
+    int start_x = 0;
+    int start_y = 0;
+
+    // 1 for RAW8 or 2 for RAW16, where pixels are 16-bit little-endian words
+    int bytes_per_pixel = 1;
+};
 
 class Frame
 {
 public:
-    Frame();
+    // The frame belongs to the pool of the given pipeline and returns to it when no longer in use.
+    // buffer_size must be large enough for a full-sensor frame so the pool can be reused for any
+    // ROI. If dma_handle is not null, try to allocate the buffer from usbfs-mapped memory
+    // belonging to that device so that bulk transfers land in it without a copy. Otherwise the
+    // buffer comes from arena if given and not yet used up, or else from the heap.
+    Frame(
+        Pipeline &pipeline,
+        size_t buffer_size,
+        libusb_device_handle *dma_handle = nullptr,
+        FrameArena *arena = nullptr
+    );
     ~Frame();
 
     // Explicit: no copy or move construction or assignment
@@ -15,22 +63,93 @@ public:
     Frame& operator=(const Frame&) = delete;
     Frame& operator=(Frame&&)      = delete;
 
-    void incrRefCount();
-    void decrRefCount();
-    uint16_t syncStart();
-    uint16_t syncEnd();
-    uint16_t frameIndex();
-    bool validate();
+    uint16_t syncStart(const CameraModel &model);
+    uint16_t syncEnd(const CameraModel &model);
+    uint16_t frameIndex(const CameraModel &model);
+    bool validate(const CameraModel &model);
+    bool isDma() const;
+
+    // Size of the image described by metadata_ (may be smaller than the buffer)
+    size_t imageSizeBytes() const;
+    size_t bufferSizeBytes() const;
+
+    Pipeline &pipeline() const;
 
-    // Must be initialized before first object is constructed
-    static size_t IMAGE_SIZE_BYTES;
-    static size_t WIDTH;
-    static size_t HEIGHT;
+    // Number of FrameRefs to this frame; zero while it is in the pool
+    int refCount() const;
+
+    // What holds the outstanding references, e.g. "disk, to-preview ring". Only tracked in debug
+    // builds (NDEBUG not defined); empty otherwise.
+    std::string holders() const;
 
     // Raw image data from camera
     const uint8_t *frame_buffer_;
 
+    // Filled in when the transfer that wrote frame_buffer_ completes
+    FrameMetadata metadata_;
+
 private:
+    friend class FrameRef;
+
+    // Only FrameRef changes the reference count. The last release returns the frame to the pool.
+    void incrRefCount(const char *holder);
+    void decrRefCount(const char *holder);
+    void changeHolder(const char *from, const char *to);
+
+    Pipeline *pipeline_;
+    size_t buffer_size_;
+    libusb_device_handle *dma_handle_;
+    bool heap_buffer_;
     std::atomic_int ref_count_;
-    std::mutex decr_mutex_;
+
+#ifndef NDEBUG
+    // One entry per outstanding reference
+    mutable std::mutex holders_mutex_;
+    std::vector<const char *> holders_;
+#endif
+};
+
+
+/*
+ * Owning handle to one reference to a pooled Frame. Moving a FrameRef hands the reference on;
+ * share() takes another one for a second consumer. The frame goes back to its pipeline's pool when
+ * the last FrameRef to it is destroyed or reset. Each reference is labelled with what holds it
+ * (a string literal) so that debug builds can say who is sitting on frames that never come back.
+ */
+class FrameRef
+{
+public:
+    FrameRef() = default;
+
+    // Take the first reference to a frame that was just taken from the pool
+    FrameRef(Frame *frame, const char *holder);
+
+    FrameRef(FrameRef &&other) noexcept;
+    FrameRef &operator=(FrameRef &&other) noexcept;
+    ~FrameRef() { reset(); }
+
+    // Explicit: use share() to take another reference
+    FrameRef(const FrameRef&)            = delete;
+    FrameRef& operator=(const FrameRef&) = delete;
+
+    FrameRef share(const char *holder) const;
+
+    // Drop the reference now
+    void reset();
+
+    // Label the reference with whatever holds it now, e.g. when a consumer takes it from a ring
+    void setHolder(const char *holder);
+
+    // Give up the reference without ever returning the frame to the pool, for a buffer that a
+    // USB transfer might still write to
+    void leak();
+
+    Frame *get() const { return frame_; }
+    Frame *operator->() const { return frame_; }
+    Frame &operator*() const { return *frame_; }
+    explicit operator bool() const { return frame_ != nullptr; }
+
+private:
+    Frame *frame_ = nullptr;
+    const char *holder_ = nullptr;
 };
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * One contiguous mapping that frame buffers are carved from, so that the realtime threads don't
+ * take page faults or TLB misses on a scattered heap. The mapping starts on a 2 MiB boundary and
+ * buffers are packed into it a whole number of 4 KiB pages apart. It is backed by hugetlb pages if
+ * the kernel has enough reserved and hugepages are requested, otherwise by transparent hugepages
+ * where available, otherwise by ordinary pages. Each buffer is locked into RAM and prefaulted when
+ * it is taken. Buffers that are never taken (because the pool got usbfs DMA memory instead) are
+ * returned to the kernel by trim().
+ */
+class FrameArena
+{
+public:
+    // Reserve address space for up to max_buffers buffers of buffer_size bytes each
+    FrameArena(size_t max_buffers, size_t buffer_size, bool hugepages);
+    ~FrameArena();
+
+    // Explicit: no copy or move construction or assignment
+    FrameArena(const FrameArena&)            = delete;
+    FrameArena(FrameArena&&)                 = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+    FrameArena& operator=(FrameArena&&)      = delete;
+
+    // Next unused buffer, locked and prefaulted as far as possible, or nullptr if all are taken
+    uint8_t *take();
+
+    // Unmap the buffers that have not been taken
+    void trim();
+
+    // Which guarantees the buffers taken so far actually have, for the startup log
+    size_t buffersTaken() const { return taken_; }
+    size_t bytesTaken() const { return taken_ * stride_; }
+    bool hugetlb() const { return hugetlb_; }
+    bool transparentHugepages() const { return thp_; }
+    bool locked() const { return locked_; }
+
+private:
+    uint8_t *base_ = nullptr;
+    size_t buffer_size_;
+    size_t stride_;
+    size_t max_buffers_;
+    size_t mapped_length_ = 0;
+    size_t taken_ = 0;
+    size_t page_size_;
+    bool hugetlb_ = false;
+    bool thp_ = false;
+    bool locked_ = true;
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <spdlog/spdlog.h>
+#include "ASICamera2.h"
+#include "camera.h"
+#include "Frame.h"
+#include "FrameArena.h"
+#include "placement.h"
+#include "Ring.h"
+
+
+/*
+ * Everything needed to capture from one camera: the camera itself and our libusb handle to it,
+ * the pool of frame buffers, the queues that carry frames between threads, the camera settings
+ * and the threads that run the pipeline. Several pipelines can run in one process, one per camera;
+ * they share nothing apart from the preview thread and the program-wide end_program flag.
+ */
+
+// Rung whenever a frame is queued for the preview thread by any pipeline
+extern Doorbell preview_doorbell;
+
+/*
+ * What a pipeline does when fewer than pool_low_water frames are left in its pool. Under either
+ * drop policy the camera thread stops handing frames to the AGC and preview threads so the frames
+ * they hold come back, and it never waits for a frame: a transfer that can't get one stays off the
+ * bus until one is free. DROP_NEWEST leaves incoming frames unwritten; DROP_OLDEST has the disk
+ * thread discard the frames that have been waiting longest. BLOCK waits for the consumers, which
+ * is only sensible when the source can wait too (replays).
+ */
+enum class PoolPolicy
+{
+    BLOCK,
+    DROP_NEWEST,
+    DROP_OLDEST,
+};
+
+struct Pipeline
+{
+    // Position on the command line, used to tell the cameras apart in logs and thread names
+    int index = 0;
+
+    ASI_CAMERA_INFO CamInfo;
+
+    // Log messages from this pipeline's threads are tagged with "cam<index>"
+    std::shared_ptr<spdlog::logger> log;
+
+    // State of the custom libusb streaming code for this camera
+    camera::State camera;
+
+    // Estimated rate of frames received from the camera
+    std::atomic<float> camera_frame_rate = 0.0;
+
+    // AGC enable state
+    std::atomic_bool agc_enabled = false;
+
+    // AGC outputs
+    std::atomic_int camera_gain = camera::GAIN_MAX;
+    std::atomic_int camera_exposure_us = camera::EXPOSURE_DEFAULT_US;
+
+    // Settings most recently applied to the camera by the control thread
+    std::atomic_int camera_gain_applied = -1;
+    std::atomic_int camera_exposure_us_applied = -1;
+
+    // Camera settings waiting to be applied by the control thread, keyed by control type. A newer
+    // request for a control replaces an older one that has not been applied yet.
+    std::mutex control_mutex;
+    std::condition_variable control_cv;
+    std::map<ASI_CONTROL_TYPE, long> pending_controls;
+
+    // disk thread state
+    std::atomic_bool disk_file_exists = false;
+    std::atomic_bool disk_write_enabled = false;
+
+    /*
+     * FIFOs holding pointers to frame objects. The camera thread is the only producer for the
+     * rings headed to the other threads so they are single-producer; frames come back to the
+     * pool from whichever thread drops the last reference. The rings are sized so that a push
+     * can only fail if a frame is queued twice. The to-preview ring holds one frame so the
+     * preview thread only ever sees the latest; all pipelines' to-preview rings share the
+     * preview thread's doorbell.
+     */
+    SpscRing<FrameRef> to_disk_ring;
+    SpscRing<FrameRef> to_agc_ring;
+    SpscRing<FrameRef> to_record_ring;
+    SpscRing<FrameRef> to_preview_ring;
+    MpscRing<Frame *> unused_ring;
+
+    // Frame pool exhaustion handling, set before the pipeline's threads start
+    PoolPolicy pool_policy = PoolPolicy::DROP_NEWEST;
+    size_t pool_low_water = 0;
+
+    // Frames that were not written to disk because the pool was running low
+    std::atomic<int64_t> frames_dropped = 0;
+
+    // Memory for the frame buffers that don't get usbfs DMA memory. Declared before frames so
+    // that it outlives them.
+    std::unique_ptr<FrameArena> frame_arena;
+
+    // Pool of frame buffers. Frame objects add themselves to unused_ring on construction.
+    std::deque<Frame> frames;
+
+    // Placement of each of this pipeline's threads, keyed by role ("cam", "disk", "stripe" (the
+    // stripe writers), "agc", "control", "record" or "housekeeping" (the disk monitor and segment
+    // closer, see place_housekeeping_thread())). Roles not listed are left as they inherited.
+    std::map<std::string, ThreadPlacement> placements;
+
+    std::thread camera_thread;
+    std::thread disk_thread;
+    std::thread agc_thread;
+    std::thread control_thread;
+    std::thread record_thread;
+
+    // The frame pool will hold at most frame_pool_max frames
+    Pipeline(int index, size_t frame_pool_max);
+
+    // Explicit: no copy or move construction or assignment
+    Pipeline(const Pipeline&)            = delete;
+    Pipeline(Pipeline&&)                 = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+    Pipeline& operator=(Pipeline&&)      = delete;
+
+    // Wake every thread of this pipeline that may be waiting so it can notice end_program
+    void notifyAll();
+
+    // Once the pipeline's threads have ended: drop references still queued between threads,
+    // report frames that never came back to the pool and free the pool
+    void releaseFrames();
+};
@@ -0,0 +1,272 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+/*
+ * Lets a consumer sleep until a producer has put something in a ring, without either side taking
+ * a lock. Waiters sleep on a futex; notify() is a pair of atomic operations and only makes a
+ * system call when somebody is actually asleep, so it is cheap enough to call for every frame from
+ * the camera thread.
+ */
+class Doorbell
+{
+public:
+    // Block until ready() returns true. ready() is re-evaluated after every notify().
+    template <typename Predicate>
+    void wait(Predicate ready)
+    {
+        while (!ready())
+        {
+            waiters_.fetch_add(1);
+            uint32_t seq = seq_.load();
+            // Anything pushed before the sequence number was read is visible to this check, and
+            // anything pushed after it changes the sequence number so futexWait() returns at once
+            if (!ready())
+            {
+                futexWait(seq);
+            }
+            waiters_.fetch_sub(1);
+        }
+    }
+
+    void notify()
+    {
+        seq_.fetch_add(1);
+        if (waiters_.load() > 0)
+        {
+            futexWakeAll();
+        }
+    }
+
+private:
+    void futexWait(uint32_t seq);
+    void futexWakeAll();
+
+    std::atomic<uint32_t> seq_ = 0;
+    std::atomic<int> waiters_ = 0;
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex must be 32 bits");
+};
+
+
+// Size of the destructive interference region; keeps the producer and consumer indexes from
+// sharing a cache line
+constexpr size_t RING_ALIGN = 64;
+
+
+static inline size_t ring_capacity(size_t min_capacity)
+{
+    size_t capacity = 1;
+    while (capacity < min_capacity)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+
+/*
+ * Bounded lock-free FIFO with exactly one producer thread and one consumer thread. The capacity
+ * is rounded up to a power of two. Each side keeps a private copy of the other side's index and
+ * only reloads the shared one when the copy says the ring is full (or empty), so in the common case
+ * a push or pop touches one shared cache line.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    // If doorbell is not null, pushes ring that shared doorbell instead of the ring's own (for a
+    // consumer that serves several rings)
+    explicit SpscRing(size_t min_capacity, Doorbell *doorbell = nullptr) :
+        slots_(new T[ring_capacity(min_capacity)]),
+        mask_(ring_capacity(min_capacity) - 1),
+        doorbell_((doorbell != nullptr) ? doorbell : &own_doorbell_)
+    {}
+
+    SpscRing(const SpscRing&)            = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer only. Returns false if the ring is full, in which case item is dropped.
+    bool push(T item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ > mask_)
+        {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_)
+            {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        doorbell_->notify();
+        return true;
+    }
+
+    // Consumer only. Returns false if the ring is empty.
+    bool pop(T &item)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_)
+        {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_)
+            {
+                return false;
+            }
+        }
+        item = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Block until the ring is not empty or stop() returns true.
+    template <typename Predicate>
+    void waitNotEmpty(Predicate stop)
+    {
+        doorbell_->wait([&]{return !empty() || stop();});
+    }
+
+    // Safe from any thread, but only a snapshot
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Wake the consumer, e.g. so it notices the program is ending
+    void notify() { doorbell_->notify(); }
+
+private:
+    std::unique_ptr<T[]> slots_;
+    const size_t mask_;
+    Doorbell own_doorbell_;
+    Doorbell *doorbell_;
+
+    // Written by the consumer
+    alignas(RING_ALIGN) std::atomic<size_t> head_ = 0;
+    size_t cached_tail_ = 0;
+
+    // Written by the producer
+    alignas(RING_ALIGN) std::atomic<size_t> tail_ = 0;
+    size_t cached_head_ = 0;
+};
+
+
+/*
+ * Bounded lock-free FIFO with any number of producer threads and one consumer thread. Producers
+ * claim a slot by advancing the tail with compare-and-swap; each slot carries a sequence number
+ * that says whether it is free, claimed or filled, so the consumer never sees a half-written slot.
+ * (This is Dmitry Vyukov's bounded queue with the consumer side simplified.)
+ */
+template <typename T>
+class MpscRing
+{
+public:
+    explicit MpscRing(size_t min_capacity) :
+        slots_(new Slot[ring_capacity(min_capacity)]),
+        mask_(ring_capacity(min_capacity) - 1)
+    {
+        for (size_t i = 0; i <= mask_; i++)
+        {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&)            = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // Any thread. Returns false if the ring is full.
+    bool push(T item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &slots_[tail & mask_];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)tail;
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                tail = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = std::move(item);
+        slot->seq.store(tail + 1, std::memory_order_release);
+        doorbell_.notify();
+        return true;
+    }
+
+    // Consumer only. Returns false if the ring is empty (or the oldest push is still in progress).
+    bool pop(T &item)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        Slot &slot = slots_[head & mask_];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1)
+        {
+            return false;
+        }
+        item = std::move(slot.item);
+        slot.seq.store(head + mask_ + 1, std::memory_order_release);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Block until the ring is not empty or stop() returns true.
+    template <typename Predicate>
+    void waitNotEmpty(Predicate stop)
+    {
+        doorbell_.wait([&]{return !empty() || stop();});
+    }
+
+    // Safe from any thread, but only a snapshot. Not empty as soon as a push has been claimed.
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    void notify() { doorbell_.notify(); }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    const size_t mask_;
+    Doorbell doorbell_;
+
+    alignas(RING_ALIGN) std::atomic<size_t> head_ = 0;
+    alignas(RING_ALIGN) std::atomic<size_t> tail_ = 0;
+};
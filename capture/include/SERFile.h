@@ -1,9 +1,13 @@
 #pragma once
 #include <cstring>
+#include <memory>
+#include <string>
 #include <tuple>
 #include <vector>
 #include "Frame.h"
 
+class UringWriter;
+
 
 /*
  * The SER file format is popular in astrophotography for storage of RAW images or video. It is
@@ -91,7 +95,8 @@ public:
         const char *observer = "",
         const char *instrument = "",
         const char *telescope = "",
-        bool add_trailer = true
+        bool add_trailer = true,
+        bool direct_io = false
     );
     ~SERFile();
 
@@ -101,7 +106,44 @@ public:
     SERFile& operator=(const SERFile&) = delete;
     SERFile& operator=(SERFile&&)      = delete;
 
-    void addFrame(Frame &frame);
+    // Append a frame. Without a writer it is written before this returns; with one the writer
+    // holds the reference until the write completes.
+    void addFrame(FrameRef frame);
+
+    // Write frames through writer (which must outlive this file) instead of with write(). Not
+    // used with direct I/O, which goes through a staging buffer.
+    void setWriter(UringWriter *writer);
+
+    // Wait for the writes in flight through the writer and stop using it, so that the file can be
+    // closed by a thread other than the one that owns the writer
+    void releaseWriter();
+
+    /*
+     * Pace the kernel's writeback of buffered frames instead of leaving it to flush gigabytes of
+     * dirty pages in bursts: once the frames past a chunk_bytes boundary fill another chunk, the
+     * chunk before is handed to the disk with sync_file_range(), and one chunk later it is waited
+     * for and dropped from the page cache. Dirty memory stays at about three chunks, and the
+     * thread adding frames waits a little at a time if the disk falls behind. 0 (the default)
+     * leaves writeback to the kernel. Has no effect with direct I/O; carried over to the next
+     * segment.
+     */
+    void setWriteback(int64_t chunk_bytes);
+
+    // True if the file is written with O_DIRECT, bypassing the page cache. Requested in the
+    // constructor; falls back to buffered writes if the filesystem doesn't support it.
+    bool directIo() const { return direct_io_; }
+
+    int32_t imageWidth() const;
+    int32_t imageHeight() const;
+
+    /*
+     * Create the next segment of this recording for frames of a different size, with the same
+     * header fields apart from the image geometry. Segments are named after the first file with a
+     * sequence number appended, e.g. capture.ser, capture_001.ser, capture_002.ser, skipping
+     * names that already exist.
+     */
+    std::unique_ptr<SERFile> nextSegment(int32_t width, int32_t height) const;
+
     static int64_t utcOffset();
 
     const std::string FILENAME;
@@ -112,10 +154,64 @@ private:
     int fd_;
     size_t bytes_per_frame_;
     bool add_trailer_;
-    std::vector<int64_t> frame_timestamps_;
+    UringWriter *writer_;
+
+    // O_DIRECT staging: stage_ holds the staged_ bytes of the file from stage_offset_ onwards,
+    // which is always block-aligned. first_block_ is a copy of the file's first block.
+    bool direct_io_;
+    uint8_t *stage_ = nullptr;
+    size_t stage_capacity_ = 0;
+    size_t staged_ = 0;
+    int64_t stage_offset_ = 0;
+    uint8_t *first_block_ = nullptr;
+
+    // Disk space is reserved up to here with fallocate(), unless the filesystem can't
+    bool preallocate_ = true;
+    int64_t preallocated_end_ = 0;
+
+    // Paced writeback: chunk size, or 0 if off, and the end of the chunks handed to the disk so far
+    int64_t writeback_chunk_ = 0;
+    int64_t writeback_end_ = 0;
+
+    // Trailer timestamps as they are recorded, in a side file of which timestamps_ maps the part
+    // starting with entry timestamps_window_start_
+    int timestamps_fd_ = -1;
+    int64_t *timestamps_ = nullptr;
+    size_t timestamps_window_start_ = 0;
+    size_t timestamps_count_ = 0;
+
+    // Filename of the first segment without the .ser extension, and this segment's number
+    std::string segment_stem_;
+    int segment_number_;
 
     using TimestampPair_t = std::tuple<int64_t, int64_t>; // utc, local
 
     void closeFile();
+
+    // File offset just past the last frame
+    int64_t dataEnd() const;
+
+    // Direct I/O: append to the staging buffer, write out its whole blocks (all of it, padded to
+    // a block, if pad is true), and write the final header and trim the padding at close
+    void stage(const void *data, size_t length);
+    void flushStage(bool pad);
+    void finishDirectIo();
+
+    // Reserve disk space up to at least end, and at close give back what wasn't used
+    void preallocate(int64_t end);
+    void releasePreallocation(int64_t file_size);
+
+    // Start writeback of the chunks the frames have moved far enough past
+    void paceWriteback();
+
+    // Side file for the trailer timestamps: its name, moving the mapped window along it so that it
+    // starts with entry first, and copying its contents to the end of the SER file
+    std::string timestampsFilename() const;
+    void mapTimestampWindow(size_t first);
+    void writeTrailer();
+
+    // pwrite() that exits on failure
+    void writeAt(const void *data, size_t length, int64_t offset);
     TimestampPair_t makeTimestamps();
+    TimestampPair_t makeTimestamps(int64_t utc_ns);
 };
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "Frame.h"
+
+struct io_uring;
+struct Pipeline;
+
+
+/*
+ * Writes frames to files asynchronously with io_uring so that the disk thread can keep several
+ * frame writes in flight instead of waiting for each one in turn. The pipeline's frame buffers are
+ * registered with the kernel as fixed buffers where possible (usbfs DMA buffers can't be), which
+ * saves pinning the pages again for every write. Each write holds a reference to its frame, so the
+ * frame only goes back to the pool once its completion has been reaped. Only used by the thread
+ * that created it.
+ */
+class UringWriter
+{
+public:
+    // Returns nullptr, having logged why, if io_uring is not available (kernel too old, blocked by
+    // seccomp or not compiled in), in which case the caller should use plain write() calls. At
+    // most depth writes are in flight at a time.
+    static std::unique_ptr<UringWriter> create(Pipeline &pipeline, unsigned depth);
+
+    // Waits for all writes in flight
+    ~UringWriter();
+
+    // Explicit: no copy or move construction or assignment
+    UringWriter(const UringWriter&)            = delete;
+    UringWriter(UringWriter&&)                 = delete;
+    UringWriter& operator=(const UringWriter&) = delete;
+    UringWriter& operator=(UringWriter&&)      = delete;
+
+    // Queue a write of the first length bytes of the frame's buffer at offset in fd. Waits for an
+    // earlier write to complete first if depth writes are already in flight. Like SERFile, exits
+    // if a write fails.
+    void write(int fd, FrameRef frame, size_t length, int64_t offset);
+
+    // Handle the completions that have arrived. If wait is true and nothing has completed yet,
+    // block until something does (unless nothing is in flight).
+    void reap(bool wait);
+
+    // Wait for every write in flight, e.g. before the file is closed
+    void drain();
+
+    unsigned inFlight() const { return in_flight_; }
+
+private:
+    UringWriter(Pipeline &pipeline, std::unique_ptr<io_uring> ring, unsigned depth);
+
+    // A write in flight, identified to the kernel by its index in slots_
+    struct Slot
+    {
+        FrameRef frame;
+        size_t length;
+    };
+
+    std::shared_ptr<spdlog::logger> log_;
+    std::unique_ptr<io_uring> ring_;
+    std::vector<Slot> slots_;
+    std::vector<unsigned> free_slots_;
+    unsigned in_flight_ = 0;
+
+    // Index of each registered frame buffer, if registration succeeded
+    std::unordered_map<const Frame *, int> fixed_buffers_;
+};
@@ -1,3 +1,5 @@
 #pragma once
 
-void agc();
+struct Pipeline;
+
+void agc(Pipeline *pipeline);
@@ -1,5 +1,37 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
 #include "ASICamera2.h"
+#include "record.h"
+
+
+#define ASI_EXIT_ON_FAIL(func, ...) \
+    do { \
+        ASI_ERROR_CODE ret = func(__VA_ARGS__); \
+        if (ret != ASI_SUCCESS) { \
+            spdlog::error(#func " returned  {}", camera::asi_error_str(ret)); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define ASI_LOG_ON_FAIL(func, ...) \
+    do { \
+        ASI_ERROR_CODE ret = func(__VA_ARGS__); \
+        if (ret != ASI_SUCCESS) { \
+            spdlog::error(#func " returned  {}", camera::asi_error_str(ret)); \
+        } \
+    } while (0)
+
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+struct CameraModel;
+struct Pipeline;
 
 namespace camera
 {
@@ -9,6 +41,112 @@ namespace camera
     constexpr int EXPOSURE_MIN_US = 32; // 32 is the minimum value for this camera
     constexpr int EXPOSURE_MAX_US = 16'667; // Max for ~60 FPS
 
-    void init_camera(ASI_CAMERA_INFO &CamInfo, const char *cam_name, int binning = 1);
-    void run_camera(ASI_CAMERA_INFO &CamInfo);
+    // Number of bulk transfers kept queued on the camera's bulk endpoint
+    constexpr int NUM_TRANSFERS_DEFAULT = 4;
+    constexpr int NUM_TRANSFERS_MAX = 32;
+
+    // Region of interest in binned sensor pixels. Width must be a multiple of 8 and height a
+    // multiple of 2; start coordinates are kept even so the Bayer pattern does not change.
+    struct Roi
+    {
+        int width;
+        int height;
+        int start_x;
+        int start_y;
+    };
+
+    /*
+     * Everything the streaming code keeps about one camera. Each Pipeline has its own, including
+     * its own libusb context so that transfer callbacks only ever run on that camera's thread.
+     * Apart from the ROI request members this is only touched by the camera thread once streaming
+     * has started.
+     */
+    struct State
+    {
+        int camera_id = -1;
+        int binning = 1;
+        ASI_IMG_TYPE img_type = ASI_IMG_RAW8;
+
+        libusb_context *ctx = nullptr;
+        libusb_device_handle *dev_handle = nullptr;
+        const CameraModel *model = nullptr;
+        uint16_t usb_product_id = 0;
+
+        // Largest ROI at the current binning, and the ROI that newly submitted transfers are
+        // sized for
+        Roi full_roi = {0, 0, 0, 0};
+        Roi roi = {0, 0, 0, 0};
+
+        // ROI requested by another thread, picked up by the camera thread between passes through
+        // the resubmit loop
+        std::mutex roi_mutex;
+        Roi pending_roi = {0, 0, 0, 0};
+        std::atomic_bool roi_change_pending = false;
+
+        // Set while transfers are being cancelled to change the ROI so the cancellations aren't
+        // reported as errors
+        bool roi_changing = false;
+
+        // The first frame after streaming (re)starts has nothing to compare its index against
+        bool resync_frame_index = true;
+        uint16_t last_frame_index = 0;
+
+        // Raw USB stream recording and replay
+        bool recording_enabled = false;
+        int replay_fd = -1;
+
+        // Transfers whose callbacks have run since the last pass through the resubmit loop, in
+        // order of completion
+        std::vector<libusb_transfer *> completed_transfers;
+
+        // Transfer ring statistics
+        int frame_count = 0;
+        int transfers_in_flight = 0;
+        int transfers_in_flight_min = 0;
+        int transfer_overflow_count = 0;
+        int transfer_error_count = 0;
+        int dma_frame_count = 0;
+        int64_t frame_bytes_count = 0;
+
+        // Set while transfers are waiting for the frame pool to give up a frame; counts how often
+        // that has happened
+        bool pool_starved = false;
+        int pool_starved_count = 0;
+
+        // Timestamps of recent frames for calculating the frame rate, and when frames were last
+        // sent to the AGC and statistics were last logged
+        std::deque<int64_t> frame_timestamps;
+        std::chrono::steady_clock::time_point agc_last_dispatch_ts;
+        std::chrono::steady_clock::time_point stats_last_printed_ts;
+    };
+
+    const char *asi_error_str(ASI_ERROR_CODE code);
+
+    // Open a camera not already opened by another pipeline and our own libusb handle to it.
+    // img_type is ASI_IMG_RAW8 or ASI_IMG_RAW16.
+    void init_camera(
+        Pipeline &pipeline,
+        const char *cam_name,
+        int binning = 1,
+        ASI_IMG_TYPE img_type = ASI_IMG_RAW8
+    );
+    libusb_device_handle *usb_handle(Pipeline &pipeline);
+    uint16_t usb_product_id(Pipeline &pipeline);
+    void enable_recording(Pipeline &pipeline);
+
+    // Largest ROI at the current binning. Frame buffers are allocated at this size.
+    Roi full_frame_roi(Pipeline &pipeline);
+
+    // 1 for RAW8, 2 for RAW16 (16-bit little-endian pixels)
+    int bytes_per_pixel(Pipeline &pipeline);
+
+    // Ask the camera thread to switch to a new ROI while streaming. The request is clamped to the
+    // sensor; a request made before the previous one is applied replaces it. Frames carry the
+    // geometry they were captured with in their metadata.
+    void request_roi(Pipeline &pipeline, Roi roi);
+    void run_camera(Pipeline &pipeline, int num_transfers = NUM_TRANSFERS_DEFAULT);
+    void close_camera(Pipeline &pipeline);
+
+    UsbRecordHeader_t init_replay(Pipeline &pipeline, const char *filename);
+    void run_replay(Pipeline &pipeline, bool as_fast_as_possible);
 }
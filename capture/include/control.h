@@ -0,0 +1,7 @@
+#pragma once
+#include "ASICamera2.h"
+
+struct Pipeline;
+
+void request_control_value(Pipeline &pipeline, ASI_CONTROL_TYPE control, long value);
+void control(Pipeline *pipeline);
@@ -1,4 +1,32 @@
 #pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
 #include "SERFile.h"
 
-void write_to_disk(SERFile *ser_file);
+struct Pipeline;
+
+// When the disk thread moves on to a new SER segment, besides whenever the frame size changes.
+// Limits apply to the whole segment (all of its stripes together when striping), which always
+// gets at least one frame per stripe whatever they say. Zero means no limit.
+struct SegmentLimits
+{
+    int64_t max_bytes = 0;
+    int64_t max_frames = 0;
+
+    // Measured between the arrival times of the segment's first and last frames
+    int64_t max_ns = 0;
+};
+
+// Writes the pipeline's frames to ser_files, which may be empty (frames are discarded) or hold one
+// file. With more than one file the frames are striped across them round-robin, each file written
+// by a thread of its own; ser_merge turns the stripes back into a single SER file. If uring_depth
+// is not zero, up to that many frame writes per file are kept in flight with io_uring where it is
+// available; otherwise each frame is written with write() before the next is taken. Finished
+// segments are closed by a background thread.
+void write_to_disk(
+    Pipeline *pipeline,
+    std::vector<std::unique_ptr<SERFile>> ser_files,
+    unsigned uring_depth,
+    SegmentLimits segment_limits
+);
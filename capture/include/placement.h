@@ -0,0 +1,56 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+
+
+/*
+ * Where a thread may run and how it is scheduled. On the command line a placement is written as
+ * [policy[:priority]][@cpus], e.g. "rr:10@2", "fifo:20", "other@0-1" or "@4", where policy is one
+ * of other, batch, idle, fifo or rr and cpus is a CPU list as accepted by parse_cpus(). Whatever
+ * is left out is left as the thread inherited it.
+ */
+struct ThreadPlacement
+{
+    // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or SCHED_RR; -1 to leave the policy alone
+    int policy = -1;
+    int priority = 0;
+
+    // Empty to leave the affinity alone
+    cpu_set_t cpus;
+
+    ThreadPlacement() { CPU_ZERO(&cpus); }
+};
+
+// Parse a CPU list such as "2", "2-3" or "0+2" (CPUs 0 and 2). Exits if it can't be parsed.
+cpu_set_t parse_cpus(const char *list);
+
+// The inverse of parse_cpus()
+std::string format_cpus(const cpu_set_t &cpus);
+
+// Parse a placement. Fields not given in spec are taken from defaults. Exits if it can't be parsed.
+ThreadPlacement parse_placement(const char *spec, const ThreadPlacement &defaults = {});
+
+void set_thread_name(pthread_t thread, const char *name);
+
+// Apply placement to a thread; name is only for messages. Exits on failure, which usually means
+// the process lacks CAP_SYS_NICE for a realtime policy.
+void apply_placement(pthread_t thread, const ThreadPlacement &placement, const char *name);
+
+// Apply placement to a thread that does housekeeping for the real-time threads (logging, disk
+// monitoring, closing files), so that it neither competes with them nor lands on the CPUs kept for
+// them. Unless placement says otherwise the thread is scheduled SCHED_OTHER on the main thread's
+// CPUs, whatever it inherited from the thread that started it.
+void place_housekeeping_thread(
+    pthread_t thread,
+    const char *name,
+    const ThreadPlacement &placement = {}
+);
+
+// Apply placement to every thread of this process called name, such as the threads libasicamera2
+// starts, which inherit the name of the thread that created them. Returns how many there were.
+int apply_placement_by_name(const char *name, const ThreadPlacement &placement);
+
+// Log the name, scheduling policy, priority and allowed CPUs of every thread in this process and
+// which CPUs the kernel keeps isolated from the scheduler
+void log_thread_placement();
@@ -1,3 +1,7 @@
 #pragma once
+#include <vector>
+#include "camera.h"
 
-void preview(bool color);
+struct Pipeline;
+
+void preview(std::vector<Pipeline *> pipelines, camera::Roi tracking_roi);
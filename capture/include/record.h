@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+
+
+/*
+ * Raw USB stream recording format. A file starts with one UsbRecordHeader_t followed by one
+ * UsbRecordEntry_t per completed bulk transfer, in order of completion. Each entry is immediately
+ * followed by ActualLength bytes of transfer data (nothing for transfers that failed without
+ * delivering data). All fields are little-endian.
+ */
+
+
+struct [[gnu::packed]] UsbRecordHeader_t
+{
+    char Magic[8] = {'Z', 'W', 'O', 'U', 'S', 'B', 'R', '3'};
+
+    // Identifies the camera model so replay can use the same sync words and header layout
+    uint16_t VendorID = 0;
+    uint16_t ProductID = 0;
+
+    // Full frame geometry at the binning used for the recording (individual transfers may be
+    // smaller; see UsbRecordEntry_t)
+    int32_t ImageWidth = 0;
+    int32_t ImageHeight = 0;
+    int32_t IsColor = 0;
+
+    // 1 for RAW8, 2 for RAW16
+    int32_t BytesPerPixel = 1;
+
+    // Length of a full frame bulk transfer
+    int64_t TransferLength = 0;
+
+    // Camera name. 40 ASCII characters, fill unused characters with 0.
+    char Instrument[40] = {};
+};
+
+
+struct [[gnu::packed]] UsbRecordEntry_t
+{
+    // Transfer completion time (CLOCK_MONOTONIC_RAW) and UTC time, in nanoseconds
+    int64_t MonotonicRawNs;
+    int64_t UtcNs;
+
+    // Camera settings in effect
+    int32_t Gain;
+    int32_t ExposureUs;
+
+    // libusb_transfer_status and number of bytes received
+    int32_t Status;
+    int32_t ActualLength;
+
+    // ROI the transfer was sized for; the requested length was Width * Height * BytesPerPixel
+    int32_t Width;
+    int32_t Height;
+    int32_t StartX;
+    int32_t StartY;
+};
+
+
+struct Pipeline;
+
+void record_usb(Pipeline *pipeline, const char *filename, UsbRecordHeader_t header);
@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <spdlog/spdlog.h>
+
+
+/*
+ * Logging for the threads that must never wait: the camera thread, the disk and stripe writers.
+ * An RTLOG_*() call formats its message into a fixed-size record and pushes it onto a lock-free
+ * queue belonging to the calling thread; a low-priority logger thread takes the records off and
+ * hands them to spdlog with the time they were logged. No lock is taken and no I/O is done on the
+ * calling thread, and nothing is allocated except the thread's queue on its first message.
+ *
+ * Each call site may log rtlog::SITE_BURST messages per second. Beyond that messages are counted
+ * instead of formatted, so that a storm of errors costs the calling thread next to nothing, and
+ * once a second the logger thread reports how many were suppressed at each site. Messages that
+ * find the thread's queue full are counted and reported too.
+ *
+ * Critical messages, and all messages while the logger thread isn't running, go straight to
+ * spdlog as usual: a critical message is normally followed by exit().
+ */
+
+#define RTLOG(logger, level, ...) \
+    do { \
+        static rtlog::Site rtlog_site_; \
+        rtlog::log(rtlog_site_, &*(logger), (level), __VA_ARGS__); \
+    } while (0)
+
+#define RTLOG_DEBUG(logger, ...) RTLOG(logger, spdlog::level::debug, __VA_ARGS__)
+#define RTLOG_INFO(logger, ...)  RTLOG(logger, spdlog::level::info, __VA_ARGS__)
+#define RTLOG_WARN(logger, ...)  RTLOG(logger, spdlog::level::warn, __VA_ARGS__)
+#define RTLOG_ERROR(logger, ...) RTLOG(logger, spdlog::level::err, __VA_ARGS__)
+
+
+namespace rtlog
+{
+    // Messages a call site may log per second before the rest are suppressed
+    constexpr int SITE_BURST = 10;
+
+    // Longer messages are cut off
+    constexpr size_t MAX_MESSAGE_LENGTH = 200;
+
+
+    // Rate limit and suppressed message count of one RTLOG() call site; may be shared by threads
+    struct Site
+    {
+        std::atomic<int64_t> second = -1;
+        std::atomic<int> count = 0;
+        std::atomic<int64_t> suppressed = 0;
+
+        // For the report of suppressed messages
+        std::atomic<const char *> format = nullptr;
+        std::atomic<spdlog::logger *> logger = nullptr;
+        std::atomic<spdlog::level::level_enum> level = spdlog::level::info;
+
+        std::atomic_bool listed = false;
+        Site *next = nullptr;
+    };
+
+
+    struct Record
+    {
+        spdlog::logger *logger;
+        spdlog::level::level_enum level;
+        spdlog::log_clock::time_point time;
+        size_t length;
+        char text[MAX_MESSAGE_LENGTH];
+    };
+
+
+    // Start the logger thread. Also arranges for stop() to be called at exit().
+    void start();
+
+    // Log everything still queued and stop the logger thread
+    void stop();
+
+    bool running();
+
+    // Whether the site may log another message this second; if not, counts it as suppressed
+    bool admit(
+        Site &site,
+        spdlog::logger *logger,
+        spdlog::level::level_enum level,
+        const char *format
+    );
+
+    // Queue a record on the calling thread's queue
+    void push(Record &record);
+
+
+    template <typename... Args>
+    void log(
+        Site &site,
+        spdlog::logger *logger,
+        spdlog::level::level_enum level,
+        spdlog::format_string_t<Args...> format,
+        Args&&... args
+    )
+    {
+        if (!logger->should_log(level))
+        {
+            return;
+        }
+        if (level >= spdlog::level::critical || !running())
+        {
+            logger->log(level, format, std::forward<Args>(args)...);
+            return;
+        }
+        if (!admit(site, logger, level, fmt::string_view(format).data()))
+        {
+            return;
+        }
+
+        Record record;
+        record.logger = logger;
+        record.level = level;
+        record.time = spdlog::log_clock::now();
+        auto result = fmt::format_to_n(
+            record.text,
+            MAX_MESSAGE_LENGTH,
+            format,
+            std::forward<Args>(args)...
+        );
+        record.length = std::min(result.size, MAX_MESSAGE_LENGTH);
+        push(record);
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+
+/*
+ * Frame lifecycle tracing. While enabled, each thread records events in a ring buffer of its own:
+ * a frame being taken from the pool, every change of what holds a reference to it (which is how
+ * every push onto and pop off a ring shows up, since a frame is relabelled "to-disk ring" when it
+ * is queued and "disk" when the disk thread takes it), each reference being dropped, the frame
+ * returning to the pool, and spans of work such as writing a frame. Recording an event is a clock
+ * read and a store into the calling thread's buffer; no lock is taken and nothing is allocated
+ * except each thread's buffer on its first event. When a buffer fills up the oldest events are
+ * overwritten, so a trace holds the last EVENTS_PER_THREAD events of each thread.
+ *
+ * write() saves everything recorded in Chrome trace event JSON, which chrome://tracing and
+ * Perfetto (ui.perfetto.dev) open. Each frame buffer gets an async track that shows each trip of
+ * the frame from the pool and back with a mark wherever it changes hands; each thread's track
+ * shows the same hand-overs as instant events alongside its spans.
+ */
+namespace trace
+{
+    constexpr size_t EVENTS_PER_THREAD = 1 << 18;
+
+    enum class Kind : uint8_t
+    {
+        FRAME_TAKEN,    // First reference taken to a frame from the pool
+        FRAME_SHARED,   // Another reference taken
+        FRAME_HOLDER,   // A reference relabelled with a new holder
+        FRAME_RELEASED, // A reference dropped, not the last
+        FRAME_RETURNED, // The last reference dropped; the frame is back in the pool
+        SPAN,           // Work done by the thread, from start_ns for duration_ns
+    };
+
+    struct Event
+    {
+        int64_t start_ns;
+        int64_t duration_ns;
+        const char *name;
+        const void *frame;
+        Kind kind;
+    };
+
+    extern std::atomic_bool tracing;
+
+    // Turn tracing on; call before starting the threads to be traced
+    void enable();
+
+    inline bool enabled()
+    {
+        return tracing.load(std::memory_order_relaxed);
+    }
+
+    inline int64_t now_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+    }
+
+    // Append an event to the calling thread's buffer
+    void record(const Event &event);
+
+    // Record a frame event. name is a string literal, normally the holder of the reference.
+    inline void frame(Kind kind, const char *name, const void *frame)
+    {
+        if (enabled())
+        {
+            record({now_ns(), 0, name, frame, kind});
+        }
+    }
+
+    // Records a SPAN event covering its own lifetime
+    class Span
+    {
+    public:
+        explicit Span(const char *name, const void *frame = nullptr) :
+            name_(name),
+            frame_(frame),
+            start_ns_(enabled() ? now_ns() : 0)
+        {}
+
+        ~Span()
+        {
+            if (start_ns_ != 0)
+            {
+                record({start_ns_, now_ns() - start_ns_, name_, frame_, Kind::SPAN});
+            }
+        }
+
+        Span(const Span&)            = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char *name_;
+        const void *frame_;
+        int64_t start_ns_;
+    };
+
+    // Save what every thread has recorded as Chrome trace JSON. Only call once the traced threads
+    // have stopped. Returns false (having logged why) if the file couldn't be written.
+    bool write(const char *filename);
+}
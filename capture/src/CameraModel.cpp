@@ -0,0 +1,78 @@
+#include "CameraModel.h"
+#include <algorithm>
+
+
+// Start and stop sequences shared by the cameras built around the FX3 USB controller and the ZWO
+// FPGA. These are custom implementations of the startup and shutdown sections of
+// `ASIStartVideoCapture()` and `ASIStopVideoCapture()`.
+static const std::vector<ControlStep> FX3_STOP_SEQUENCE = {
+    // Stop streaming
+    {ControlStep::WRITE, 0xaa, 0, 0x0, 0x0, 0, 200},
+
+    // Set bit 4 of FPGA register 0 to put FPGA in the "stop" state
+    {ControlStep::SET_BITS, 0xbd, 0xbc, 0x0, 0x0, 0x10, 500},
+};
+
+static const std::vector<ControlStep> ASI178_START_SEQUENCE = {
+    {ControlStep::RESET, 0, 0, 0, 0, 0, 0},
+
+    // Stop streaming
+    {ControlStep::WRITE, 0xaa, 0, 0x0, 0x0, 0, 200},
+
+    // Set bit 4 of FPGA register 0 to put FPGA in the "stop" state
+    {ControlStep::SET_BITS, 0xbd, 0xbc, 0x0, 0x0, 0x10, 500},
+
+    // Start streaming
+    {ControlStep::WRITE, 0xa9, 0, 0x0, 0x0, 0, 200},
+
+    // Write 0x6 then 0x0 to sensor chip register 0x3000
+    {ControlStep::WRITE, 0xb6, 0, 0x3000, 0x6, 0, 500},
+    {ControlStep::WRITE, 0xb6, 0, 0x3000, 0x0, 0, 500},
+
+    // Clear bit 4 of FPGA register 0 to take FPGA out of the "stop" state
+    {ControlStep::CLEAR_BITS, 0xbd, 0xbc, 0x0, 0x0, 0x10, 500},
+
+    // Make sure the bulk transfer endpoint isn't halted
+    {ControlStep::CLEAR_HALT, 0, 0, 0, 0, 0, 0},
+};
+
+
+const std::vector<CameraModel> CAMERA_MODELS = {
+    {
+        "ASI178",
+        {
+            0x178a,  // ASI178MC
+            0x178c,  // ASI178MM
+        },
+        0x81,
+        ASI178_START_SEQUENCE,
+        FX3_STOP_SEQUENCE,
+        0x7e5a,
+        0xf03c,
+        0,
+        2,
+        // Not sure why the frame index sometimes increments by 2, but even at low frame rates this
+        // seems to be true so increment by 1 or 2 are both considered valid.
+        2,
+    },
+};
+
+
+const CameraModel *find_camera_model(uint16_t vid, uint16_t pid)
+{
+    if (vid != ZWO_VID)
+    {
+        return nullptr;
+    }
+
+    for (const auto &model : CAMERA_MODELS)
+    {
+        if (std::find(model.product_ids.begin(), model.product_ids.end(), pid) !=
+            model.product_ids.end())
+        {
+            return &model;
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,252 @@
+#include "DiskMonitor.h"
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "Pipeline.h"
+#include "placement.h"
+
+
+// Writes are disabled once less than this is left on any of the filesystems
+constexpr int64_t MIN_FREE_DISK_SPACE_BYTES = 100 << 20; // 100 MiB
+
+// Warn when the predicted time left at the current rate drops below each of these, in seconds
+constexpr double WARN_SECONDS_LEFT[] = {600.0, 60.0};
+
+constexpr std::chrono::seconds SAMPLE_PERIOD(1);
+constexpr int LOG_EVERY_SAMPLES = 30;
+
+// Time constant of the smoothing applied to the rate free space is used up at. Long enough to
+// ride out the steps in free space as SER files preallocate in large chunks.
+constexpr double USE_RATE_TIME_CONSTANT_S = 10.0;
+
+// /sys block statistics count 512-byte sectors whatever the device's sector size
+constexpr uint64_t STAT_SECTOR_BYTES = 512;
+
+
+// The directory holding path, or path itself if it is a directory
+static std::string directory_of(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        return path;
+    }
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos)
+    {
+        return ".";
+    }
+    return (slash == 0) ? "/" : path.substr(0, slash);
+}
+
+DiskMonitor::DiskMonitor(Pipeline &pipeline, const std::vector<std::string> &paths) :
+    log_(pipeline.log),
+    seconds_left_(std::numeric_limits<double>::infinity())
+{
+    for (const auto &path : paths)
+    {
+        Volume volume;
+        volume.path = directory_of(path);
+        struct stat st;
+        if (stat(volume.path.c_str(), &st) != 0)
+        {
+            // Kept, so that sample() finds it can't be checked and stops the writes
+            volumes_.push_back(volume);
+            continue;
+        }
+
+        // Stripes may well share a filesystem
+        bool seen = false;
+        for (const auto &other : volumes_)
+        {
+            seen = seen || other.dev == st.st_dev;
+        }
+        if (seen)
+        {
+            continue;
+        }
+
+        volume.dev = st.st_dev;
+        char stat_path[64];
+        snprintf(
+            stat_path,
+            sizeof(stat_path),
+            "/sys/dev/block/%u:%u/stat",
+            major(st.st_dev),
+            minor(st.st_dev)
+        );
+        if (access(stat_path, R_OK) == 0)
+        {
+            volume.stat_path = stat_path;
+        }
+        volumes_.push_back(volume);
+    }
+
+    sample(0.0, true);
+
+    thread_ = std::thread(&DiskMonitor::run, this);
+    char name[16];
+    snprintf(name, sizeof(name), "diskmon%d", pipeline.index);
+    set_thread_name(thread_.native_handle(), name);
+    auto placement = pipeline.placements.find("housekeeping");
+    place_housekeeping_thread(
+        thread_.native_handle(),
+        name,
+        (placement != pipeline.placements.end()) ? placement->second : ThreadPlacement()
+    );
+}
+
+DiskMonitor::~DiskMonitor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void DiskMonitor::run()
+{
+    using namespace std::chrono;
+
+    auto last = steady_clock::now();
+    int samples = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, SAMPLE_PERIOD, [this]{return stopping_;}))
+    {
+        lock.unlock();
+        auto now = steady_clock::now();
+        samples++;
+        sample(duration<double>(now - last).count(), samples % LOG_EVERY_SAMPLES == 0);
+        last = now;
+        lock.lock();
+    }
+}
+
+void DiskMonitor::sample(double dt, bool log_now)
+{
+    bool space_ok = true;
+    double seconds_left = std::numeric_limits<double>::infinity();
+
+    for (auto &volume : volumes_)
+    {
+        struct statvfs disk_stats;
+        if (statvfs(volume.path.c_str(), &disk_stats) != 0)
+        {
+            // Free space that can't be checked can't be relied on
+            if (!volume.failing)
+            {
+                char buf[256];
+                log_->error(
+                    "Cannot check free space in {}, so writes are stopped: {}",
+                    volume.path,
+                    strerror_r(errno, buf, sizeof(buf))
+                );
+                volume.failing = true;
+            }
+            space_ok = false;
+            continue;
+        }
+        if (volume.failing)
+        {
+            log_->info("Free space in {} can be checked again.", volume.path);
+            volume.failing = false;
+        }
+        int64_t free_bytes = (int64_t)disk_stats.f_frsize * disk_stats.f_bavail;
+
+        if (dt > 0.0 && volume.free_bytes >= 0)
+        {
+            // Space given back (a file deleted, preallocation trimmed) counts as no use at all
+            double rate = std::max(0.0, (volume.free_bytes - free_bytes) / dt);
+            double alpha = 1.0 - std::exp(-dt / USE_RATE_TIME_CONSTANT_S);
+            volume.use_rate += alpha * (rate - volume.use_rate);
+        }
+        volume.free_bytes = free_bytes;
+
+        // Fields 5, 7 and 8 of the block device stat file: writes completed, sectors written,
+        // milliseconds spent writing; 9 is I/Os currently in flight
+        if (!volume.stat_path.empty())
+        {
+            FILE *file = fopen(volume.stat_path.c_str(), "r");
+            uint64_t f[9];
+            if (file != nullptr && fscanf(
+                file,
+                "%lu %lu %lu %lu %lu %lu %lu %lu %lu",
+                &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7], &f[8]
+            ) == 9)
+            {
+                if (dt > 0.0)
+                {
+                    uint64_t writes = f[4] - volume.writes_completed;
+                    volume.write_bandwidth =
+                        (f[6] - volume.sectors_written) * STAT_SECTOR_BYTES / dt;
+                    volume.write_latency_ms = (writes > 0) ?
+                        (double)(f[7] - volume.ms_writing) / writes : 0.0;
+                }
+                volume.writes_completed = f[4];
+                volume.sectors_written = f[6];
+                volume.ms_writing = f[7];
+                volume.in_flight = f[8];
+            }
+            if (file != nullptr)
+            {
+                fclose(file);
+            }
+        }
+
+        double volume_seconds_left = std::numeric_limits<double>::infinity();
+        if (volume.use_rate > 0.0)
+        {
+            volume_seconds_left =
+                std::max<int64_t>(0, free_bytes - MIN_FREE_DISK_SPACE_BYTES) / volume.use_rate;
+        }
+        seconds_left = std::min(seconds_left, volume_seconds_left);
+
+        if (free_bytes <= MIN_FREE_DISK_SPACE_BYTES)
+        {
+            space_ok = false;
+        }
+        else if (volume.warnings_given < std::size(WARN_SECONDS_LEFT) &&
+            volume_seconds_left < WARN_SECONDS_LEFT[volume.warnings_given])
+        {
+            log_->warn(
+                "{} will be full in about {:.0f} s at the current rate ({:.0f} MiB/s)!",
+                volume.path,
+                volume_seconds_left,
+                volume.use_rate / (1 << 20)
+            );
+            volume.warnings_given++;
+        }
+
+        if (log_now)
+        {
+            std::string device = volume.stat_path.empty() ? "no block device statistics" :
+                fmt::format(
+                    "device writing {:.0f} MiB/s, {:.1f} ms per write, {} I/Os in flight",
+                    volume.write_bandwidth / (1 << 20),
+                    volume.write_latency_ms,
+                    volume.in_flight
+                );
+            log_->info(
+                "Disk {}: {:.1f} GiB free, {}; {}",
+                volume.path,
+                (double)free_bytes / (1 << 30),
+                std::isinf(volume_seconds_left) ? std::string("not filling") :
+                    fmt::format("full in {:.0f} min", volume_seconds_left / 60),
+                device
+            );
+        }
+    }
+
+    space_ok_.store(space_ok, std::memory_order_relaxed);
+    seconds_left_.store(seconds_left, std::memory_order_relaxed);
+}
@@ -1,103 +1,283 @@
 #include "Frame.h"
-#include <deque>
-#include <condition_variable>
+#include "CameraModel.h"
+#include "FrameArena.h"
+#include "Pipeline.h"
+#include "rtlog.h"
+#include "trace.h"
+#include <algorithm>
 #include <err.h>
+#include <libusb-1.0/libusb.h>
 #include <spdlog/spdlog.h>
 
-extern std::deque<Frame *> unused_deque;
-extern std::mutex unused_deque_mutex;
-extern std::condition_variable unused_deque_cv;
+// Set once usbfs refuses an allocation so the rest of the pool goes straight to the heap. The
+// usbfs memory limit is shared by all devices, so this applies to every pipeline.
+static bool dma_alloc_failed = false;
 
-size_t Frame::IMAGE_SIZE_BYTES = 0;
-size_t Frame::WIDTH = 0;
-size_t Frame::HEIGHT = 0;
-
-Frame::Frame() :
+Frame::Frame(
+    Pipeline &pipeline,
+    size_t buffer_size,
+    libusb_device_handle *dma_handle,
+    FrameArena *arena
+) :
+    frame_buffer_(nullptr),
+    pipeline_(&pipeline),
+    buffer_size_(buffer_size),
+    dma_handle_(nullptr),
+    heap_buffer_(false),
     ref_count_(0)
 {
-    if (IMAGE_SIZE_BYTES == 0)
+    if (buffer_size_ == 0)
     {
-        spdlog::critical(
-            "Frame: IMAGE_SIZE_BYTES must be set to a non-zero value before construction."
-        );
+        spdlog::critical("Frame: buffer size must be non-zero.");
+        exit(1);
+    }
+
+    if (dma_handle != nullptr && !dma_alloc_failed)
+    {
+        frame_buffer_ = libusb_dev_mem_alloc(dma_handle, buffer_size_);
+        if (frame_buffer_ != nullptr)
+        {
+            dma_handle_ = dma_handle;
+        }
+        else
+        {
+            // Typically the kernel's usbfs memory limit (usbcore.usbfs_memory_mb) is too small
+            // for the pool, or the platform doesn't support mmap on usbfs at all.
+            spdlog::warn(
+                "libusb_dev_mem_alloc failed; remaining frame buffers will come from ordinary "
+                "memory. Raising /sys/module/usbcore/parameters/usbfs_memory_mb may help."
+            );
+            dma_alloc_failed = true;
+        }
+    }
+
+    if (dma_handle_ == nullptr && arena != nullptr)
+    {
+        frame_buffer_ = arena->take();
+    }
+
+    if (frame_buffer_ == nullptr)
+    {
+        frame_buffer_ = new uint8_t[buffer_size_];
+        heap_buffer_ = true;
+    }
+
+    if (!pipeline_->unused_ring.push(this))
+    {
+        spdlog::critical("Frame: more frames than the pool was sized for.");
         exit(1);
     }
-    frame_buffer_ = new uint8_t[IMAGE_SIZE_BYTES];
-    std::unique_lock<std::mutex> unused_deque_lock(unused_deque_mutex);
-    unused_deque.push_front(this);
-    unused_deque_lock.unlock();
-    unused_deque_cv.notify_one();
 }
 
 Frame::~Frame()
 {
-    delete [] frame_buffer_;
+    if (dma_handle_ != nullptr)
+    {
+        libusb_dev_mem_free(dma_handle_, const_cast<uint8_t *>(frame_buffer_), buffer_size_);
+    }
+    else if (heap_buffer_)
+    {
+        delete [] frame_buffer_;
+    }
+}
+
+bool Frame::isDma() const
+{
+    return dma_handle_ != nullptr;
+}
+
+size_t Frame::imageSizeBytes() const
+{
+    return (size_t)metadata_.width * metadata_.height * metadata_.bytes_per_pixel;
 }
 
-void Frame::incrRefCount()
+size_t Frame::bufferSizeBytes() const
 {
-    // Assume this Frame object has already been removed from the unused frame deque
-    ref_count_++;
+    return buffer_size_;
 }
 
-void Frame::decrRefCount()
+Pipeline &Frame::pipeline() const
 {
-    // Ensure this function is reentrant
-    std::lock_guard<std::mutex> lock(decr_mutex_);
+    return *pipeline_;
+}
 
-    if (ref_count_ <= 0)
+int Frame::refCount() const
+{
+    return ref_count_.load(std::memory_order_relaxed);
+}
+
+std::string Frame::holders() const
+{
+    std::string list;
+#ifndef NDEBUG
+    std::lock_guard<std::mutex> lock(holders_mutex_);
+    for (auto holder : holders_)
     {
-        spdlog::critical("Frame.decrRefCount called on Frame where ref_count_ was already zero!");
+        list += (list.empty() ? "" : ", ") + std::string(holder);
+    }
+#endif
+    return list;
+}
+
+void Frame::incrRefCount(const char *holder)
+{
+    int previous = ref_count_.fetch_add(1, std::memory_order_relaxed);
+    trace::frame(
+        (previous == 0) ? trace::Kind::FRAME_TAKEN : trace::Kind::FRAME_SHARED,
+        holder,
+        this
+    );
+#ifndef NDEBUG
+    std::lock_guard<std::mutex> lock(holders_mutex_);
+    holders_.push_back(holder);
+#endif
+}
+
+void Frame::decrRefCount(const char *holder)
+{
+#ifndef NDEBUG
+    std::unique_lock<std::mutex> lock(holders_mutex_);
+    auto it = std::find(holders_.begin(), holders_.end(), holder);
+    if (it == holders_.end())
+    {
+        lock.unlock();
+        spdlog::critical(
+            "Frame released by '{}', which holds no reference to it (holders: {}).",
+            holder,
+            holders()
+        );
         exit(1);
     }
+    holders_.erase(it);
+    lock.unlock();
+#endif
 
-    ref_count_--;
+    // acq_rel so that everything the releasing threads did with the frame happens before it is
+    // handed out again
+    int previous = ref_count_.fetch_sub(1, std::memory_order_acq_rel);
+    if (previous <= 0)
+    {
+        spdlog::critical("Frame released by '{}' when its reference count was already zero!", holder);
+        exit(1);
+    }
+    trace::frame(
+        (previous == 1) ? trace::Kind::FRAME_RETURNED : trace::Kind::FRAME_RELEASED,
+        holder,
+        this
+    );
+    if (previous == 1)
+    {
+        // Cannot fail: the ring has room for every frame in the pool
+        pipeline_->unused_ring.push(this);
+    }
+}
 
-    if (ref_count_ == 0)
+void Frame::changeHolder(const char *from, const char *to)
+{
+    trace::frame(trace::Kind::FRAME_HOLDER, to, this);
+#ifndef NDEBUG
+    std::lock_guard<std::mutex> lock(holders_mutex_);
+    auto it = std::find(holders_.begin(), holders_.end(), from);
+    if (it != holders_.end())
     {
-        std::unique_lock<std::mutex> unused_deque_lock(unused_deque_mutex);
-        unused_deque.push_front(this);
-        unused_deque_lock.unlock();
-        unused_deque_cv.notify_one();
+        *it = to;
     }
+#endif
 }
 
-uint16_t Frame::syncStart()
+
+FrameRef::FrameRef(Frame *frame, const char *holder) :
+    frame_(frame),
+    holder_(holder)
 {
-    // Return first two bytes of the frame buffer
-    return (frame_buffer_[0] << 8) | frame_buffer_[1];
+    frame_->incrRefCount(holder_);
 }
 
-uint16_t Frame::syncEnd()
+FrameRef::FrameRef(FrameRef &&other) noexcept :
+    frame_(other.frame_),
+    holder_(other.holder_)
 {
-    // Return last two bytes of the frame buffer
-    return (frame_buffer_[IMAGE_SIZE_BYTES - 2] << 8) | frame_buffer_[IMAGE_SIZE_BYTES - 1];
+    other.frame_ = nullptr;
 }
 
-uint16_t Frame::frameIndex()
+FrameRef &FrameRef::operator=(FrameRef &&other) noexcept
 {
-    // Return third and fourth bytes of the frame buffer
-    return (frame_buffer_[3] << 8) | frame_buffer_[2];
+    if (this != &other)
+    {
+        reset();
+        frame_ = other.frame_;
+        holder_ = other.holder_;
+        other.frame_ = nullptr;
+    }
+    return *this;
 }
 
-bool Frame::validate()
+FrameRef FrameRef::share(const char *holder) const
 {
-    // Valid frames from ASI178 cameras always start and end with these 16-bit values
-    constexpr uint16_t SYNC_START = 0x7e5a;
-    constexpr uint16_t SYNC_END = 0xf03c;
+    return FrameRef(frame_, holder);
+}
+
+void FrameRef::reset()
+{
+    if (frame_ != nullptr)
+    {
+        Frame *frame = frame_;
+        frame_ = nullptr;
+        frame->decrRefCount(holder_);
+    }
+}
 
-    auto sync_start = syncStart();
-    auto sync_end = syncEnd();
+void FrameRef::setHolder(const char *holder)
+{
+    if (frame_ != nullptr)
+    {
+        frame_->changeHolder(holder_, holder);
+    }
+    holder_ = holder;
+}
+
+void FrameRef::leak()
+{
+    frame_ = nullptr;
+}
+
+uint16_t Frame::syncStart(const CameraModel &model)
+{
+    // Return big-endian 16-bit word at the start of the frame buffer
+    size_t offset = model.sync_start_offset;
+    return (frame_buffer_[offset] << 8) | frame_buffer_[offset + 1];
+}
+
+uint16_t Frame::syncEnd(const CameraModel &model)
+{
+    // Return last two bytes of the image
+    size_t size = imageSizeBytes();
+    return (frame_buffer_[size - 2] << 8) | frame_buffer_[size - 1];
+}
+
+uint16_t Frame::frameIndex(const CameraModel &model)
+{
+    // Return little-endian 16-bit frame counter from the frame header
+    size_t offset = model.index_offset;
+    return (frame_buffer_[offset + 1] << 8) | frame_buffer_[offset];
+}
+
+bool Frame::validate(const CameraModel &model)
+{
+    // Valid frames always start and end with the sync words for this camera model
+    auto sync_start = syncStart(model);
+    auto sync_end = syncEnd(model);
 
-    if ((sync_start == SYNC_START) && (sync_end == SYNC_END)) {
+    if ((sync_start == model.sync_start) && (sync_end == model.sync_end)) {
         return true;
     }
 
-    spdlog::error(
+    RTLOG_ERROR(
+        spdlog::default_logger_raw(),
         "Bad frame. Started with 0x{:04x} (expected 0x{:04x}) and ended with 0x{:04x} (expected 0x{:04x}).",
         sync_start,
-        SYNC_START,
+        model.sync_start,
         sync_end,
-        SYNC_END);
+        model.sync_end);
     return false;
 }
@@ -0,0 +1,168 @@
+#include "FrameArena.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+
+
+// The mapping is aligned to this so that it can be backed by hugepages on x86-64 and aarch64.
+// Hugepages back the mapping as a whole, so buffers within it need no such alignment.
+constexpr size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+// Buffers start on page boundaries, which suits mlock(), O_DIRECT and cache lines alike
+constexpr size_t BUFFER_ALIGN = 4096;
+
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+
+FrameArena::FrameArena(size_t max_buffers, size_t buffer_size, bool hugepages) :
+    buffer_size_(buffer_size),
+    stride_(round_up(buffer_size, BUFFER_ALIGN)),
+    max_buffers_(max_buffers),
+    page_size_(sysconf(_SC_PAGESIZE))
+{
+    // hugetlb mappings must be a whole number of hugepages
+    const size_t length = round_up(stride_ * max_buffers_, HUGEPAGE_SIZE);
+    if (length == 0)
+    {
+        return;
+    }
+
+    if (hugepages)
+    {
+        // Fails unless enough hugepages are reserved in /proc/sys/vm/nr_hugepages
+        void *addr = mmap(
+            nullptr,
+            length,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+            -1,
+            0
+        );
+        if (addr != MAP_FAILED)
+        {
+            base_ = static_cast<uint8_t *>(addr);
+            hugetlb_ = true;
+            page_size_ = HUGEPAGE_SIZE;
+        }
+        else
+        {
+            char buf[256];
+            spdlog::warn(
+                "Could not map {} MiB of hugetlb pages for frame buffers ({}); using ordinary "
+                "pages. Raising /proc/sys/vm/nr_hugepages may help.",
+                length >> 20,
+                strerror_r(errno, buf, sizeof(buf))
+            );
+        }
+    }
+
+    if (base_ == nullptr)
+    {
+        // Over-allocate so the start can be moved up to a hugepage boundary, then give back the
+        // slack at either end
+        const size_t padded_length = length + HUGEPAGE_SIZE;
+        void *addr = mmap(
+            nullptr,
+            padded_length,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0
+        );
+        if (addr == MAP_FAILED)
+        {
+            char buf[256];
+            spdlog::critical(
+                "Could not map {} MiB for frame buffers: {}",
+                length >> 20,
+                strerror_r(errno, buf, sizeof(buf))
+            );
+            exit(1);
+        }
+        uint8_t *start = static_cast<uint8_t *>(addr);
+        base_ = reinterpret_cast<uint8_t *>(
+            round_up(reinterpret_cast<uintptr_t>(start), HUGEPAGE_SIZE)
+        );
+        if (base_ > start)
+        {
+            munmap(start, base_ - start);
+        }
+        size_t tail = (start + padded_length) - (base_ + length);
+        if (tail > 0)
+        {
+            munmap(base_ + length, tail);
+        }
+
+        // Only a hint: the kernel may still use small pages if THP is disabled or memory is
+        // fragmented
+        if (hugepages)
+        {
+            thp_ = (madvise(base_, length, MADV_HUGEPAGE) == 0);
+        }
+    }
+
+    mapped_length_ = length;
+}
+
+FrameArena::~FrameArena()
+{
+    if (mapped_length_ > 0)
+    {
+        munmap(base_, mapped_length_);
+    }
+}
+
+uint8_t *FrameArena::take()
+{
+    if (taken_ >= max_buffers_ || (taken_ + 1) * stride_ > mapped_length_)
+    {
+        return nullptr;
+    }
+    uint8_t *buffer = base_ + taken_ * stride_;
+
+    // Usually fails for lack of CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK. Only the first
+    // failure is reported.
+    if (mlock(buffer, stride_) != 0 && locked_)
+    {
+        char buf[256];
+        spdlog::warn(
+            "mlock of frame buffers failed ({}); they may be paged out. Raising the memlock limit "
+            "(ulimit -l) may help.",
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        locked_ = false;
+    }
+
+    // mlock() faults the pages in, but not if it failed. Write rather than read: a read fault
+    // would only map the shared zero page. A buffer need not start on a hugepage, so the last byte
+    // is written too in case it lies on a page the stride skips over.
+    for (size_t offset = 0; offset < buffer_size_; offset += page_size_)
+    {
+        static_cast<volatile uint8_t *>(buffer)[offset] = 0;
+    }
+    if (buffer_size_ > 0)
+    {
+        static_cast<volatile uint8_t *>(buffer)[buffer_size_ - 1] = 0;
+    }
+
+    taken_++;
+    return buffer;
+}
+
+void FrameArena::trim()
+{
+    // Only whole pages can be unmapped, and hugetlb pages are 2 MiB
+    const size_t used = round_up(taken_ * stride_, page_size_);
+    if (mapped_length_ > used)
+    {
+        munmap(base_ + used, mapped_length_ - used);
+        mapped_length_ = used;
+    }
+}
@@ -0,0 +1,56 @@
+#include "Pipeline.h"
+#include <cstring>
+
+
+Pipeline::Pipeline(int index, size_t frame_pool_max) :
+    index(index),
+    log(spdlog::default_logger()->clone("cam" + std::to_string(index))),
+    to_disk_ring(frame_pool_max),
+    to_agc_ring(frame_pool_max),
+    to_record_ring(frame_pool_max),
+    to_preview_ring(1, &preview_doorbell),
+    unused_ring(frame_pool_max)
+{
+    memset(&CamInfo, 0, sizeof(CamInfo));
+}
+
+void Pipeline::notifyAll()
+{
+    to_disk_ring.notify();
+    to_agc_ring.notify();
+    to_record_ring.notify();
+    to_preview_ring.notify();
+    unused_ring.notify();
+    control_cv.notify_all();
+}
+
+void Pipeline::releaseFrames()
+{
+    FrameRef frame;
+    while (to_disk_ring.pop(frame)) {}
+    while (to_agc_ring.pop(frame)) {}
+    while (to_record_ring.pop(frame)) {}
+    while (to_preview_ring.pop(frame)) {}
+    frame.reset();
+
+    size_t leaked = 0;
+    for (const auto &f : frames)
+    {
+        if (f.refCount() != 0)
+        {
+            leaked++;
+            log->warn(
+                "Frame still has {} references at shutdown. Holders: {}",
+                f.refCount(),
+                f.holders().empty() ? "(only tracked in debug builds)" : f.holders()
+            );
+        }
+    }
+    if (leaked > 0)
+    {
+        log->error("{} of {} frames never returned to the pool.", leaked, frames.size());
+    }
+
+    frames.clear();
+    frame_arena.reset();
+}
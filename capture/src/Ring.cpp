@@ -0,0 +1,18 @@
+#include "Ring.h"
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+void Doorbell::futexWait(uint32_t seq)
+{
+    // Returns immediately (EAGAIN) if seq_ has already moved on; spurious wakeups are fine since
+    // wait() re-checks its predicate
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq_), FUTEX_WAIT_PRIVATE, seq, nullptr);
+}
+
+void Doorbell::futexWakeAll()
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq_), FUTEX_WAKE_PRIVATE, INT_MAX);
+}
@@ -1,12 +1,36 @@
 #include "SERFile.h"
+#include "trace.h"
+#include "UringWriter.h"
 #include <bsd/string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <chrono>
 #include <err.h>
 #include <spdlog/spdlog.h>
 
 
+// O_DIRECT transfers must start at offsets and addresses that are multiples of the device's
+// logical block size and cover whole blocks. 4096 suits both 512-byte and 4K-sector devices.
+constexpr size_t DIRECT_IO_ALIGN = 4096;
+
+// Disk space is reserved ahead of the frames in chunks of this size, so that the filesystem
+// allocates extents a few times per minute instead of on every write
+constexpr int64_t PREALLOCATE_CHUNK_BYTES = 512 << 20;
+
+// Frame timestamps are stored in a side file as they arrive, through a mapped window of this size
+// that moves along the file (a window holds 131072 timestamps, over ten minutes at 200 FPS)
+constexpr size_t TIMESTAMP_WINDOW_BYTES = 1 << 20;
+constexpr size_t TIMESTAMP_WINDOW_ENTRIES = TIMESTAMP_WINDOW_BYTES / sizeof(int64_t);
+
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+
 SERFile::SERFile(
     const char *filename,
     int32_t width,
@@ -16,19 +40,37 @@ SERFile::SERFile(
     const char *observer,
     const char *instrument,
     const char *telescope,
-    bool add_trailer
+    bool add_trailer,
+    bool direct_io
 ) :
     FILENAME(filename),
     UTC_OFFSET_S(utcOffset()),
-    add_trailer_(add_trailer)
+    add_trailer_(add_trailer),
+    writer_(nullptr),
+    direct_io_(direct_io),
+    segment_stem_(filename),
+    segment_number_(0)
 {
+    if (segment_stem_.size() > 4 &&
+        strcasecmp(segment_stem_.c_str() + segment_stem_.size() - 4, ".ser") == 0)
+    {
+        segment_stem_.resize(segment_stem_.size() - 4);
+    }
+
     bytes_per_frame_ = width * height * ((bit_depth - 1) / 8 + 1);
     if (color_id == RGB || color_id == BGR)
     {
         bytes_per_frame_ *= 3;
     }
 
-    fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC | (direct_io_ ? O_DIRECT : 0), 0644);
+    if (fd_ < 0 && direct_io_ && errno == EINVAL)
+    {
+        // Some filesystems (tmpfs for one) don't do direct I/O
+        spdlog::warn("{} can't be opened with O_DIRECT; writing through the page cache.", filename);
+        direct_io_ = false;
+        fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
     if (fd_ < 0)
     {
         char buf[256];
@@ -36,45 +78,67 @@ SERFile::SERFile(
         exit(1);
     }
 
-    // Extend file size to length of header
-    if (ftruncate(fd_, sizeof(SERHeader_t)))
+    if (direct_io_)
     {
-        char buf[256];
-        spdlog::critical(
-            "Could not extend file to make room for SER header: {}",
-            strerror_r(errno, buf, sizeof(buf))
-        );
-        exit(1);
+        /*
+         * The 178-byte header puts every frame at an unaligned offset, so frames can't be written
+         * straight from their buffers. Instead the file is assembled in an aligned staging buffer
+         * and written out in whole blocks; the few bytes of a block that isn't full yet wait there
+         * for the next frame. The header is kept in memory and written into the first block when
+         * the file is closed.
+         */
+        stage_capacity_ = round_up(bytes_per_frame_, DIRECT_IO_ALIGN) + DIRECT_IO_ALIGN;
+        stage_ = (uint8_t *)aligned_alloc(DIRECT_IO_ALIGN, stage_capacity_);
+        first_block_ = (uint8_t *)aligned_alloc(DIRECT_IO_ALIGN, DIRECT_IO_ALIGN);
+        header_ = (SERHeader_t *)malloc(sizeof(SERHeader_t));
+        if (stage_ == nullptr || first_block_ == nullptr || header_ == nullptr)
+        {
+            spdlog::critical("Could not allocate O_DIRECT staging buffer for {}", filename);
+            exit(1);
+        }
     }
-
-    // Reposition file descriptor offset past header
-    if (lseek(fd_, 0, SEEK_END) < 0)
+    else
     {
-        char buf[256];
-        spdlog::critical(
-            "Could not seek past header in SER file: {}",
-            strerror_r(errno, buf, sizeof(buf))
-        );
-        exit(1);
-    }
+        // Extend file size to length of header
+        if (ftruncate(fd_, sizeof(SERHeader_t)))
+        {
+            char buf[256];
+            spdlog::critical(
+                "Could not extend file to make room for SER header: {}",
+                strerror_r(errno, buf, sizeof(buf))
+            );
+            exit(1);
+        }
 
-    // Map the header portion of the file into memory
-    header_ = (SERHeader_t *)mmap(
-        0,
-        sizeof(SERHeader_t),
-        PROT_READ | PROT_WRITE,
-        MAP_SHARED,
-        fd_,
-        0
-    );
-    if (header_ == MAP_FAILED)
-    {
-        char buf[256];
-        spdlog::critical(
-            "mmap for SERFile header failed: {}",
-            strerror_r(errno, buf, sizeof(buf))
+        // Reposition file descriptor offset past header
+        if (lseek(fd_, 0, SEEK_END) < 0)
+        {
+            char buf[256];
+            spdlog::critical(
+                "Could not seek past header in SER file: {}",
+                strerror_r(errno, buf, sizeof(buf))
+            );
+            exit(1);
+        }
+
+        // Map the header portion of the file into memory
+        header_ = (SERHeader_t *)mmap(
+            0,
+            sizeof(SERHeader_t),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd_,
+            0
         );
-        exit(1);
+        if (header_ == MAP_FAILED)
+        {
+            char buf[256];
+            spdlog::critical(
+                "mmap for SERFile header failed: {}",
+                strerror_r(errno, buf, sizeof(buf))
+            );
+            exit(1);
+        }
     }
 
     // Use placement new operator to init header to defaults in struct definition
@@ -85,16 +149,53 @@ SERFile::SERFile(
     header_->ImageHeight = height;
     header_->ColorID = color_id;
     header_->PixelDepthPerPlane = bit_depth;
+
+    // Frames are written in the byte order they arrive in from the camera, which for 16-bit data
+    // is little-endian
+    header_->LittleEndian = (bit_depth > 8) ? 1 : 0;
     strlcpy(header_->Observer, observer, 40);
     strlcpy(header_->Instrument, instrument, 40);
     strlcpy(header_->Telescope, telescope, 40);
     auto [utc, local] = makeTimestamps();
     header_->DateTime_UTC = utc;
     header_->DateTime = local;
+
+    if (direct_io_)
+    {
+        // Reserves the header's place in the file; the final header replaces it at close
+        stage(header_, sizeof(SERHeader_t));
+    }
+
+    if (add_trailer_)
+    {
+        /*
+         * Rather than collecting the timestamps in memory until the trailer is written at close,
+         * which takes ever more memory and loses them all if the program dies, they go straight to
+         * a file next to the SER file. Once the trailer is written the side file is deleted;
+         * ser_recover uses it to finish a SER file that was never closed.
+         */
+        timestamps_fd_ = open(timestampsFilename().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (timestamps_fd_ < 0)
+        {
+            char buf[256];
+            spdlog::critical(
+                "open({}) failed: {}",
+                timestampsFilename(),
+                strerror_r(errno, buf, sizeof(buf))
+            );
+            exit(1);
+        }
+        mapTimestampWindow(0);
+    }
 }
 
 SERFile::~SERFile()
 {
+    if (writer_ != nullptr)
+    {
+        writer_->drain();
+    }
+
     if (header_->FrameCount == 0)
     {
         spdlog::info("Deleting {} since no frames were written to it.", FILENAME);
@@ -111,47 +212,222 @@ SERFile::~SERFile()
         return;
     }
 
+    int64_t file_size = dataEnd();
     if (add_trailer_)
     {
-        if (header_->FrameCount != static_cast<int32_t>(frame_timestamps_.size()))
+        file_size += sizeof(int64_t) * timestamps_count_;
+        writeTrailer();
+    }
+
+    if (direct_io_)
+    {
+        finishDirectIo();
+    }
+    releasePreallocation(file_size);
+
+    closeFile();
+}
+
+void SERFile::preallocate(int64_t end)
+{
+    while (preallocate_ && end > preallocated_end_)
+    {
+        // FALLOC_FL_KEEP_SIZE: the file still ends after the last frame if we crash
+        if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, preallocated_end_, PREALLOCATE_CHUNK_BYTES) != 0)
         {
-            auto frame_count = header_->FrameCount;
-            spdlog::error("SERFile class frame count {} does not match timestamp vector size {}",
-                frame_count,
-                frame_timestamps_.size()
+            char buf[256];
+            spdlog::warn(
+                "Could not preallocate space for {} ({}); the filesystem will allocate it as "
+                "frames are written.",
+                FILENAME,
+                strerror_r(errno, buf, sizeof(buf))
             );
+            preallocate_ = false;
+            return;
         }
+        preallocated_end_ += PREALLOCATE_CHUNK_BYTES;
+    }
+}
+
+void SERFile::releasePreallocation(int64_t file_size)
+{
+    if (preallocated_end_ <= file_size)
+    {
+        return;
+    }
+    // Truncating frees blocks past the end even when the size doesn't change (punching a hole
+    // there doesn't on ext4)
+    if (ftruncate(fd_, file_size) != 0)
+    {
+        char buf[256];
+        spdlog::warn(
+            "Could not give back space preallocated past the end of {}: {}",
+            FILENAME,
+            strerror_r(errno, buf, sizeof(buf))
+        );
+    }
+}
+
+void SERFile::setWriteback(int64_t chunk_bytes)
+{
+    writeback_chunk_ = direct_io_ ? 0 : chunk_bytes;
+}
 
-        size_t trailer_len_bytes = sizeof(int64_t) * frame_timestamps_.size();
-        ssize_t n = write(fd_, frame_timestamps_.data(), trailer_len_bytes);
-        if (n < 0)
+void SERFile::paceWriteback()
+{
+    // A chunk isn't handed over until the frames have filled the one after it as well, so that
+    // writes still in flight through writer_ are long finished by the time it is
+    while (writeback_chunk_ > 0 && dataEnd() - writeback_end_ >= 2 * writeback_chunk_)
+    {
+        if (sync_file_range(fd_, writeback_end_, writeback_chunk_, SYNC_FILE_RANGE_WRITE) != 0)
         {
             char buf[256];
-            spdlog::critical(
-                "SER file trailer write failed: {}",
+            spdlog::warn(
+                "sync_file_range on {} failed ({}); leaving writeback to the kernel.",
+                FILENAME,
                 strerror_r(errno, buf, sizeof(buf))
             );
-            exit(1);
+            writeback_chunk_ = 0;
+            return;
         }
-        else if (n != static_cast<ssize_t>(trailer_len_bytes))
+
+        // Normally the previous chunk reached the disk while this one was filling, so the wait is
+        // short; if the disk is falling behind it is what keeps the dirty pages in check
+        if (writeback_end_ >= writeback_chunk_)
+        {
+            const int64_t previous = writeback_end_ - writeback_chunk_;
+            (void)sync_file_range(
+                fd_,
+                previous,
+                writeback_chunk_,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+            );
+
+            // Frames are never read back, so there's no point in them taking up the page cache
+            (void)posix_fadvise(fd_, previous, writeback_chunk_, POSIX_FADV_DONTNEED);
+        }
+        writeback_end_ += writeback_chunk_;
+    }
+}
+
+void SERFile::releaseWriter()
+{
+    if (writer_ != nullptr)
+    {
+        writer_->drain();
+        writer_ = nullptr;
+    }
+}
+
+void SERFile::writeTrailer()
+{
+    // Read back through a buffer the size of the window: its mapping is only good for the last
+    // part of the side file
+    std::vector<int64_t> buffer(TIMESTAMP_WINDOW_ENTRIES);
+
+    // Frames written through writer_ don't move the file offset, so place the trailer explicitly
+    const int64_t trailer_offset = dataEnd();
+    for (size_t first = 0; first < timestamps_count_; first += TIMESTAMP_WINDOW_ENTRIES)
+    {
+        size_t length = sizeof(int64_t) *
+            std::min(TIMESTAMP_WINDOW_ENTRIES, timestamps_count_ - first);
+        ssize_t n = pread(timestamps_fd_, buffer.data(), length, sizeof(int64_t) * first);
+        if (n != static_cast<ssize_t>(length))
         {
             char buf[256];
             spdlog::critical(
-                "SER file trailer write incomplete ({}/{}): {}",
-                n,
-                trailer_len_bytes,
-                strerror_r(errno, buf, sizeof(buf))
+                "Reading back timestamps from {} failed: {}",
+                timestampsFilename(),
+                (n < 0) ? strerror_r(errno, buf, sizeof(buf)) : "short read"
             );
             exit(1);
         }
+
+        if (direct_io_)
+        {
+            stage(buffer.data(), length);
+        }
+        else
+        {
+            writeAt(buffer.data(), length, trailer_offset + sizeof(int64_t) * first);
+        }
     }
+}
 
-    closeFile();
+void SERFile::mapTimestampWindow(size_t first)
+{
+    if (timestamps_ != nullptr)
+    {
+        munmap(timestamps_, TIMESTAMP_WINDOW_BYTES);
+    }
+
+    // Allocate the blocks rather than just extending the file so that a store to the mapping
+    // can't fail (with SIGBUS) for lack of disk space
+    const off_t offset = sizeof(int64_t) * first;
+    if (fallocate(timestamps_fd_, 0, offset, TIMESTAMP_WINDOW_BYTES) != 0 &&
+        (errno != EOPNOTSUPP || ftruncate(timestamps_fd_, offset + TIMESTAMP_WINDOW_BYTES) != 0))
+    {
+        char buf[256];
+        spdlog::critical(
+            "Could not extend {}: {}",
+            timestampsFilename(),
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        exit(1);
+    }
+
+    void *addr = mmap(
+        nullptr,
+        TIMESTAMP_WINDOW_BYTES,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        timestamps_fd_,
+        offset
+    );
+    if (addr == MAP_FAILED)
+    {
+        char buf[256];
+        spdlog::critical(
+            "mmap of {} failed: {}",
+            timestampsFilename(),
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        exit(1);
+    }
+    timestamps_ = static_cast<int64_t *>(addr);
+    timestamps_window_start_ = first;
+}
+
+std::string SERFile::timestampsFilename() const
+{
+    return FILENAME + ".timestamps";
 }
 
 void SERFile::closeFile()
 {
-    if (munmap(header_, sizeof(SERHeader_t)))
+    // By now the timestamps are in the trailer, or the file is being deleted
+    if (timestamps_fd_ >= 0)
+    {
+        munmap(timestamps_, TIMESTAMP_WINDOW_BYTES);
+        (void)close(timestamps_fd_);
+        if (unlink(timestampsFilename().c_str()))
+        {
+            char buf[256];
+            spdlog::error(
+                "Unable to delete {}: {}",
+                timestampsFilename(),
+                strerror_r(errno, buf, sizeof(buf))
+            );
+        }
+    }
+
+    if (direct_io_)
+    {
+        free(header_);
+        free(stage_);
+        free(first_block_);
+    }
+    else if (munmap(header_, sizeof(SERHeader_t)))
     {
         char buf[256];
         spdlog::critical(
@@ -163,26 +439,140 @@ void SERFile::closeFile()
     (void)close(fd_);
 }
 
-void SERFile::addFrame(Frame &frame)
+void SERFile::stage(const void *data, size_t length)
 {
-    if (bytes_per_frame_ != Frame::IMAGE_SIZE_BYTES)
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (length > 0)
+    {
+        size_t n = std::min(length, stage_capacity_ - staged_);
+        memcpy(stage_ + staged_, bytes, n);
+        staged_ += n;
+        bytes += n;
+        length -= n;
+        if (staged_ == stage_capacity_)
+        {
+            flushStage(false);
+        }
+    }
+}
+
+void SERFile::flushStage(bool pad)
+{
+    size_t length = pad ?
+        round_up(staged_, DIRECT_IO_ALIGN) :
+        staged_ / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    if (length == 0)
+    {
+        return;
+    }
+    memset(stage_ + staged_, 0, length - std::min(length, staged_));
+
+    // Kept so the final header can be written over it
+    if (stage_offset_ == 0)
+    {
+        memcpy(first_block_, stage_, DIRECT_IO_ALIGN);
+    }
+
+    writeAt(stage_, length, stage_offset_);
+
+    size_t remainder = staged_ - std::min(length, staged_);
+    memmove(stage_, stage_ + length, remainder);
+    staged_ = remainder;
+    stage_offset_ += length;
+}
+
+void SERFile::finishDirectIo()
+{
+    // Whatever is still staged goes out padded to a whole block and the padding is cut off again
+    int64_t file_size = stage_offset_ + staged_;
+    if (stage_offset_ == 0)
+    {
+        memcpy(stage_, header_, sizeof(SERHeader_t));
+    }
+    else
+    {
+        memcpy(first_block_, header_, sizeof(SERHeader_t));
+        writeAt(first_block_, DIRECT_IO_ALIGN, 0);
+    }
+    flushStage(true);
+    if (ftruncate(fd_, file_size))
+    {
+        char buf[256];
+        spdlog::critical(
+            "Could not trim padding from end of {}: {}",
+            FILENAME,
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        exit(1);
+    }
+}
+
+void SERFile::writeAt(const void *data, size_t length, int64_t offset)
+{
+    ssize_t n = pwrite(fd_, data, length, offset);
+    if (n < 0)
+    {
+        char buf[256];
+        spdlog::critical(
+            "write failed: {}",
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        exit(1);
+    }
+    else if (n != static_cast<ssize_t>(length))
+    {
+        spdlog::critical("write incomplete ({}/{})", n, length);
+        exit(1);
+    }
+}
+
+void SERFile::addFrame(FrameRef frame)
+{
+    trace::Span span("write frame", frame.get());
+    if (bytes_per_frame_ != frame->imageSizeBytes())
     {
         spdlog::error(
             "frame size {} bytes does not match expected size {} bytes",
-            Frame::IMAGE_SIZE_BYTES,
+            frame->imageSizeBytes(),
             bytes_per_frame_
         );
         exit(1);
     }
 
+    // With direct I/O up to a block more than the frame may be written past the data
+    preallocate(dataEnd() + bytes_per_frame_ + (direct_io_ ? DIRECT_IO_ALIGN : 0));
+
     if (add_trailer_)
     {
+        // Use the time the frame arrived from the camera, not the time it reached the disk thread
         int64_t utc_timestamp;
-        std::tie(utc_timestamp, std::ignore) = makeTimestamps();
-        frame_timestamps_.push_back(utc_timestamp);
+        std::tie(utc_timestamp, std::ignore) = makeTimestamps(frame->metadata_.utc_ns);
+        if (timestamps_count_ - timestamps_window_start_ == TIMESTAMP_WINDOW_ENTRIES)
+        {
+            mapTimestampWindow(timestamps_count_);
+        }
+        timestamps_[timestamps_count_ - timestamps_window_start_] = utc_timestamp;
+        timestamps_count_++;
     }
 
-    ssize_t n = write(fd_, frame.frame_buffer_, bytes_per_frame_);
+    if (direct_io_)
+    {
+        stage(frame->frame_buffer_, bytes_per_frame_);
+        flushStage(false);
+        header_->FrameCount++;
+        return;
+    }
+
+    if (writer_ != nullptr)
+    {
+        // Every frame's position is known up front, so writes may complete in any order
+        writer_->write(fd_, std::move(frame), bytes_per_frame_, dataEnd());
+        header_->FrameCount++;
+        paceWriteback();
+        return;
+    }
+
+    ssize_t n = write(fd_, frame->frame_buffer_, bytes_per_frame_);
     if (n < 0)
     {
         char buf[256];
@@ -205,6 +595,58 @@ void SERFile::addFrame(Frame &frame)
     }
 
     header_->FrameCount++;
+    paceWriteback();
+}
+
+void SERFile::setWriter(UringWriter *writer)
+{
+    writer_ = writer;
+}
+
+int64_t SERFile::dataEnd() const
+{
+    return sizeof(SERHeader_t) + (int64_t)header_->FrameCount * bytes_per_frame_;
+}
+
+int32_t SERFile::imageWidth() const
+{
+    return header_->ImageWidth;
+}
+
+int32_t SERFile::imageHeight() const
+{
+    return header_->ImageHeight;
+}
+
+std::unique_ptr<SERFile> SERFile::nextSegment(int32_t width, int32_t height) const
+{
+    int number = segment_number_;
+    std::string filename;
+    do
+    {
+        number++;
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%03d.ser", number);
+        filename = segment_stem_ + suffix;
+    } while (access(filename.c_str(), F_OK) == 0);
+
+    std::unique_ptr<SERFile> next(new SERFile(
+        filename.c_str(),
+        width,
+        height,
+        header_->ColorID,
+        header_->PixelDepthPerPlane,
+        header_->Observer,
+        header_->Instrument,
+        header_->Telescope,
+        add_trailer_,
+        direct_io_
+    ));
+    next->writer_ = writer_;
+    next->writeback_chunk_ = writeback_chunk_;
+    next->segment_stem_ = segment_stem_;
+    next->segment_number_ = number;
+    return next;
 }
 
 int64_t SERFile::utcOffset()
@@ -227,6 +669,12 @@ SERFile::TimestampPair_t SERFile::makeTimestamps()
 {
     using namespace std::chrono;
 
+    system_clock::time_point now = system_clock::now();
+    return makeTimestamps(duration_cast<nanoseconds>(now.time_since_epoch()).count());
+}
+
+SERFile::TimestampPair_t SERFile::makeTimestamps(int64_t utc_ns)
+{
     /*
      * Number of ticks from the Visual Basic Date data type to the Unix time epoch. The
      * VB Date type is the number of "ticks" since Jan 1, year 0001 in the Gregorian calendar,
@@ -235,10 +683,7 @@ SERFile::TimestampPair_t SERFile::makeTimestamps()
     constexpr int64_t VB_DATE_TICKS_TO_UNIX_EPOCH = 621'355'968'000'000'000LL;
     constexpr int64_t VB_DATE_TICKS_PER_SEC = 10'000'000LL;
 
-    system_clock::time_point now = system_clock::now();
-    int64_t ns_since_epoch = duration_cast<nanoseconds>(now.time_since_epoch()).count();
-
-    int64_t utc_tick = (ns_since_epoch / 100) + VB_DATE_TICKS_TO_UNIX_EPOCH;
+    int64_t utc_tick = (utc_ns / 100) + VB_DATE_TICKS_TO_UNIX_EPOCH;
     int64_t local_tick = utc_tick + UTC_OFFSET_S * VB_DATE_TICKS_PER_SEC;
 
     return TimestampPair_t(utc_tick, local_tick);
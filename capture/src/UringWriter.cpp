@@ -0,0 +1,202 @@
+#include "UringWriter.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include "Pipeline.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+
+std::unique_ptr<UringWriter> UringWriter::create(Pipeline &pipeline, unsigned depth)
+{
+    std::unique_ptr<io_uring> ring(new io_uring);
+    int ret = io_uring_queue_init(depth, ring.get(), 0);
+    if (ret < 0)
+    {
+        char buf[256];
+        pipeline.log->warn(
+            "io_uring is not available ({}); writing frames with write().",
+            strerror_r(-ret, buf, sizeof(buf))
+        );
+        return nullptr;
+    }
+    return std::unique_ptr<UringWriter>(new UringWriter(pipeline, std::move(ring), depth));
+}
+
+UringWriter::UringWriter(Pipeline &pipeline, std::unique_ptr<io_uring> ring, unsigned depth) :
+    log_(pipeline.log),
+    ring_(std::move(ring)),
+    slots_(depth)
+{
+    for (unsigned i = depth; i > 0; i--)
+    {
+        free_slots_.push_back(i - 1);
+    }
+
+    // usbfs DMA memory is mapped from the device and can't be pinned by io_uring
+    std::vector<iovec> iovecs;
+    std::vector<const Frame *> registered;
+    for (const auto &frame : pipeline.frames)
+    {
+        if (!frame.isDma())
+        {
+            iovecs.push_back({const_cast<uint8_t *>(frame.frame_buffer_), frame.bufferSizeBytes()});
+            registered.push_back(&frame);
+        }
+    }
+    if (!iovecs.empty())
+    {
+        int ret = io_uring_register_buffers(ring_.get(), iovecs.data(), iovecs.size());
+        if (ret < 0)
+        {
+            // Typically the memlock limit is too small for the pool
+            char buf[256];
+            log_->warn(
+                "Could not register frame buffers with io_uring ({}); writes will pin them each "
+                "time.",
+                strerror_r(-ret, buf, sizeof(buf))
+            );
+        }
+        else
+        {
+            for (size_t i = 0; i < registered.size(); i++)
+            {
+                fixed_buffers_[registered[i]] = i;
+            }
+        }
+    }
+
+    log_->info(
+        "Writing frames with io_uring, up to {} in flight; {} of {} frame buffers registered.",
+        depth,
+        fixed_buffers_.size(),
+        pipeline.frames.size()
+    );
+}
+
+UringWriter::~UringWriter()
+{
+    drain();
+    if (!fixed_buffers_.empty())
+    {
+        io_uring_unregister_buffers(ring_.get());
+    }
+    io_uring_queue_exit(ring_.get());
+}
+
+void UringWriter::write(int fd, FrameRef frame, size_t length, int64_t offset)
+{
+    reap(false);
+    while (free_slots_.empty())
+    {
+        reap(true);
+    }
+
+    // There is always a submission queue entry free since no more than depth writes are queued
+    io_uring_sqe *sqe = io_uring_get_sqe(ring_.get());
+    auto fixed = fixed_buffers_.find(frame.get());
+    if (fixed != fixed_buffers_.end())
+    {
+        io_uring_prep_write_fixed(sqe, fd, frame->frame_buffer_, length, offset, fixed->second);
+    }
+    else
+    {
+        io_uring_prep_write(sqe, fd, frame->frame_buffer_, length, offset);
+    }
+
+    unsigned index = free_slots_.back();
+    free_slots_.pop_back();
+    frame.setHolder("disk write");
+    slots_[index] = {std::move(frame), length};
+    io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(static_cast<uintptr_t>(index)));
+
+    int ret = io_uring_submit(ring_.get());
+    if (ret < 0)
+    {
+        char buf[256];
+        log_->critical("io_uring_submit failed: {}", strerror_r(-ret, buf, sizeof(buf)));
+        exit(1);
+    }
+    in_flight_++;
+}
+
+void UringWriter::reap(bool wait)
+{
+    while (in_flight_ > 0)
+    {
+        io_uring_cqe *cqe;
+        int ret = wait ?
+            io_uring_wait_cqe(ring_.get(), &cqe) :
+            io_uring_peek_cqe(ring_.get(), &cqe);
+        if (ret == -EAGAIN || ret == -EINTR)
+        {
+            // -EAGAIN: nothing has completed. -EINTR: interrupted by a signal such as SIGINT.
+            if (wait)
+            {
+                continue;
+            }
+            return;
+        }
+        else if (ret < 0)
+        {
+            char buf[256];
+            log_->critical(
+                "Waiting for io_uring completion failed: {}",
+                strerror_r(-ret, buf, sizeof(buf))
+            );
+            exit(1);
+        }
+
+        auto index = static_cast<unsigned>(reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe)));
+        int res = cqe->res;
+        io_uring_cqe_seen(ring_.get(), cqe);
+
+        Slot &slot = slots_[index];
+        if (res < 0)
+        {
+            char buf[256];
+            log_->critical("write failed: {}", strerror_r(-res, buf, sizeof(buf)));
+            exit(1);
+        }
+        else if (static_cast<size_t>(res) != slot.length)
+        {
+            log_->critical("write incomplete ({}/{})", res, slot.length);
+            exit(1);
+        }
+
+        // This is where the frame goes back to the pool
+        slot.frame.reset();
+        free_slots_.push_back(index);
+        in_flight_--;
+
+        // Having waited for one completion, pick up any others without waiting
+        wait = false;
+    }
+}
+
+void UringWriter::drain()
+{
+    while (in_flight_ > 0)
+    {
+        reap(true);
+    }
+}
+
+#else
+
+// Built without liburing
+struct io_uring {};
+
+std::unique_ptr<UringWriter> UringWriter::create(Pipeline &pipeline, unsigned depth)
+{
+    pipeline.log->warn("Built without liburing; writing frames with write().");
+    return nullptr;
+}
+
+UringWriter::~UringWriter() {}
+void UringWriter::write(int fd, FrameRef frame, size_t length, int64_t offset) {}
+void UringWriter::reap(bool wait) {}
+void UringWriter::drain() {}
+
+#endif
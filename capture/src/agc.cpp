@@ -3,121 +3,139 @@
 #include <cstdio>
 #include <cstring>
 #include <algorithm>
-#include <deque>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
 #include <unistd.h>
+#include <vector>
 #include <spdlog/spdlog.h>
 #include <sys/syscall.h>
 #include "Frame.h"
 #include "camera.h"
+#include "control.h"
+#include "Pipeline.h"
 
 using namespace camera;
 
 extern std::atomic_bool end_program;
 
-// AGC outputs
-extern std::atomic_int camera_gain;
-extern std::atomic_int camera_exposure_us;
-
-extern std::mutex to_agc_deque_mutex;
-extern std::condition_variable to_agc_deque_cv;
-extern std::deque<Frame *> to_agc_deque;
-
 /*
  * This function is intended to be run as a thread. The main thread dispatches frames to this
- * thread via a deque protected by a mutex. For each frame this thread may update either the
- * desired camera gain, exposure time, or both. The new desired values are stored in atomic global
- * variables monitored by the main thread which performs the actual calls to the camera API to
- * commit any changes to hardware.
+ * thread via a lock-free ring. For each frame this thread may update either the desired camera
+ * gain, exposure time, or both. The new desired values are stored in atomic members of the
+ * pipeline and queued for its control thread which performs the actual calls to the camera API
+ * to commit any changes to hardware.
  */
-void agc()
+void agc(Pipeline *pipeline)
 {
-    static uint32_t hist[256];
+    Pipeline &p = *pipeline;
+
+    // One bin per possible pixel value (65536 for RAW16 frames)
+    std::vector<uint32_t> hist(1 << 16);
 
     /*
      * The AGC directly servos this variable which has range [0.0, 1.0]. The camera gain and
      * exposure time are both functions of this value.
      */
-    static double agc_value = 0.0;
+    double agc_value = 0.0;
 
-    spdlog::info("Gain thread id: {}", syscall(SYS_gettid));
+    p.log->info("Gain thread id: {}", syscall(SYS_gettid));
 
     while (!end_program)
     {
-        // Get frame from deque
-        std::unique_lock<std::mutex> to_agc_deque_lock(to_agc_deque_mutex);
-        to_agc_deque_cv.wait(to_agc_deque_lock, [&]{return !to_agc_deque.empty() || end_program;});
+        // Get frame from ring
+        p.to_agc_ring.waitNotEmpty([]{return (bool)end_program;});
         if (end_program)
         {
             break;
         }
-        while (to_agc_deque.size() > 1)
+        FrameRef frame;
+        if (!p.to_agc_ring.pop(frame))
+        {
+            continue;
+        }
+        FrameRef newer;
+        while (p.to_agc_ring.pop(newer))
         {
             // Discard all but most recent frame
-            to_agc_deque.back()->decrRefCount();
-            to_agc_deque.pop_back();
+            frame = std::move(newer);
         }
-        Frame *frame = to_agc_deque.back();
-        to_agc_deque.pop_back();
-        to_agc_deque_lock.unlock();
+        frame.setHolder("AGC");
+
+        // 8-bit frames use the first 256 bins. Thresholds below are in 8-bit units and scaled by
+        // this shift for 16-bit frames.
+        const bool raw16 = (frame->metadata_.bytes_per_pixel == 2);
+        const int shift = raw16 ? 8 : 0;
+        const uint32_t num_bins = 256u << shift;
 
         // Clear histogram array
-        memset(hist, 0, sizeof(hist));
+        std::fill(hist.begin(), hist.begin() + num_bins, 0);
 
         // Generate histogram
-        for (size_t i = 0; i < Frame::IMAGE_SIZE_BYTES; i++)
+        size_t num_pixels = (size_t)frame->metadata_.width * frame->metadata_.height;
+        if (raw16)
+        {
+            const uint16_t *pixels = (const uint16_t *)frame->frame_buffer_;
+            for (size_t i = 0; i < num_pixels; i++)
+            {
+                hist[pixels[i]]++;
+            }
+        }
+        else
         {
-            uint8_t pixel_val = frame->frame_buffer_[i];
-            hist[pixel_val]++;
+            for (size_t i = 0; i < num_pixels; i++)
+            {
+                uint8_t pixel_val = frame->frame_buffer_[i];
+                hist[pixel_val]++;
+            }
         }
-        frame->decrRefCount();
+        frame.reset();
 
         // Calculate Nth percentile pixel value
         constexpr float percentile = 1.0;
-        uint32_t integral_threshold = (uint32_t)((1.0 - percentile) * Frame::IMAGE_SIZE_BYTES);
-        uint8_t upper_tail_val = 255;
-        uint32_t integral = hist[upper_tail_val];;
-        while (integral <= integral_threshold)
+        uint32_t integral_threshold = (uint32_t)((1.0 - percentile) * num_pixels);
+        uint32_t upper_tail_val = num_bins - 1;
+        uint32_t integral = hist[upper_tail_val];
+        while (integral <= integral_threshold && upper_tail_val > 0)
         {
             upper_tail_val--;
             integral += hist[upper_tail_val];
         }
 
         // Adjust AGC
-        if (upper_tail_val >= 255)
+        if (upper_tail_val >= (255u << shift))
         {
             agc_value -= 0.01;
         }
-        else if (upper_tail_val < 230)
+        else if (upper_tail_val < (230u << shift))
         {
             agc_value += 0.01;
         }
         agc_value = std::clamp(agc_value, 0.0, 1.0);
 
         // derive new camera gain
-        camera_gain = std::clamp(
+        p.camera_gain = std::clamp(
             (int)(4.0 * GAIN_MAX * agc_value - (3.0 * GAIN_MAX)),
             GAIN_MIN,
             GAIN_MAX
         );
 
         // derive new camera exposure time
-        camera_exposure_us = std::clamp(
+        p.camera_exposure_us = std::clamp(
             (int)(4.0 / 3.0 * EXPOSURE_MAX_US * agc_value),
             EXPOSURE_MIN_US,
             EXPOSURE_MAX_US
         );
 
-        spdlog::debug(
+        request_control_value(p, ASI_GAIN, p.camera_gain);
+        request_control_value(p, ASI_EXPOSURE, p.camera_exposure_us);
+
+        p.log->debug(
             "AGC value: {:.3f}, upper tail value: {:03d}, gain: {:03d}, exposure: {:05.3f} ms",
             agc_value,
-            upper_tail_val,
-            camera_gain,
-            (float)camera_exposure_us / 1.0e3
+            upper_tail_val >> shift,
+            (int)p.camera_gain,
+            (float)p.camera_exposure_us / 1.0e3
         );
     }
 
-    spdlog::info("AGC thread ending.");
+    p.log->info("AGC thread ending.");
 }
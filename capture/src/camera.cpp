@@ -1,96 +1,58 @@
 #include "camera.h"
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <deque>
 #include <dirent.h>
 #include <err.h>
+#include <fcntl.h>
+#include <thread>
 #include <libusb-1.0/libusb.h>
 #include <mutex>
 #include <spdlog/spdlog.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 #include <vector>
+#include "CameraModel.h"
 #include "Frame.h"
+#include "Pipeline.h"
+#include "record.h"
+#include "rtlog.h"
+#include "trace.h"
 
 
 #define LIBUSB_CHECK(func, ...) \
     do { \
         int ret = func(__VA_ARGS__); \
         if (ret < LIBUSB_SUCCESS) { \
-            spdlog::error(#func " returned {}: {}", \
+            RTLOG_ERROR(spdlog::default_logger_raw(), #func " returned {}: {}", \
                 libusb_error_name(ret), \
                 libusb_strerror((libusb_error)ret) \
             ); \
         } \
     } while (0)
 
-#define ASI_EXIT_ON_FAIL(func, ...) \
-    do { \
-        ASI_ERROR_CODE ret = func(__VA_ARGS__); \
-        if (ret != ASI_SUCCESS) { \
-            spdlog::error(#func " returned  {}", asi_error_str(ret)); \
-            exit(1); \
-        } \
-    } while (0)
-
-#define ASI_LOG_ON_FAIL(func, ...) \
-    do { \
-        ASI_ERROR_CODE ret = func(__VA_ARGS__); \
-        if (ret != ASI_SUCCESS) { \
-            spdlog::error(#func " returned  {}", asi_error_str(ret)); \
-        } \
-    } while (0)
-
 
 using namespace std::chrono;
 using namespace std::chrono_literals;
 
 
 constexpr auto AGC_PERIOD = 100ms;
-constexpr int NUM_LIBUSB_TRANSFERS = 2;
-int frame_count = 0;
-uint16_t last_frame_index = 0;
-libusb_context *ctx = nullptr;
-libusb_device_handle *dev_handle = nullptr;
+
+// Number of recent frames the frame rate estimate is calculated over
+constexpr int NUM_FRAMERATE_FRAMES = 100;
 
 
 // All threads should end gracefully when this is true
 extern std::atomic_bool end_program;
 
-// Estimated rate of frames received from the camera
-extern std::atomic<float> camera_frame_rate;
-
-// AGC enable state
-extern std::atomic_bool agc_enabled;
-
-// AGC outputs
-extern std::atomic_int camera_gain;
-extern std::atomic_int camera_exposure_us;
-
-// std::deque is not thread safe
-extern std::mutex to_disk_deque_mutex;
-extern std::mutex to_preview_deque_mutex;
-extern std::mutex to_agc_deque_mutex;
-extern std::mutex unused_deque_mutex;
-
-extern std::condition_variable to_disk_deque_cv;
-extern std::condition_variable to_preview_deque_cv;
-extern std::condition_variable to_agc_deque_cv;
-extern std::condition_variable unused_deque_cv;
-
-// FIFOs holding pointers to frame objects
-extern std::deque<Frame *> to_disk_deque;
-extern std::deque<Frame *> to_preview_deque;
-extern std::deque<Frame *> to_agc_deque;
-extern std::deque<Frame *> unused_deque;
-
 
 // A pointer to an instance is passed to the libusb transfer callback in transfer->user_data
 struct CallbackArgs {
-    Frame *frame;
-    int completed;
+    Pipeline *pipeline;
+    FrameRef frame;
+    bool in_flight;
 };
 
 
@@ -100,7 +62,20 @@ struct UsbDevice {
 };
 
 
-static const char *asi_error_str(ASI_ERROR_CODE code)
+// Cameras opened by all pipelines so far, as ASI camera IDs and as USB devices. Only used by the
+// main thread while cameras are being opened.
+static std::vector<int> opened_camera_ids;
+static std::vector<UsbDevice> claimed_usb_devices;
+
+
+static bool camera_is_open(int camera_id)
+{
+    return std::find(opened_camera_ids.begin(), opened_camera_ids.end(), camera_id) !=
+        opened_camera_ids.end();
+}
+
+
+const char *camera::asi_error_str(ASI_ERROR_CODE code)
 {
     switch (code)
     {
@@ -145,12 +120,17 @@ ASI_CAMERA_INFO prompt_user_for_camera()
         printf("\nSelect from the following cameras:\n");
         for (int i = 0; i < num_devices; i++) {
             ASI_EXIT_ON_FAIL(ASIGetCameraProperty, &CamInfo, i);
-            printf("\t%d) %s\n", i, CamInfo.Name);
+            if (!camera_is_open(CamInfo.CameraID)) {
+                printf("\t%d) %s\n", i, CamInfo.Name);
+            }
         }
         printf("\nEnter selection: ");
         int scanned = scanf("%d", &selection);
         if (scanned == 1 && selection >= 0 && selection < num_devices) {
-            break;
+            ASI_EXIT_ON_FAIL(ASIGetCameraProperty, &CamInfo, selection);
+            if (!camera_is_open(CamInfo.CameraID)) {
+                break;
+            }
         }
         printf("Invalid selection.\n");
 
@@ -178,25 +158,33 @@ ASI_CAMERA_INFO select_camera(const char *cam_name)
 
     int num_devices = ASIGetNumOfConnectedCameras();
     spdlog::info("Found {} cameras connected.", num_devices);
-    if (num_devices <= 0) {
-        spdlog::critical("No cameras connected.");
+
+    // Cameras already opened by another pipeline are not candidates
+    std::vector<ASI_CAMERA_INFO> available;
+    for (int i = 0; i < num_devices; ++i) {
+        ASI_EXIT_ON_FAIL(ASIGetCameraProperty, &CamInfo, i);
+        if (!camera_is_open(CamInfo.CameraID)) {
+            available.push_back(CamInfo);
+        }
+    }
+    if (available.empty()) {
+        spdlog::critical("No cameras available.");
         exit(1);
     }
 
     if (cam_name == nullptr) {
-        if (num_devices == 1) {
-            ASI_EXIT_ON_FAIL(ASIGetCameraProperty, &CamInfo, 0);
+        if (available.size() == 1) {
+            memcpy(&CamInfo, &available.front(), sizeof(CamInfo));
             spdlog::info("Connecting to the only camera available, named '{}'", CamInfo.Name);
         } else {
             CamInfo = prompt_user_for_camera();
         }
     } else {
         std::vector<ASI_CAMERA_INFO> matches;
-        for (int i = 0; i < num_devices; ++i) {
-            ASI_EXIT_ON_FAIL(ASIGetCameraProperty, &CamInfo, i);
+        for (const auto &info : available) {
             // checks if second arg is substring of first
-            if (strcasestr(CamInfo.Name, cam_name) != nullptr) {
-                matches.push_back(CamInfo);
+            if (strcasestr(info.Name, cam_name) != nullptr) {
+                matches.push_back(info);
             }
         }
 
@@ -216,11 +204,22 @@ ASI_CAMERA_INFO select_camera(const char *cam_name)
 }
 
 
-void camera::init_camera(ASI_CAMERA_INFO &CamInfo, const char *cam_name, int binning)
+static libusb_device_handle *init_libusb(Pipeline &pipeline);
+
+
+void camera::init_camera(
+    Pipeline &pipeline,
+    const char *cam_name,
+    int binning,
+    ASI_IMG_TYPE img_type
+)
 {
+    ASI_CAMERA_INFO &CamInfo = pipeline.CamInfo;
+    camera::State &state = pipeline.camera;
     CamInfo = select_camera(cam_name);
 
     ASI_EXIT_ON_FAIL(ASIOpenCamera, CamInfo.CameraID);
+    opened_camera_ids.push_back(CamInfo.CameraID);
     ASI_EXIT_ON_FAIL(ASIInitCamera, CamInfo.CameraID);
     ASI_EXIT_ON_FAIL(
         ASISetROIFormat,
@@ -228,8 +227,13 @@ void camera::init_camera(ASI_CAMERA_INFO &CamInfo, const char *cam_name, int bin
         CamInfo.MaxWidth / binning,
         CamInfo.MaxHeight / binning,
         binning,
-        ASI_IMG_RAW8
+        img_type
     );
+    state.camera_id = CamInfo.CameraID;
+    state.binning = binning;
+    state.img_type = img_type;
+    state.full_roi = {(int)CamInfo.MaxWidth / binning, (int)CamInfo.MaxHeight / binning, 0, 0};
+    state.roi = state.full_roi;
 
     /*
      * A value of 100 works on the author's PC with the ASI178 camera when using the custom
@@ -239,30 +243,116 @@ void camera::init_camera(ASI_CAMERA_INFO &CamInfo, const char *cam_name, int bin
      */
     ASI_EXIT_ON_FAIL(ASISetControlValue, CamInfo.CameraID, ASI_BANDWIDTHOVERLOAD, 100, ASI_FALSE);
     ASI_EXIT_ON_FAIL(ASISetControlValue, CamInfo.CameraID, ASI_HIGH_SPEED_MODE, 1, ASI_FALSE);
+
+    // Open our own handle to the same device so frame buffers can be allocated from its usbfs
+    // memory before streaming starts
+    state.dev_handle = init_libusb(pipeline);
 }
 
 
-libusb_device_handle *init_libusb()
+libusb_device_handle *camera::usb_handle(Pipeline &pipeline)
 {
-    constexpr uint16_t ZWO_VID = 0x03c3;
-    constexpr uint16_t ASI178MC_PID = 0x178a;
-    constexpr uint16_t ASI178MM_PID = 0x178c;
+    return pipeline.camera.dev_handle;
+}
+
+
+uint16_t camera::usb_product_id(Pipeline &pipeline)
+{
+    return pipeline.camera.usb_product_id;
+}
+
+
+void camera::enable_recording(Pipeline &pipeline)
+{
+    pipeline.camera.recording_enabled = true;
+}
+
+
+camera::Roi camera::full_frame_roi(Pipeline &pipeline)
+{
+    return pipeline.camera.full_roi;
+}
+
+
+int camera::bytes_per_pixel(Pipeline &pipeline)
+{
+    return (pipeline.camera.img_type == ASI_IMG_RAW16) ? 2 : 1;
+}
 
-    LIBUSB_CHECK(libusb_init, &ctx);
 
-    // Figure out what USB devices this process is already connected to
+void camera::request_roi(Pipeline &pipeline, Roi requested)
+{
+    camera::State &state = pipeline.camera;
+    const Roi &full_roi = state.full_roi;
+    if (state.camera_id < 0)
+    {
+        pipeline.log->warn("The ROI cannot be changed while replaying a recording.");
+        return;
+    }
+
+    // Satisfy the ASI alignment rules and keep the ROI on the sensor
+    Roi clamped;
+    clamped.width = std::clamp(requested.width, 8, full_roi.width) & ~7;
+    clamped.height = std::clamp(requested.height, 2, full_roi.height) & ~1;
+    clamped.start_x = std::clamp(requested.start_x, 0, full_roi.width - clamped.width) & ~1;
+    clamped.start_y = std::clamp(requested.start_y, 0, full_roi.height - clamped.height) & ~1;
+
+    std::unique_lock<std::mutex> roi_lock(state.roi_mutex);
+    state.pending_roi = clamped;
+    state.roi_change_pending = true;
+}
+
+
+void camera::close_camera(Pipeline &pipeline)
+{
+    camera::State &state = pipeline.camera;
+    libusb_close(state.dev_handle);
+    state.dev_handle = nullptr;
+    libusb_exit(state.ctx);
+    state.ctx = nullptr;
+    ASICloseCamera(state.camera_id);
+}
+
+
+static libusb_device_handle *init_libusb(Pipeline &pipeline)
+{
+    // Each pipeline has its own context so that libusb only runs a camera's transfer callbacks
+    // from that camera's thread
+    camera::State &state = pipeline.camera;
+    LIBUSB_CHECK(libusb_init, &state.ctx);
+
+    // Figure out what USB devices this process is already connected to, apart from the ones that
+    // belong to cameras opened by other pipelines. File descriptors are not necessarily
+    // contiguous so list the directory rather than counting up from 0.
     std::vector<UsbDevice> open_usb_devices;
     char pathname[PATH_MAX + 1];
     char buf[PATH_MAX + 1];
-    for (int i = 0; ; i++) {
-        sprintf(pathname, "/proc/self/fd/%d", i);
+    DIR *fd_dir = opendir("/proc/self/fd");
+    if (fd_dir == nullptr) {
+        char errbuf[256];
+        spdlog::critical(
+            "opendir(/proc/self/fd) failed: {}",
+            strerror_r(errno, errbuf, sizeof(errbuf))
+        );
+        exit(1);
+    }
+    while (dirent *entry = readdir(fd_dir)) {
+        snprintf(pathname, sizeof(pathname), "/proc/self/fd/%s", entry->d_name);
         ssize_t rtn = readlink(pathname, buf, PATH_MAX);
         if (rtn <= 0) {
-            break;
+            continue;
         }
         buf[rtn] = 0;  // add null termination since readlink doesn't
         UsbDevice device;
         if (sscanf(buf, "/dev/bus/usb/%03d/%03d", &device.bus, &device.dev) == 2) {
+            bool claimed = std::any_of(
+                claimed_usb_devices.begin(),
+                claimed_usb_devices.end(),
+                [&](const UsbDevice &d){return d.bus == device.bus && d.dev == device.dev;}
+            );
+            if (claimed) {
+                continue;
+            }
             spdlog::info("This process is using USB device {:03d} on bus {:03d}",
                 device.dev,
                 device.bus
@@ -270,6 +360,7 @@ libusb_device_handle *init_libusb()
             open_usb_devices.push_back(device);
         }
     }
+    closedir(fd_dir);
 
     if (open_usb_devices.size() == 0) {
         spdlog::critical("Unable to detect what USB device the ASI library is using.");
@@ -278,7 +369,7 @@ libusb_device_handle *init_libusb()
 
     // Find a USB device on the system that matches the one already opened
     libusb_device **devices_list;
-    ssize_t ret = libusb_get_device_list(ctx, &devices_list);
+    ssize_t ret = libusb_get_device_list(state.ctx, &devices_list);
     if (ret < 0) {
         spdlog::critical("libusb_get_device_list returned {}: {}",
             libusb_error_name(ret),
@@ -320,11 +411,24 @@ libusb_device_handle *init_libusb()
         spdlog::critical("Vendor ID is 0x{:x}, expected 0x{:x} for ZWO", desc.idVendor, ZWO_VID);
         exit(1);
     }
-    if (desc.idProduct != ASI178MC_PID && desc.idProduct != ASI178MM_PID) {
-        spdlog::critical("Product ID is 0x{:x}, expected 0x{:x} or 0x{:x} for ASI178MC or MM",
-            desc.idProduct, ASI178MC_PID, ASI178MM_PID);
+    state.model = find_camera_model(desc.idVendor, desc.idProduct);
+    if (state.model == nullptr) {
+        spdlog::critical(
+            "Product ID 0x{:x} does not match any camera model supported by the streaming code",
+            desc.idProduct
+        );
+        for (const auto &model : CAMERA_MODELS) {
+            for (auto pid : model.product_ids) {
+                spdlog::info("Supported: {} (0x{:x})", model.name, pid);
+            }
+        }
         exit(1);
     }
+    spdlog::info("Using streaming parameters for camera model {}", state.model->name);
+    state.usb_product_id = desc.idProduct;
+    claimed_usb_devices.push_back(
+        {libusb_get_bus_number(matching_dev), libusb_get_device_address(matching_dev)}
+    );
 
     spdlog::info(
         "USB device {:03d} on bus {:03d} seems to be the correct camera",
@@ -339,52 +443,103 @@ libusb_device_handle *init_libusb()
 }
 
 
-// This is a custom implementation of the startup section of `ASIStartVideoCapture()`
-void start_streaming(libusb_device_handle *dev_handle)
+// Send one of the start/stop control sequences from the camera model descriptor
+static void run_control_sequence(
+    const camera::State &state,
+    const std::vector<ControlStep> &sequence
+)
 {
-    LIBUSB_CHECK(libusb_reset_device, dev_handle);
+    libusb_device_handle *dev_handle = state.dev_handle;
+    for (const auto &step : sequence) {
+        unsigned char data;
+        switch (step.op) {
+            case ControlStep::RESET:
+                LIBUSB_CHECK(libusb_reset_device, dev_handle);
+                break;
+            case ControlStep::CLEAR_HALT:
+                LIBUSB_CHECK(libusb_clear_halt, dev_handle, state.model->bulk_endpoint);
+                break;
+            case ControlStep::WRITE:
+                LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, step.request, step.value,
+                    step.index, nullptr, 0, step.timeout_ms);
+                break;
+            case ControlStep::SET_BITS:
+            case ControlStep::CLEAR_BITS:
+                LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0xc0, step.read_request,
+                    step.value, 0x0, &data, 1, step.timeout_ms);
+                data = (step.op == ControlStep::SET_BITS) ? (data | step.mask) : (data & ~step.mask);
+                LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, step.request, step.value,
+                    data, nullptr, 0, step.timeout_ms);
+                break;
+        }
+    }
+}
 
-    // Stop streaming
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xaa, 0x0, 0x0, nullptr, 0, 200);
 
-    // Set bit 4 of FPGA register 0 to put FPGA in the "stop" state
-    unsigned char data;
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0xc0, 0xbc, 0x0, 0x0, &data, 1, 500);
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xbd, 0x0, data | 0x10, nullptr, 0, 500);
+static int64_t clock_ns(clockid_t clock_id)
+{
+    timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (int64_t)ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
 
-    // Start streaming
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xa9, 0x0, 0x0, nullptr, 0, 200);
 
-    // Write 0x6 then 0x0 to sensor chip register 0x3000
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xb6, 0x3000, 0x6, nullptr, 0, 500);
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xb6, 0x3000, 0x0, nullptr, 0, 500);
+// Frame rate and statistics bookkeeping starts over when streaming (or a replay) starts
+static void reset_stats(camera::State &state)
+{
+    state.frame_timestamps.assign(NUM_FRAMERATE_FRAMES, clock_ns(CLOCK_MONOTONIC_RAW));
+    state.agc_last_dispatch_ts = steady_clock::now();
+    state.stats_last_printed_ts = steady_clock::now();
+}
 
-    // Clear bit 4 of FPGA register 0 to take FPGA out of the "stop" state
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0xc0, 0xbc, 0x0, 0x0, &data, 1, 500);
-    LIBUSB_CHECK(libusb_control_transfer, dev_handle, 0x40, 0xbd, 0x0, data & 0xef, nullptr, 0, 500);
 
-    // Make sure the bulk transfer endpoint isn't halted
-    LIBUSB_CHECK(libusb_clear_halt, dev_handle, 0x81);
+// Hand a reference to a frame to another thread of the pipeline. The rings are sized for the whole
+// frame pool, so a full ring means a frame was queued twice; the reference is dropped in that case.
+static void queue_frame(Pipeline &pipeline, SpscRing<FrameRef> &ring, FrameRef frame, const char *name)
+{
+    if (!ring.push(std::move(frame)))
+    {
+        RTLOG_ERROR(pipeline.log, "To-{} ring is full; dropping frame.", name);
+    }
 }
 
 
-void libusb_callback(libusb_transfer *transfer)
+// Handles a completed transfer whose frame already has its capture times and camera settings
+// filled in. Called from libusb_callback() for live transfers and from run_replay().
+static void dispatch_transfer(libusb_transfer *transfer)
 {
-    static auto agc_last_dispatch_ts = steady_clock::now();
-    static auto stats_last_printed_ts = steady_clock::now();
-    // deque of timestamps for use in calculating frame rate
-    constexpr int NUM_FRAMERATE_FRAMES = 100;
-    static std::deque<steady_clock::time_point> timestamps(
-        NUM_FRAMERATE_FRAMES,
-        steady_clock::now()
-    );
-
     CallbackArgs *args = (CallbackArgs *)(transfer->user_data);
-    auto frame = args->frame;
+    Pipeline &pipeline = *args->pipeline;
+    camera::State &state = pipeline.camera;
+    auto &log = pipeline.log;
+
+    // Take over the transfer's reference. Returning without queueing the frame anywhere hands it
+    // back to the pool.
+    FrameRef frame = std::move(args->frame);
+    frame.setHolder("camera");
+    trace::Span span("dispatch transfer", frame.get());
+
+    FrameMetadata &metadata = frame->metadata_;
+    metadata.sensor_index = 0;
+    metadata.transfer_status = transfer->status;
+    metadata.actual_length = transfer->actual_length;
+
+    // Hand the transfer back to the resubmit loop in run_camera() regardless of outcome. The frame
+    // it carried is dealt with below, so the loop only needs to attach a fresh one.
+    state.completed_transfers.push_back(transfer);
+    args->in_flight = false;
+    state.transfers_in_flight--;
+    state.transfers_in_flight_min = std::min(state.transfers_in_flight_min, state.transfers_in_flight);
+
+    // Transfers are cancelled deliberately at shutdown and to change the ROI; nothing to report.
+    if ((end_program || state.roi_changing) && transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        return;
+    }
 
-    // This is checked by libusb_handle_events_completed() to determine if it needs to wait for
-    // this callback event or if it already happened.
-    args->completed = 1;
+    // Every transfer, successful or not, goes to the recorder in order of completion
+    if (state.recording_enabled) {
+        queue_frame(pipeline, pipeline.to_record_ring, frame.share("to-record ring"), "record");
+    }
 
     // I'm not 100% sure all of these transfer errors are handled correctly, in part because I'm
     // not sure how to induce most of them. I can induce an overflow by inserting sleep statements,
@@ -394,231 +549,667 @@ void libusb_callback(libusb_transfer *transfer)
         case LIBUSB_TRANSFER_COMPLETED:
             break;
         case LIBUSB_TRANSFER_ERROR:
-            spdlog::error("LIBUSB_TRANSFER_ERROR");
-            frame->decrRefCount();
+            RTLOG_ERROR(log, "LIBUSB_TRANSFER_ERROR");
+            state.transfer_error_count++;
             return;
         case LIBUSB_TRANSFER_TIMED_OUT:
-            spdlog::error("LIBUSB_TRANSFER_TIMED_OUT");
-            frame->decrRefCount();
+            RTLOG_ERROR(log, "LIBUSB_TRANSFER_TIMED_OUT");
+            state.transfer_error_count++;
             return;
         case LIBUSB_TRANSFER_CANCELLED:
-            spdlog::error("LIBUSB_TRANSFER_CANCELLED");
-            frame->decrRefCount();
+            RTLOG_ERROR(log, "LIBUSB_TRANSFER_CANCELLED");
+            state.transfer_error_count++;
             return;
         case LIBUSB_TRANSFER_STALL:
-            spdlog::error("LIBUSB_TRANSFER_STALL");
-            frame->decrRefCount();
-            LIBUSB_CHECK(libusb_clear_halt, dev_handle, 0x81);
+            RTLOG_ERROR(log, "LIBUSB_TRANSFER_STALL");
+            state.transfer_error_count++;
+            LIBUSB_CHECK(libusb_clear_halt, state.dev_handle, state.model->bulk_endpoint);
             return;
         case LIBUSB_TRANSFER_NO_DEVICE:
-            spdlog::critical("LIBUSB_TRANSFER_NO_DEVICE");
+            log->critical("LIBUSB_TRANSFER_NO_DEVICE");
             exit(1);
         case LIBUSB_TRANSFER_OVERFLOW:
-            spdlog::error("LIBUSB_TRANSFER_OVERFLOW");
-            frame->decrRefCount();
+            RTLOG_ERROR(log, "LIBUSB_TRANSFER_OVERFLOW");
+            state.transfer_overflow_count++;
             // libusb docs say pending transfers should be cancelled before clearing a halt, but
             // this seems to be working fine without doing that.
-            LIBUSB_CHECK(libusb_clear_halt, dev_handle, 0x81);
+            LIBUSB_CHECK(libusb_clear_halt, state.dev_handle, state.model->bulk_endpoint);
             return;
     }
 
     if (transfer->length != transfer->actual_length) {
-        spdlog::error("Expected {} bytes from USB bulk transfer but got {} (diff: {})",
+        RTLOG_ERROR(log, "Expected {} bytes from USB bulk transfer but got {} (diff: {})",
             transfer->length, transfer->actual_length, transfer->actual_length - transfer->length
         );
     }
-    frame->validate();
-
-    // Not sure why the frame index sometimes increments by 2, but even at low frame rates this
-    // seems to be true so increment by 1 or 2 are both considered valid.
-    auto frame_index = frame->frameIndex();
-    if ((frame_index <= last_frame_index) || (frame_index > last_frame_index + 2)) {
-        spdlog::warn(
-            "Expected frame index {} or {} but got {}",
-            last_frame_index + 1,
-            last_frame_index + 2,
+    frame->validate(*state.model);
+
+    auto frame_index = frame->frameIndex(*state.model);
+    metadata.sensor_index = frame_index;
+    if (state.resync_frame_index) {
+        state.resync_frame_index = false;
+    } else if ((frame_index <= state.last_frame_index) ||
+        (frame_index > state.last_frame_index + state.model->index_increment_max)) {
+        RTLOG_WARN(
+            log,
+            "Expected frame index {} through {} but got {}",
+            state.last_frame_index + 1,
+            state.last_frame_index + state.model->index_increment_max,
             frame_index
         );
     }
-    last_frame_index = frame_index;
+    state.last_frame_index = frame_index;
 
-    frame_count++;
+    state.frame_count++;
+    state.frame_bytes_count += transfer->actual_length;
+    if (frame->isDma())
+    {
+        state.dma_frame_count++;
+    }
+
+    // Below the pool's low-water mark the AGC and preview threads go without, so that the frames
+    // they hold come back to the pool (see PoolPolicy)
+    const bool pool_low = pipeline.pool_policy != PoolPolicy::BLOCK &&
+        pipeline.unused_ring.size() < pipeline.pool_low_water;
 
     // Dispatch a subset of frames to AGC thread
-    if (agc_enabled)
+    if (pipeline.agc_enabled && !pool_low)
     {
         auto now_ts = steady_clock::now();
-        if (now_ts - agc_last_dispatch_ts > AGC_PERIOD)
+        if (now_ts - state.agc_last_dispatch_ts > AGC_PERIOD)
         {
-            agc_last_dispatch_ts = now_ts;
-
-            // Put this frame in the deque headed for AGC thread
-            frame->incrRefCount();
-            std::unique_lock<std::mutex> to_agc_deque_lock(to_agc_deque_mutex);
-            to_agc_deque.push_front(frame);
-            to_agc_deque_lock.unlock();
-            to_agc_deque_cv.notify_one();
+            state.agc_last_dispatch_ts = now_ts;
+
+            // Put this frame in the ring headed for AGC thread
+            queue_frame(pipeline, pipeline.to_agc_ring, frame.share("to-AGC ring"), "AGC");
         }
     }
 
-    // Put this frame in the deque headed for live preview thread if the deque is empty
-    if (to_preview_deque.empty())
+    // Put this frame in the ring headed for live preview thread unless the preview thread has
+    // not yet taken the last one from this camera
+    if (!pool_low && pipeline.to_preview_ring.empty())
     {
-        frame->incrRefCount();
-        std::unique_lock<std::mutex> to_preview_deque_lock(to_preview_deque_mutex);
-        to_preview_deque.push_front(frame);
-        to_preview_deque_lock.unlock();
-        to_preview_deque_cv.notify_one();
+        queue_frame(pipeline, pipeline.to_preview_ring, frame.share("to-preview ring"), "preview");
     }
 
-    // Put this frame in the deque headed for write to disk thread. This must be done after
-    // dispatching frames to the other threads (AGC, preview) because this thread could decrement
-    // the reference count of the frame down to zero before it is processed by those other threads.
-    std::unique_lock<std::mutex> to_disk_deque_lock(to_disk_deque_mutex);
-    to_disk_deque.push_front(frame);
-    to_disk_deque_lock.unlock();
-    to_disk_deque_cv.notify_one();
+    // Put this frame in the ring headed for write to disk thread, handing over this thread's own
+    // reference. This must come last because the frame may go back to the pool as soon as the disk
+    // thread is done with it. With the DROP_NEWEST policy a frame that arrives while the pool is
+    // low goes straight back to it instead.
+    if (pool_low && pipeline.pool_policy == PoolPolicy::DROP_NEWEST)
+    {
+        if (pipeline.disk_write_enabled)
+        {
+            pipeline.frames_dropped++;
+        }
+        frame.reset();
+    }
+    else
+    {
+        frame.setHolder("to-disk ring");
+        queue_frame(pipeline, pipeline.to_disk_ring, std::move(frame), "disk");
+    }
 
     // For calculating frame rate
-    timestamps.push_front(steady_clock::now());
+    auto &timestamps = state.frame_timestamps;
+    timestamps.push_front(metadata.monotonic_raw_ns);
     timestamps.pop_back();
-    auto now = timestamps.front();
-    auto then = timestamps.back();
-    duration<float> elapsed = now - then;
-    camera_frame_rate = (float)(NUM_FRAMERATE_FRAMES - 1) / elapsed.count();
+    duration<float> elapsed = nanoseconds(timestamps.front() - timestamps.back());
+    pipeline.camera_frame_rate = (float)(NUM_FRAMERATE_FRAMES - 1) / elapsed.count();
 
-    now = steady_clock::now();
-    if (now - stats_last_printed_ts > 1s)
+    auto now = steady_clock::now();
+    if (now - state.stats_last_printed_ts > 1s)
     {
-        spdlog::info(
-            "{:6d} frames, {:6.2f} FPS over last {}",
-            frame_count,
-            camera_frame_rate,
-            NUM_FRAMERATE_FRAMES
+        RTLOG_INFO(
+            log,
+            "{:6d} frames, {:6.2f} FPS over last {}, {} overflows, {} transfer errors, "
+            "{} frames dropped for lack of buffers",
+            state.frame_count,
+            pipeline.camera_frame_rate,
+            NUM_FRAMERATE_FRAMES,
+            state.transfer_overflow_count,
+            state.transfer_error_count,
+            pipeline.frames_dropped
+        );
+        RTLOG_DEBUG(
+            log,
+            "Transfer ring: {} in flight now, {} at minimum since last report.",
+            state.transfers_in_flight,
+            state.transfers_in_flight_min
         );
-        spdlog::debug(
-            "Frame counts: To-disk queue: {}, to-AGC queue: {}, to-preview queue: {}, pool: {} free frames.",
-            to_disk_deque.size(),
-            to_agc_deque.size(),
-            to_preview_deque.size(),
-            unused_deque.size()
+        state.transfers_in_flight_min = state.transfers_in_flight;
+        RTLOG_DEBUG(
+            log,
+            "Frame counts: To-disk ring: {}, to-AGC ring: {}, to-preview ring: {}, pool: {} free frames.",
+            pipeline.to_disk_ring.size(),
+            pipeline.to_agc_ring.size(),
+            pipeline.to_preview_ring.size(),
+            pipeline.unused_ring.size()
         );
-        stats_last_printed_ts = steady_clock::now();
+        state.stats_last_printed_ts = steady_clock::now();
     }
 }
 
 
-void camera::run_camera(ASI_CAMERA_INFO &CamInfo)
+void libusb_callback(libusb_transfer *transfer)
 {
-    dev_handle = init_libusb();
-    libusb_transfer *transfers[NUM_LIBUSB_TRANSFERS];
-    CallbackArgs callback_args[NUM_LIBUSB_TRANSFERS];
+    // Capture-time record that travels with the frame to every consumer
+    CallbackArgs *args = (CallbackArgs *)(transfer->user_data);
+    FrameMetadata &metadata = args->frame->metadata_;
+    metadata.monotonic_raw_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+    metadata.utc_ns = clock_ns(CLOCK_REALTIME);
+    metadata.gain = args->pipeline->camera_gain_applied;
+    metadata.exposure_us = args->pipeline->camera_exposure_us_applied;
 
-    for (int i = 0; i < NUM_LIBUSB_TRANSFERS; i++) {
+    dispatch_transfer(transfer);
+}
+
+
+// Attach a frame from the pool to a transfer and queue it on the bulk endpoint. The transfer holds
+// the reference until dispatch_transfer() takes it over.
+static void submit_transfer(Pipeline &pipeline, libusb_transfer *transfer, FrameRef frame)
+{
+    camera::State &state = pipeline.camera;
+
+    auto args = (CallbackArgs *)transfer->user_data;
+    frame->metadata_.width = state.roi.width;
+    frame->metadata_.height = state.roi.height;
+    frame->metadata_.start_x = state.roi.start_x;
+    frame->metadata_.start_y = state.roi.start_y;
+    frame->metadata_.bytes_per_pixel = camera::bytes_per_pixel(pipeline);
+    transfer->buffer = const_cast<uint8_t *>(frame->frame_buffer_);
+    args->frame = std::move(frame);
+    int ret = libusb_submit_transfer(transfer);
+    if (ret < LIBUSB_SUCCESS) {
+        RTLOG_ERROR(pipeline.log, "libusb_submit_transfer returned {}: {}",
+            libusb_error_name(ret),
+            libusb_strerror((libusb_error)ret)
+        );
+        args->frame.reset();
+        // Try again on the next pass through the resubmit loop
+        state.completed_transfers.push_back(transfer);
+        return;
+    }
+    args->in_flight = true;
+    state.transfers_in_flight++;
+}
+
+
+// Take a frame from the pool for a USB transfer. If the pool is empty this only waits for a frame
+// under the BLOCK pool policy. Returns an empty FrameRef if there is no frame or the program is
+// ending.
+static FrameRef get_unused_frame(Pipeline &pipeline)
+{
+    camera::State &state = pipeline.camera;
+    Frame *frame;
+    if (pipeline.unused_ring.pop(frame))
+    {
+        state.pool_starved = false;
+        return FrameRef(frame, "usb transfer");
+    }
+
+    // Report each time the pool runs dry, not every attempt to get a frame while it is
+    if (!state.pool_starved)
+    {
+        state.pool_starved = true;
+        state.pool_starved_count++;
+        RTLOG_ERROR(pipeline.log, "Frame pool exhausted. To-disk ring: {}, to-AGC ring: {}, "
+            "to-preview ring: {}, to-record ring: {}.",
+            pipeline.to_disk_ring.size(),
+            pipeline.to_agc_ring.size(),
+            pipeline.to_preview_ring.size(),
+            pipeline.to_record_ring.size()
+        );
+    }
+    if (pipeline.pool_policy != PoolPolicy::BLOCK)
+    {
+        return FrameRef();
+    }
+
+    while (!pipeline.unused_ring.pop(frame))
+    {
+        if (end_program)
+        {
+            return FrameRef();
+        }
+        pipeline.unused_ring.waitNotEmpty([]{return (bool)end_program;});
+    }
+    state.pool_starved = false;
+    return FrameRef(frame, "usb transfer");
+}
+
+
+// Attach fresh frames to the transfers that have completed and queue them again. Transfers that
+// can't get a frame wait in completed_transfers for the next pass. Returns false if the program is
+// ending.
+static bool resubmit_completed_transfers(
+    Pipeline &pipeline,
+    std::vector<libusb_transfer *> &to_resubmit
+)
+{
+    auto &completed = pipeline.camera.completed_transfers;
+    to_resubmit.swap(completed);
+    for (auto it = to_resubmit.begin(); it != to_resubmit.end(); ++it) {
+        FrameRef frame = get_unused_frame(pipeline);
+        if (!frame)
+        {
+            if (end_program)
+            {
+                to_resubmit.clear();
+                return false;
+            }
+            completed.insert(completed.end(), it, to_resubmit.end());
+            break;
+        }
+        submit_transfer(pipeline, *it, std::move(frame));
+    }
+    to_resubmit.clear();
+    return true;
+}
+
+
+/*
+ * Switch to the ROI most recently passed to camera::request_roi(). Moving the ROI without changing
+ * its size is done while streaming, so frames already in flight may carry the old start position in
+ * their metadata. Changing the size means every transfer has to be resized, so the transfers in
+ * flight are cancelled, the camera is stopped and reconfigured, and streaming is restarted; the
+ * frame pool is untouched since every buffer can hold a full frame. Afterwards all transfers are
+ * waiting in completed_transfers to be resubmitted.
+ */
+static void change_roi(Pipeline &pipeline, const std::vector<libusb_transfer *> &transfers)
+{
+    camera::State &state = pipeline.camera;
+    camera::Roi &roi = state.roi;
+    auto &log = pipeline.log;
+
+    std::unique_lock<std::mutex> roi_lock(state.roi_mutex);
+    camera::Roi requested = state.pending_roi;
+    state.roi_change_pending = false;
+    roi_lock.unlock();
+
+    if (requested.width == roi.width && requested.height == roi.height)
+    {
+        if (requested.start_x != roi.start_x || requested.start_y != roi.start_y)
+        {
+            ASI_LOG_ON_FAIL(ASISetStartPos, state.camera_id, requested.start_x, requested.start_y);
+            ASI_LOG_ON_FAIL(ASIGetStartPos, state.camera_id, &roi.start_x, &roi.start_y);
+            log->info("ROI moved to ({}, {}).", roi.start_x, roi.start_y);
+        }
+        return;
+    }
+
+    auto change_start_ts = steady_clock::now();
+    state.roi_changing = true;
+    for (auto transfer : transfers) {
+        if (((CallbackArgs *)transfer->user_data)->in_flight) {
+            libusb_cancel_transfer(transfer);
+        }
+    }
+    while (state.transfers_in_flight > 0 && steady_clock::now() - change_start_ts < 1s) {
+        timeval timeout = {0, 100'000};
+        LIBUSB_CHECK(libusb_handle_events_timeout_completed, state.ctx, &timeout, nullptr);
+    }
+    state.roi_changing = false;
+    if (state.transfers_in_flight > 0) {
+        log->error(
+            "{} transfers still in flight after cancellation; ROI change abandoned.",
+            state.transfers_in_flight
+        );
+        return;
+    }
+
+    run_control_sequence(state, state.model->stop_sequence);
+
+    ASI_ERROR_CODE ret = ASISetROIFormat(
+        state.camera_id,
+        requested.width,
+        requested.height,
+        state.binning,
+        state.img_type
+    );
+    if (ret != ASI_SUCCESS)
+    {
+        log->error("ASISetROIFormat returned  {}", camera::asi_error_str(ret));
+    }
+    else
+    {
+        ASI_LOG_ON_FAIL(ASISetStartPos, state.camera_id, requested.start_x, requested.start_y);
+    }
+
+    // Use whatever the camera actually ended up with
+    int bin;
+    ASI_IMG_TYPE img_type;
+    ASI_LOG_ON_FAIL(ASIGetROIFormat, state.camera_id, &roi.width, &roi.height, &bin, &img_type);
+    ASI_LOG_ON_FAIL(ASIGetStartPos, state.camera_id, &roi.start_x, &roi.start_y);
+    for (auto transfer : transfers) {
+        transfer->length = roi.width * roi.height * camera::bytes_per_pixel(pipeline);
+    }
+
+    run_control_sequence(state, state.model->start_sequence);
+    state.resync_frame_index = true;
+
+    duration<float, std::milli> change_elapsed = steady_clock::now() - change_start_ts;
+    log->info(
+        "ROI changed to {}x{} at ({}, {}) in {:.1f} ms.",
+        roi.width,
+        roi.height,
+        roi.start_x,
+        roi.start_y,
+        change_elapsed.count()
+    );
+}
+
+
+// CPU time consumed so far by the calling thread
+static duration<double> thread_cpu_time()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+}
+
+
+void camera::run_camera(Pipeline &pipeline, int num_transfers)
+{
+    camera::State &state = pipeline.camera;
+    auto &log = pipeline.log;
+
+    std::vector<libusb_transfer *> transfers(num_transfers);
+    std::vector<CallbackArgs> callback_args(num_transfers);
+    for (auto &args : callback_args) {
+        args.pipeline = &pipeline;
+        args.in_flight = false;
+    }
+    state.completed_transfers.reserve(num_transfers);
+
+    for (int i = 0; i < num_transfers; i++) {
         transfers[i] = libusb_alloc_transfer(0);
         if (transfers[i] == nullptr) {
-            spdlog::critical("libusb_alloc_transfer returned NULL");
+            log->critical("libusb_alloc_transfer returned NULL");
             exit(1);
         }
         libusb_fill_bulk_transfer(
             transfers[i],
-            dev_handle,
-            0x81,
+            state.dev_handle,
+            state.model->bulk_endpoint,
             nullptr,  // to be filled later
-            Frame::IMAGE_SIZE_BYTES,
+            state.roi.width * state.roi.height * camera::bytes_per_pixel(pipeline),
             libusb_callback,
             &callback_args[i],
-            100  // timeout [ms]
+            // No timeout: a transfer's timeout runs from when it is submitted, so with several
+            // queued the last one waits several frame periods before its frame even starts. The
+            // transfers are cancelled explicitly at shutdown and on a change of ROI.
+            0
         );
     }
 
-    start_streaming(dev_handle);
+    run_control_sequence(state, state.model->start_sequence);
+    log->info(
+        "Streaming {}-bit frames with {} bulk transfers in flight.",
+        8 * camera::bytes_per_pixel(pipeline),
+        num_transfers
+    );
+    auto streaming_start_ts = steady_clock::now();
+    auto streaming_start_cpu = thread_cpu_time();
+    reset_stats(state);
 
     // get things started
-    std::unique_lock<std::mutex> unused_deque_lock(unused_deque_mutex);
-    for (int i = 0; i < NUM_LIBUSB_TRANSFERS; i++) {
-        Frame *frame = unused_deque.back();
-        unused_deque.pop_back();
-        // Matching decrement in write_to_disk thread (except in case of failure to get frame data)
-        frame->incrRefCount();
-        auto args = (CallbackArgs *)transfers[i]->user_data;
-        args->completed = 0;
-        args->frame = frame;
-        transfers[i]->buffer = const_cast<uint8_t *>(frame->frame_buffer_);
-        LIBUSB_CHECK(libusb_submit_transfer, transfers[i]);
-    }
-    unused_deque_lock.unlock();
-
-    int gain_prev = -1;
-    int exposure_us_prev = -1;
+    std::vector<libusb_transfer *> to_resubmit;
+    to_resubmit.reserve(num_transfers);
+    state.completed_transfers.assign(transfers.begin(), transfers.end());
+    resubmit_completed_transfers(pipeline, to_resubmit);
+    state.transfers_in_flight_min = state.transfers_in_flight;
+
     while (!end_program)
     {
-        for (int i = 0; i < NUM_LIBUSB_TRANSFERS; i++) {
+        // Run callbacks for whichever transfers have completed, in whatever order they finish.
+        // The timeout only bounds how long it takes to notice end_program, or while transfers are
+        // waiting for frames, how long until the pool is checked again.
+        timeval timeout = {0, state.completed_transfers.empty() ? 100'000 : 1'000};
+        LIBUSB_CHECK(libusb_handle_events_timeout_completed, state.ctx, &timeout, nullptr);
 
-            auto args = (CallbackArgs *)transfers[i]->user_data;
-            LIBUSB_CHECK(libusb_handle_events_completed, ctx, &args->completed);
+        if (!resubmit_completed_transfers(pipeline, to_resubmit))
+        {
+            break;
+        }
 
-            // Get pointer to an available Frame object
-            std::unique_lock<std::mutex> unused_deque_lock(unused_deque_mutex);
-            while (unused_deque.empty() && !end_program)
-            {
-                spdlog::error("Frame pool exhausted. To-disk queue: {}, to-AGC queue: {}, "
-                    "to-preview queue: {}, free: {}.",
-                    to_disk_deque.size(),
-                    to_agc_deque.size(),
-                    to_preview_deque.size(),
-                    unused_deque.size()
-                );
-                unused_deque_cv.wait(unused_deque_lock);
-            }
-            if (end_program)
-            {
-                break;
-            }
-            Frame *frame = unused_deque.back();
-            unused_deque.pop_back();
-            unused_deque_lock.unlock();
-
-            // Matching decrement in write_to_disk thread (except in case of transfer failure)
-            frame->incrRefCount();
-            args->completed = 0;
-            args->frame = frame;
-            transfers[i]->buffer = const_cast<uint8_t *>(frame->frame_buffer_);
-            LIBUSB_CHECK(libusb_submit_transfer, transfers[i]);
-
-            // Set camera gain if value was updated in another thread
-            if (camera_gain != gain_prev)
-            {
-                ASI_LOG_ON_FAIL(
-                    ASISetControlValue,
-                    CamInfo.CameraID,
-                    ASI_GAIN,
-                    camera_gain,
-                    ASI_FALSE
-                );
-                gain_prev = camera_gain;
-                spdlog::info("Camera gain set to {:03d}", camera_gain);
+        if (state.roi_change_pending)
+        {
+            change_roi(pipeline, transfers);
+            resubmit_completed_transfers(pipeline, to_resubmit);
+        }
+    }
+
+    duration<float> streaming_elapsed = steady_clock::now() - streaming_start_ts;
+    duration<double, std::micro> streaming_cpu = thread_cpu_time() - streaming_start_cpu;
+    log->info(
+        "Transfer ring depth {}: {} frames in {:.1f} s ({:.2f} FPS, {:.1f} MB/s), {} overflows, "
+        "{} other transfer errors.",
+        num_transfers,
+        state.frame_count,
+        streaming_elapsed.count(),
+        state.frame_count / streaming_elapsed.count(),
+        state.frame_bytes_count / streaming_elapsed.count() / 1e6,
+        state.transfer_overflow_count,
+        state.transfer_error_count
+    );
+    log->info(
+        "Frame pool ran dry {} times; {} frames were not written to disk for lack of buffers.",
+        state.pool_starved_count,
+        pipeline.frames_dropped
+    );
+    log->info(
+        "Camera thread used {:.1f} us of CPU per frame; {} of {} frames arrived in usbfs DMA buffers.",
+        (state.frame_count > 0) ? streaming_cpu.count() / state.frame_count : 0.0,
+        state.dma_frame_count,
+        state.frame_count
+    );
+
+    // Cancel whatever is still queued and wait for the cancellations to be reaped so that no
+    // transfer references a frame or the device after this point.
+    for (auto transfer : transfers) {
+        if (((CallbackArgs *)transfer->user_data)->in_flight) {
+            libusb_cancel_transfer(transfer);
+        }
+    }
+    auto cancel_start_ts = steady_clock::now();
+    while (state.transfers_in_flight > 0 && steady_clock::now() - cancel_start_ts < 1s) {
+        timeval timeout = {0, 100'000};
+        LIBUSB_CHECK(libusb_handle_events_timeout_completed, state.ctx, &timeout, nullptr);
+    }
+    run_control_sequence(state, state.model->stop_sequence);
+    if (state.transfers_in_flight > 0) {
+        log->warn("{} transfers still in flight after cancellation.", state.transfers_in_flight);
+        // The USB stack may still write to these buffers, so they must never go back to the pool
+        for (auto &args : callback_args) {
+            if (args.in_flight) {
+                args.frame.leak();
             }
+        }
+    } else {
+        for (auto transfer : transfers) {
+            libusb_free_transfer(transfer);
+        }
+    }
+
+}
 
-            // Set exposure time if value was updated in another thread
-            if (camera_exposure_us != exposure_us_prev)
+
+// Read exactly len bytes, however many reads that takes (a pipe or FIFO hands data over a bit at
+// a time). False if the recording ends first.
+static bool read_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, static_cast<uint8_t *>(buf) + done, len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            char errbuf[256];
+            spdlog::critical(
+                "USB record read failed: {}",
+                strerror_r(errno, errbuf, sizeof(errbuf))
+            );
+            exit(1);
+        }
+        if (n == 0)
+        {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+
+UsbRecordHeader_t camera::init_replay(Pipeline &pipeline, const char *filename)
+{
+    camera::State &state = pipeline.camera;
+    auto &log = pipeline.log;
+
+    state.replay_fd = open(filename, O_RDONLY);
+    if (state.replay_fd < 0)
+    {
+        char buf[256];
+        log->critical("open({}) failed: {}", filename, strerror_r(errno, buf, sizeof(buf)));
+        exit(1);
+    }
+
+    UsbRecordHeader_t header;
+    char magic[sizeof(header.Magic)];
+    memcpy(magic, header.Magic, sizeof(magic));
+    if (!read_all(state.replay_fd, &header, sizeof(header)) ||
+        memcmp(magic, header.Magic, sizeof(magic)) != 0)
+    {
+        log->critical("{} is not a USB stream recording.", filename);
+        exit(1);
+    }
+
+    state.model = find_camera_model(header.VendorID, header.ProductID);
+    if (state.model == nullptr)
+    {
+        log->critical(
+            "Recording is from unsupported camera (product ID 0x{:x})",
+            (uint16_t)header.ProductID
+        );
+        exit(1);
+    }
+    state.usb_product_id = header.ProductID;
+    state.full_roi = {header.ImageWidth, header.ImageHeight, 0, 0};
+    state.roi = state.full_roi;
+    state.img_type = (header.BytesPerPixel == 2) ? ASI_IMG_RAW16 : ASI_IMG_RAW8;
+
+    log->info(
+        "Replaying {}: {}x{} {}-bit frames from {} ({}).",
+        filename,
+        (int)header.ImageWidth,
+        (int)header.ImageHeight,
+        8 * camera::bytes_per_pixel(pipeline),
+        header.Instrument,
+        state.model->name
+    );
+    return header;
+}
+
+
+/*
+ * Feeds the transfers in a recording made with record=... back through the same dispatch path as
+ * live transfers, either with the original spacing between completions or as fast as frames can
+ * be taken from the pool. Capture times and camera settings in each Frame's metadata come from the
+ * recording so downstream output is reproducible.
+ */
+void camera::run_replay(Pipeline &pipeline, bool as_fast_as_possible)
+{
+    camera::State &state = pipeline.camera;
+    auto &log = pipeline.log;
+
+    CallbackArgs args;
+    args.pipeline = &pipeline;
+    args.in_flight = false;
+    libusb_transfer *transfer = (libusb_transfer *)calloc(1, sizeof(libusb_transfer));
+    transfer->user_data = &args;
+    transfer->endpoint = state.model->bulk_endpoint;
+
+    auto replay_start_ts = steady_clock::now();
+    auto replay_start_cpu = thread_cpu_time();
+    reset_stats(state);
+    int64_t first_monotonic_ns = -1;
+    UsbRecordEntry_t entry;
+    while (!end_program && read_all(state.replay_fd, &entry, sizeof(entry)))
+    {
+        FrameRef frame = get_unused_frame(pipeline);
+        if (!frame)
+        {
+            break;
+        }
+
+        // Transfers are sized for the ROI in effect when they were recorded
+        int64_t length = (int64_t)entry.Width * entry.Height * camera::bytes_per_pixel(pipeline);
+        if (entry.Width <= 0 || entry.Height <= 0 || length > (int64_t)frame->bufferSizeBytes() ||
+            entry.ActualLength < 0 || entry.ActualLength > length)
+        {
+            log->critical(
+                "Corrupt USB record: {}x{} frame, actual length {}",
+                (int)entry.Width,
+                (int)entry.Height,
+                (int)entry.ActualLength
+            );
+            exit(1);
+        }
+        transfer->length = length;
+        if (!read_all(state.replay_fd, const_cast<uint8_t *>(frame->frame_buffer_), entry.ActualLength))
+        {
+            log->warn("USB recording is truncated.");
+            break;
+        }
+
+        if (!as_fast_as_possible)
+        {
+            if (first_monotonic_ns < 0)
             {
-                ASI_LOG_ON_FAIL(
-                    ASISetControlValue,
-                    CamInfo.CameraID,
-                    ASI_EXPOSURE,
-                    camera_exposure_us,
-                    ASI_FALSE
-                );
-                exposure_us_prev = camera_exposure_us;
-                spdlog::info(
-                    "Camera exposure time set to {:6.3f} ms",
-                    (float)exposure_us_prev / 1.0e3
-                );
+                first_monotonic_ns = entry.MonotonicRawNs;
             }
+            std::this_thread::sleep_until(
+                replay_start_ts + nanoseconds(entry.MonotonicRawNs - first_monotonic_ns)
+            );
         }
+
+        FrameMetadata &metadata = frame->metadata_;
+        metadata.monotonic_raw_ns = entry.MonotonicRawNs;
+        metadata.utc_ns = entry.UtcNs;
+        metadata.gain = entry.Gain;
+        metadata.exposure_us = entry.ExposureUs;
+        metadata.width = entry.Width;
+        metadata.height = entry.Height;
+        metadata.start_x = entry.StartX;
+        metadata.start_y = entry.StartY;
+        metadata.bytes_per_pixel = camera::bytes_per_pixel(pipeline);
+
+        args.frame = std::move(frame);
+        args.in_flight = true;
+        state.transfers_in_flight++;
+        transfer->status = (libusb_transfer_status)entry.Status;
+        transfer->actual_length = entry.ActualLength;
+        dispatch_transfer(transfer);
+        state.completed_transfers.clear();
     }
 
-    libusb_close(dev_handle);
-    ASICloseCamera(CamInfo.CameraID);
+    duration<float> replay_elapsed = steady_clock::now() - replay_start_ts;
+    duration<double, std::micro> replay_cpu = thread_cpu_time() - replay_start_cpu;
+    log->info(
+        "Replayed {} frames in {:.2f} s ({:.2f} FPS, {:.1f} MB/s), {:.1f} us of CPU per frame.",
+        state.frame_count,
+        replay_elapsed.count(),
+        state.frame_count / replay_elapsed.count(),
+        state.frame_bytes_count / replay_elapsed.count() / 1e6,
+        (state.frame_count > 0) ? replay_cpu.count() / state.frame_count : 0.0
+    );
+
+    free(transfer);
+    (void)close(state.replay_fd);
+    state.replay_fd = -1;
 }
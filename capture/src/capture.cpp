@@ -3,29 +3,58 @@
 #include <csignal>
 #include <cstring>
 #include <deque>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <thread>
 #include <pthread.h>
-#include <mutex>
 #include <atomic>
-#include <condition_variable>
 #include <unistd.h>
 #include <spdlog/spdlog.h>
 #include <sys/syscall.h>
 #include <err.h>
 #include "Frame.h"
+#include "FrameArena.h"
 #include "agc.h"
 #include "disk.h"
+#include "placement.h"
 #include "preview.h"
 #include "camera.h"
+#include "CameraModel.h"
+#include "control.h"
+#include "Pipeline.h"
+#include "record.h"
+#include "rtlog.h"
+#include "trace.h"
 #include "SERFile.h"
 
 
 /*
- * This is the total number of Frame objects (frame buffers) that will be allocated. A larger
- * number increases memory usage but decreases the risk that the pool of available frames runs out
- * if for example the to_disk_queue gets backed up momentarily.
+ * The number of Frame objects (frame buffers) allocated for each camera is set by the pool option
+ * (see frame_pool_size()). A larger pool increases memory usage but decreases the risk that the
+ * pool of available frames runs out if for example the to-disk ring gets backed up momentarily.
+ * The rings between threads are sized for FRAME_POOL_MAX frames.
  */
-constexpr size_t FRAME_POOL_SIZE = 64;
+constexpr const char *FRAME_POOL_DEFAULT = "512M";
+constexpr size_t FRAME_POOL_MAX = 1024;
+static_assert(
+    FRAME_POOL_MAX >= 2 * camera::NUM_TRANSFERS_MAX + 4,
+    "Frame pool too small for transfer ring"
+);
+
+// Frame writes kept in flight by the disk thread when io_uring is available
+constexpr unsigned URING_DEPTH_DEFAULT = 8;
+
+// Chunk size in MiB by which writeback of SER files is paced (see SERFile::setWriteback()). Off
+// unless asked for: pacing makes the disk thread wait on the disk now and then, which only pays
+// off where write_benchmark shows the kernel's own bursts of writeback stalling it.
+constexpr long WRITEBACK_MIB_DEFAULT = 0;
+constexpr long WRITEBACK_MIB_MAX = 4096;
+
+// Roughly the most any of the supported cameras delivers over USB 3, for sizing the pool in
+// seconds of buffering
+constexpr double USB_BYTES_PER_SECOND_MAX = 400e6;
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -35,88 +64,92 @@ constexpr size_t FRAME_POOL_SIZE = 64;
 // All threads should end gracefully when this is true
 std::atomic_bool end_program = false;
 
-// Estimated rate of frames received from the camera
-std::atomic<float> camera_frame_rate = 0.0;
-
-// AGC enable state
-std::atomic_bool agc_enabled = false;
-
-// AGC outputs
-std::atomic_int camera_gain = camera::GAIN_MAX;
-std::atomic_int camera_exposure_us = camera::EXPOSURE_DEFAULT_US;
-
-// disk thread state
-std::atomic_bool disk_file_exists = false;
-std::atomic_bool disk_write_enabled = false;
-
-// std::deque is not thread safe
-std::mutex to_disk_deque_mutex;
-std::mutex to_preview_deque_mutex;
-std::mutex to_agc_deque_mutex;
-std::mutex unused_deque_mutex;
-
-std::condition_variable to_disk_deque_cv;
-std::condition_variable to_preview_deque_cv;
-std::condition_variable to_agc_deque_cv;
-std::condition_variable unused_deque_cv;
-
-// FIFOs holding pointers to frame objects
-std::deque<Frame *> to_disk_deque;
-std::deque<Frame *> to_preview_deque;
-std::deque<Frame *> to_agc_deque;
-std::deque<Frame *> unused_deque;
+// Rung when any pipeline queues a frame for the preview thread, which serves all pipelines
+Doorbell preview_doorbell;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // End globals declaration section
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+// One per camera (or recording being replayed). Everything else a pipeline's threads touch lives
+// in its Pipeline object.
+static std::deque<Pipeline> pipelines;
+
+// Replays still running; the last one to finish ends the program
+static std::atomic_int replays_remaining = 0;
 
-static void set_thread_priority(pthread_t thread, int policy, int priority)
+
+// Name the thread after its role and the pipeline it belongs to and apply the pipeline's placement
+// for that role
+static void place_thread(Pipeline &pipeline, std::thread &thread, const char *role)
 {
-    sched_param sch_params;
-    sch_params.sched_priority = priority;
-    if ((errno = pthread_setschedparam(thread, policy, &sch_params)))
-    {
-        char buf[256];
-        spdlog::critical("Failed to set thread priority to policy {}, priority {}: {}",
-            policy,
-            priority,
-            strerror_r(errno, buf, sizeof(buf))
-        );
-        exit(1);
+    char name[16];
+    snprintf(name, sizeof(name), "%s%d", role, pipeline.index);
+    set_thread_name(thread.native_handle(), name);
+
+    auto placement = pipeline.placements.find(role);
+    if (placement != pipeline.placements.end())
+    {
+        apply_placement(thread.native_handle(), placement->second, name);
     }
 }
 
-static void set_thread_name(pthread_t thread, const char *name)
+
+// Output file for each stripe of a recording: the file's name with _stripe<n> added, in each of
+// the +-separated directories in dirs. Just the file itself if dirs is null.
+static std::vector<std::string> stripe_paths(const char *filename, const char *dirs)
 {
-    if ((errno = pthread_setname_np(thread, name)))
+    if (dirs == nullptr)
     {
-        char buf[256];
-        spdlog::error(
-            "Failed to set thread name to '{}': {}",
-            name,
-            strerror_r(errno, buf, sizeof(buf))
-        );
+        return {filename};
     }
+
+    std::string stem = filename;
+    stem = stem.substr(stem.rfind('/') + 1);
+    if (stem.size() > 4 && stem.compare(stem.size() - 4, 4, ".ser") == 0)
+    {
+        stem.resize(stem.size() - 4);
+    }
+
+    std::vector<std::string> paths;
+    std::string list = dirs;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = std::min(list.find('+', start), list.size());
+        std::string dir = list.substr(start, end - start);
+        if (dir.empty())
+        {
+            errx(1, "Error: empty directory in stripes list '%s'", dirs);
+        }
+        paths.push_back(dir + "/" + stem + "_stripe" + std::to_string(paths.size()) + ".ser");
+        start = end + 1;
+    }
+    if (paths.size() < 2)
+    {
+        errx(1, "Error: stripes needs at least two directories, e.g. stripes=/mnt/a+/mnt/b");
+    }
+    return paths;
 }
 
 
 void sigint_handler(int signal)
 {
     end_program = true;
-    to_disk_deque_cv.notify_one();
-    to_preview_deque_cv.notify_one();
-    to_agc_deque_cv.notify_one();
-    unused_deque_cv.notify_one();
+    for (auto &pipeline : pipelines)
+    {
+        pipeline.notifyAll();
+    }
+    preview_doorbell.notify();
 }
 
 
+// Only returns if filename does not exist or the user agreed to overwrite it
 void check_if_file_exists(const char *filename)
 {
     if (access(filename, F_OK) == -1)
     {
         // the file doesn't already exist, so we're okay to create a new one
-        disk_file_exists = true;
         return;
     }
 
@@ -127,7 +160,6 @@ void check_if_file_exists(const char *filename)
         if (scanned == 1) {
             if (selection == 'y' || selection == 'Y') {
                 spdlog::info("User approved overwriting {}.", filename);
-                disk_file_exists = true;
                 return;
             } else if (selection == 'n' || selection == 'N' || selection == '\n') {
                 spdlog::critical("File {} exists and user declined to overwrite it.", filename);
@@ -150,97 +182,715 @@ void check_if_file_exists(const char *filename)
 }
 
 
+// Split a comma-separated list of per-camera values
+static std::vector<std::string> split_list(const char *list)
+{
+    std::vector<std::string> values;
+    std::string value;
+    for (const char *c = list; ; c++)
+    {
+        if (*c == ',' || *c == '\0')
+        {
+            values.push_back(value);
+            value.clear();
+            if (*c == '\0')
+            {
+                break;
+            }
+        }
+        else
+        {
+            value += *c;
+        }
+    }
+    return values;
+}
+
+
+// Value of a per-camera option for camera i. A single value applies to every camera.
+static const char *per_camera(const std::vector<std::string> &values, size_t i)
+{
+    if (values.empty())
+    {
+        return nullptr;
+    }
+    return values[(values.size() == 1) ? 0 : i].c_str();
+}
+
+
+/*
+ * Number of frames in a pool from the value of the pool option: a number of frames ("64"), a
+ * memory budget in MiB ("512M") or seconds of buffering at the fastest the camera could possibly
+ * fill buffers of frame_bytes ("2s"). The result is clamped so that there is always a ring's worth
+ * of transfers in flight and another waiting in the pool.
+ */
+static size_t frame_pool_size(const char *option, size_t frame_bytes, int num_transfers)
+{
+    char *suffix;
+    double value = strtod(option, &suffix);
+    if (suffix == option || value <= 0.0)
+    {
+        errx(1, "Error: cannot parse pool size '%s'", option);
+    }
+
+    double frames;
+    if (strcmp(suffix, "") == 0)
+    {
+        frames = value;
+    }
+    else if (strcmp(suffix, "M") == 0)
+    {
+        frames = value * (1 << 20) / frame_bytes;
+    }
+    else if (strcmp(suffix, "s") == 0)
+    {
+        frames = value * USB_BYTES_PER_SECOND_MAX / frame_bytes;
+    }
+    else
+    {
+        errx(1, "Error: pool size '%s' must be a frame count or end in M or s", option);
+    }
+
+    const size_t min_frames = 2 * num_transfers + 4;
+    return std::clamp((size_t)frames, min_frames, FRAME_POOL_MAX);
+}
+
+
+// Segment limits from the value of the segment option: a number of frames ("100000"), a size in
+// MiB or GiB ("4096M", "50G") or a duration in seconds ("600s")
+static SegmentLimits segment_limits(const char *option)
+{
+    char *suffix;
+    double value = strtod(option, &suffix);
+    if (suffix == option || value <= 0.0)
+    {
+        errx(1, "Error: cannot parse segment limit '%s'", option);
+    }
+
+    SegmentLimits limits;
+    if (strcmp(suffix, "") == 0)
+    {
+        limits.max_frames = value;
+    }
+    else if (strcmp(suffix, "M") == 0)
+    {
+        limits.max_bytes = value * (1 << 20);
+    }
+    else if (strcmp(suffix, "G") == 0)
+    {
+        limits.max_bytes = value * (1 << 30);
+    }
+    else if (strcmp(suffix, "s") == 0)
+    {
+        limits.max_ns = value * 1e9;
+    }
+    else
+    {
+        errx(1, "Error: segment limit '%s' must be a frame count or end in M, G or s", option);
+    }
+    if (limits.max_frames == 0 && limits.max_bytes == 0 && limits.max_ns == 0)
+    {
+        errx(1, "Error: segment limit '%s' is too small", option);
+    }
+    return limits;
+}
+
+
+// Roles of the threads each pipeline runs, as used in thread names and [role]_thread options
+static const char *const PIPELINE_THREAD_ROLES[] = {
+    "cam", "disk", "stripe", "agc", "control", "record", "housekeeping"
+};
+
+// Placement a pipeline's thread gets unless overridden by the [role]_thread option. The camera
+// and disk threads (and stripe writers) are latency-sensitive so they run with a real-time policy.
+static ThreadPlacement default_placement(const std::string &role)
+{
+    ThreadPlacement placement;
+    if (role == "cam" || role == "disk" || role == "stripe")
+    {
+        placement.policy = SCHED_RR;
+        placement.priority = 10;
+    }
+    else if (role == "housekeeping")
+    {
+        placement.policy = SCHED_OTHER;
+    }
+    return placement;
+}
+
+
+// Body of each pipeline's camera thread when capturing live
+static void capture_camera(Pipeline *pipeline, int num_transfers)
+{
+    pipeline->log->info("Camera thread id: {}", syscall(SYS_gettid));
+    camera::run_camera(*pipeline, num_transfers);
+    pipeline->log->info("Camera thread done.");
+}
+
+
+// Body of each pipeline's camera thread when replaying a recording
+static void replay_camera(Pipeline *pipeline, bool replay_fast)
+{
+    Pipeline &p = *pipeline;
+    p.log->info("Camera (replay) thread id: {}", syscall(SYS_gettid));
+    camera::run_replay(p, replay_fast);
+
+    // Let the disk and record threads finish with everything that was replayed
+    while (!end_program && !(p.to_disk_ring.empty() && p.to_record_ring.empty()))
+    {
+        usleep(10'000);
+    }
+    p.log->info("Camera (replay) thread done.");
+
+    if (--replays_remaining == 0)
+    {
+        sigint_handler(SIGINT);
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
     signal(SIGINT, sigint_handler);
 
-    spdlog::info("Main (camera) thread id: {}", syscall(SYS_gettid));
-
-    const char *cam_name = nullptr;
-    const char *filename = nullptr;
-    int binning = 1;
+    spdlog::info("Main thread id: {}", syscall(SYS_gettid));
+
+    // Lets the camera and disk threads log without waiting on the console (see rtlog.h)
+    rtlog::start();
+
+    // Options marked "per camera" take a comma-separated list with one value per camera, or a
+    // single value that applies to all of them
+    std::vector<std::string> cam_names;
+    std::vector<std::string> filenames;
+    std::vector<std::string> binnings;
+    std::vector<std::string> transfers;
+    std::vector<std::string> dma_options;
+    std::vector<std::string> hugepage_options;
+    std::vector<std::string> pool_options;
+    std::vector<std::string> pool_policies;
+    std::vector<std::string> uring_depths;
+    std::vector<std::string> direct_options;
+    std::vector<std::string> writeback_options;
+    std::vector<std::string> stripe_lists;
+    std::vector<std::string> segment_options;
+    std::vector<std::string> raw16_options;
+    std::vector<std::string> record_filenames;
+    std::vector<std::string> replay_filenames;
+    std::vector<std::string> cpu_lists;
+    std::map<std::string, std::vector<std::string>> thread_options;
+    for (auto role : PIPELINE_THREAD_ROLES)
+    {
+        thread_options[role];
+    }
+    thread_options["preview"];
+    thread_options["sdk"];
+    bool replay_fast = false;
+    std::string trace_filename;
+    camera::Roi tracking_roi = {640, 480, 0, 0};
     for (int i = 1; i < argc; ++i)
     {
         if (strncmp(argv[i], "camera=", 7) == 0)
         {
-            cam_name = argv[i] + 7;
+            cam_names = split_list(argv[i] + 7);
         }
         else if (strncmp(argv[i], "file=", 5) == 0)
         {
-            filename = argv[i] + 5;
+            filenames = split_list(argv[i] + 5);
         }
         else if (strncmp(argv[i], "binning=", 8) == 0)
         {
-            binning = std::stoi(argv[i] + 8);
+            binnings = split_list(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "transfers=", 10) == 0)
+        {
+            transfers = split_list(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "dma=", 4) == 0)
+        {
+            dma_options = split_list(argv[i] + 4);
+        }
+        else if (strncmp(argv[i], "hugepages=", 10) == 0)
+        {
+            hugepage_options = split_list(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "pool=", 5) == 0)
+        {
+            pool_options = split_list(argv[i] + 5);
+        }
+        else if (strncmp(argv[i], "pool_policy=", 12) == 0)
+        {
+            pool_policies = split_list(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "uring_depth=", 12) == 0)
+        {
+            uring_depths = split_list(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "direct=", 7) == 0)
+        {
+            direct_options = split_list(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "writeback=", 10) == 0)
+        {
+            writeback_options = split_list(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "stripes=", 8) == 0)
+        {
+            stripe_lists = split_list(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "segment=", 8) == 0)
+        {
+            segment_options = split_list(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "raw16=", 6) == 0)
+        {
+            raw16_options = split_list(argv[i] + 6);
+        }
+        else if (strncmp(argv[i], "record=", 7) == 0)
+        {
+            record_filenames = split_list(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "replay=", 7) == 0)
+        {
+            replay_filenames = split_list(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "replay_fast=", 12) == 0)
+        {
+            replay_fast = (std::stoi(argv[i] + 12) != 0);
+        }
+        else if (strncmp(argv[i], "trace=", 6) == 0)
+        {
+            trace_filename = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "cpus=", 5) == 0)
+        {
+            cpu_lists = split_list(argv[i] + 5);
+        }
+        else if (strstr(argv[i], "_thread=") != nullptr &&
+            thread_options.count(std::string(argv[i], strstr(argv[i], "_thread=") - argv[i])))
+        {
+            const char *role_end = strstr(argv[i], "_thread=");
+            thread_options[std::string(argv[i], role_end - argv[i])] = split_list(role_end + 8);
+        }
+        else if (strncmp(argv[i], "roi=", 4) == 0)
+        {
+            if (sscanf(argv[i] + 4, "%dx%d", &tracking_roi.width, &tracking_roi.height) != 2)
+            {
+                errx(1, "Error: roi must be given as [width]x[height]");
+            }
         }
         else
         {
             errx(
                 1,
                 "Error: Program option '%s' not recognized\n"
-                "Usage: %s file=[output_filename.ser] camera=[camera name]",
+                "Usage: %s file=[output_filename.ser] camera=[camera name] binning=[binning] "
+                "transfers=[bulk transfers in flight] dma=[0|1] hugepages=[0|1] "
+                "pool=[frames|MiB budget+M|seconds+s] "
+                "pool_policy=[drop_newest|drop_oldest|block] uring_depth=[writes in flight] "
+                "direct=[0|1] writeback=[MiB] stripes=[directory list] "
+                "segment=[frames|MiB+M|GiB+G|seconds+s] raw16=[0|1] "
+                "record=[usb_record_filename] replay=[usb_record_filename] replay_fast=[0|1] "
+                "cpus=[cpu list] [role]_thread=[policy[:priority]][@cpu list] "
+                "roi=[width]x[height] trace=[trace.json]\n"
+                "All options except replay_fast, roi, trace, preview_thread and sdk_thread take a "
+                "comma-separated list with one value per camera; a single value applies to all "
+                "cameras. CPU lists are given as ranges joined by +, e.g. cpus=0-1+4,2-3+5. "
+                "Directory lists are joined by + too; stripes splits each output file "
+                "round-robin across one file per directory, to be put back together with "
+                "ser_merge. Thread roles are cam, disk, stripe, agc, control, record, "
+                "housekeeping (disk monitor and segment closer), preview and sdk (threads "
+                "started by libasicamera2); policies are other, batch, idle, fifo "
+                "and rr, e.g. cam_thread=fifo:20@2. trace saves the life of every frame buffer "
+                "for chrome://tracing or ui.perfetto.dev.",
                 argv[i], argv[0]
             );
         }
     }
 
+    // Before any frame is taken from a pool, so that every frame's first trip is traced whole
+    if (!trace_filename.empty())
+    {
+        trace::enable();
+    }
+
+    // One pipeline per recording when replaying, otherwise one per camera named on the command
+    // line (or per output file, for cameras picked at the prompt)
+    const bool replay = !replay_filenames.empty();
+    const size_t num_cameras = replay ?
+        replay_filenames.size() :
+        std::max({cam_names.size(), filenames.size(), record_filenames.size(), (size_t)1});
+    if (replay && !cam_names.empty())
+    {
+        errx(1, "Error: camera cannot be combined with replay");
+    }
+    for (auto list : {
+        &cam_names, &binnings, &transfers, &dma_options, &hugepage_options, &pool_options,
+        &pool_policies, &uring_depths, &direct_options, &writeback_options,
+        &stripe_lists, &segment_options, &raw16_options, &cpu_lists
+    })
+    {
+        if (list->size() > 1 && list->size() != num_cameras)
+        {
+            errx(1, "Error: per-camera options must have 1 or %zu values", num_cameras);
+        }
+    }
+    for (auto role : PIPELINE_THREAD_ROLES)
+    {
+        if (thread_options[role].size() > 1 && thread_options[role].size() != num_cameras)
+        {
+            errx(1, "Error: %s_thread must have 1 or %zu values", role, num_cameras);
+        }
+    }
+    for (auto role : {"preview", "sdk"})
+    {
+        if (thread_options[role].size() > 1)
+        {
+            errx(1, "Error: %s_thread applies to all cameras and takes a single value", role);
+        }
+    }
+    for (auto list : {&filenames, &record_filenames})
+    {
+        if (!list->empty() && list->size() != num_cameras)
+        {
+            errx(1, "Error: file and record need one filename per camera (%zu)", num_cameras);
+        }
+    }
+
     // libasicamera2 threads will inherit this name
     set_thread_name(pthread_self(), "libasicamera2");
-    ASI_CAMERA_INFO CamInfo;
-    camera::init_camera(CamInfo, cam_name, binning);
-    set_thread_name(pthread_self(), "camera(main)");
-
-    // Create pool of frame buffers
-    Frame::WIDTH = CamInfo.MaxWidth / binning;
-    Frame::HEIGHT = CamInfo.MaxHeight / binning;
-    Frame::IMAGE_SIZE_BYTES = Frame::WIDTH * Frame::HEIGHT;
-    static std::deque<Frame> frames;
-    for(size_t i = 0; i < FRAME_POOL_SIZE; i++)
-    {
-        // Frame objects add themselves to unused_deque on construction
-        frames.emplace_back();
-    }
-
-    std::unique_ptr<SERFile> ser_file;
-    if (filename != nullptr) {
-        check_if_file_exists(filename);
-        ser_file.reset(new SERFile(
-            filename,
-            Frame::WIDTH,
-            Frame::HEIGHT,
-            (CamInfo.IsColorCam == ASI_TRUE) ? BAYER_RGGB : MONO,
-            8,
-            "",
-            CamInfo.Name,
-            ""
-        ));
-        spdlog::info("Creating output file {}.", filename);
-    } else {
-        spdlog::info("No output SER filename provided.");
-    }
-
-    // Start threads
-    static std::thread write_to_disk_thread(write_to_disk, ser_file.get());
-    static std::thread preview_thread(preview, CamInfo.IsColorCam == ASI_TRUE);
-    static std::thread agc_thread(agc);
-
-    // Set real-time priority for latency-sensitive threads.
-    set_thread_priority(pthread_self(), SCHED_RR, 10);
-    set_thread_priority(write_to_disk_thread.native_handle(), SCHED_RR, 10);
-
-    set_thread_name(write_to_disk_thread.native_handle(), "disk");
+
+    std::vector<Pipeline *> all_pipelines;
+    std::vector<int> num_transfers(num_cameras);
+    for (size_t i = 0; i < num_cameras; i++)
+    {
+        pipelines.emplace_back(i, FRAME_POOL_MAX);
+        Pipeline &pipeline = pipelines.back();
+        all_pipelines.push_back(&pipeline);
+        ASI_CAMERA_INFO &CamInfo = pipeline.CamInfo;
+
+        const char *value;
+        int binning = (value = per_camera(binnings, i)) ? std::stoi(value) : 1;
+        bool dma_buffers = (value = per_camera(dma_options, i)) ? (std::stoi(value) != 0) : true;
+        bool hugepages = (value = per_camera(hugepage_options, i)) ? (std::stoi(value) != 0) : true;
+        bool raw16 = (value = per_camera(raw16_options, i)) ? (std::stoi(value) != 0) : false;
+        num_transfers[i] = (value = per_camera(transfers, i)) ?
+            std::stoi(value) : camera::NUM_TRANSFERS_DEFAULT;
+        if (num_transfers[i] < 1 || num_transfers[i] > camera::NUM_TRANSFERS_MAX)
+        {
+            errx(1, "Error: transfers must be between 1 and %d", camera::NUM_TRANSFERS_MAX);
+        }
+        // cpus applies to all of the pipeline's threads unless [role]_thread says otherwise
+        const char *cpus = per_camera(cpu_lists, i);
+        for (auto role : PIPELINE_THREAD_ROLES)
+        {
+            ThreadPlacement placement = default_placement(role);
+            if (cpus != nullptr)
+            {
+                placement.cpus = parse_cpus(cpus);
+            }
+            if ((value = per_camera(thread_options[role], i)))
+            {
+                placement = parse_placement(value, placement);
+            }
+            pipeline.placements[role] = placement;
+        }
+
+        // A replay can wait for the consumers without losing anything, so it does by default
+        const char *policy = per_camera(pool_policies, i);
+        if (policy == nullptr)
+        {
+            pipeline.pool_policy = replay ? PoolPolicy::BLOCK : PoolPolicy::DROP_NEWEST;
+        }
+        else if (strcmp(policy, "drop_newest") == 0)
+        {
+            pipeline.pool_policy = PoolPolicy::DROP_NEWEST;
+        }
+        else if (strcmp(policy, "drop_oldest") == 0)
+        {
+            pipeline.pool_policy = PoolPolicy::DROP_OLDEST;
+        }
+        else if (strcmp(policy, "block") == 0)
+        {
+            pipeline.pool_policy = PoolPolicy::BLOCK;
+        }
+        else
+        {
+            errx(1, "Error: pool_policy must be drop_newest, drop_oldest or block");
+        }
+
+        if (replay)
+        {
+            // No camera is opened; everything the pipeline needs to know comes from the recording
+            UsbRecordHeader_t header = camera::init_replay(pipeline, replay_filenames[i].c_str());
+            snprintf(
+                CamInfo.Name,
+                sizeof(CamInfo.Name),
+                "%.*s",
+                (int)sizeof(header.Instrument),
+                header.Instrument
+            );
+            CamInfo.CameraID = -1;
+            CamInfo.MaxWidth = header.ImageWidth;
+            CamInfo.MaxHeight = header.ImageHeight;
+            CamInfo.IsColorCam = header.IsColor ? ASI_TRUE : ASI_FALSE;
+            binning = 1;
+            dma_buffers = false;
+            if (header.TransferLength != header.ImageWidth * header.ImageHeight * header.BytesPerPixel)
+            {
+                errx(1, "Error: recording transfer length does not match its frame size");
+            }
+        }
+        else
+        {
+            camera::init_camera(
+                pipeline,
+                per_camera(cam_names, i),
+                binning,
+                raw16 ? ASI_IMG_RAW16 : ASI_IMG_RAW8
+            );
+        }
+        pipeline.log->info("Pipeline {} is {}.", i, CamInfo.Name);
+
+        // Create pool of frame buffers. Each one can hold a full frame so the pool is reused
+        // as-is when the ROI changes. Buffers that can't have usbfs DMA memory are carved from
+        // one arena, which gives back whatever they didn't use.
+        camera::Roi full_frame = camera::full_frame_roi(pipeline);
+        size_t buffer_size = full_frame.width * full_frame.height * camera::bytes_per_pixel(pipeline);
+        const char *pool_option = per_camera(pool_options, i);
+        size_t pool_size = frame_pool_size(
+            pool_option ? pool_option : FRAME_POOL_DEFAULT,
+            buffer_size,
+            num_transfers[i]
+        );
+        pipeline.pool_low_water = num_transfers[i];
+        pipeline.frame_arena.reset(new FrameArena(pool_size, buffer_size, hugepages));
+        size_t num_dma_frames = 0;
+        for(size_t j = 0; j < pool_size; j++)
+        {
+            // Frame objects add themselves to unused_ring on construction
+            pipeline.frames.emplace_back(
+                pipeline,
+                buffer_size,
+                dma_buffers ? camera::usb_handle(pipeline) : nullptr,
+                pipeline.frame_arena.get()
+            );
+            num_dma_frames += pipeline.frames.back().isDma() ? 1 : 0;
+        }
+        FrameArena &arena = *pipeline.frame_arena;
+        arena.trim();
+
+        // Arena buffers are padded to whole pages
+        const size_t pool_bytes =
+            (pipeline.frames.size() - arena.buffersTaken()) * buffer_size + arena.bytesTaken();
+        pipeline.log->info(
+            "Allocated {} frame buffers ({} MiB), {} of them in usbfs DMA memory and {} in the "
+            "frame arena.",
+            pipeline.frames.size(),
+            pool_bytes >> 20,
+            num_dma_frames,
+            arena.buffersTaken()
+        );
+        if (arena.buffersTaken() > 0)
+        {
+            pipeline.log->info(
+                "Frame arena: {} MiB on {}, {}, prefaulted.",
+                arena.bytesTaken() >> 20,
+                arena.hugetlb() ? "2 MiB hugetlb pages" :
+                    arena.transparentHugepages() ? "transparent hugepages where granted" :
+                    "ordinary pages",
+                arena.locked() ? "locked in RAM" : "NOT locked in RAM"
+            );
+        }
+    }
+    set_thread_name(pthread_self(), "main");
+
+    // Output files and threads for each pipeline
+    for (auto &pipeline : pipelines)
+    {
+        const size_t i = pipeline.index;
+        ASI_CAMERA_INFO &CamInfo = pipeline.CamInfo;
+        camera::Roi full_frame = camera::full_frame_roi(pipeline);
+
+        std::vector<std::unique_ptr<SERFile>> ser_files;
+        const char *filename = per_camera(filenames, i);
+        if (filename != nullptr) {
+            std::vector<std::string> paths = stripe_paths(filename, per_camera(stripe_lists, i));
+            pipeline.disk_file_exists = true;
+            const char *direct = per_camera(direct_options, i);
+            const char *writeback = per_camera(writeback_options, i);
+            long writeback_mib = WRITEBACK_MIB_DEFAULT;
+            if (writeback != nullptr)
+            {
+                char *end;
+                writeback_mib = strtol(writeback, &end, 10);
+                if (end == writeback || *end != '\0' || writeback_mib < 0 ||
+                    writeback_mib > WRITEBACK_MIB_MAX)
+                {
+                    errx(
+                        1,
+                        "Error: writeback must be 0 (off) or a chunk size in MiB up to %ld",
+                        WRITEBACK_MIB_MAX
+                    );
+                }
+            }
+            for (const auto &path : paths)
+            {
+                check_if_file_exists(path.c_str());
+                ser_files.emplace_back(new SERFile(
+                    path.c_str(),
+                    full_frame.width,
+                    full_frame.height,
+                    (CamInfo.IsColorCam == ASI_TRUE) ? BAYER_RGGB : MONO,
+                    8 * camera::bytes_per_pixel(pipeline),
+                    "",
+                    CamInfo.Name,
+                    "",
+                    true,
+                    direct ? (std::stoi(direct) != 0) : false
+                ));
+                ser_files.back()->setWriteback((int64_t)writeback_mib << 20);
+                pipeline.log->info(
+                    "Creating output file {}{}.",
+                    path,
+                    ser_files.back()->directIo() ? " (direct I/O)" : ""
+                );
+            }
+            if (paths.size() > 1)
+            {
+                std::string merge_command = std::string("ser_merge ") + filename;
+                for (const auto &path : paths)
+                {
+                    merge_command += " " + path;
+                }
+                pipeline.log->info(
+                    "Frames are striped across {} files. To merge them: {}",
+                    paths.size(),
+                    merge_command
+                );
+            }
+            if (replay) {
+                // There may be nobody at the preview window to enable writes during a replay
+                pipeline.disk_write_enabled = true;
+            }
+        } else {
+            pipeline.log->info("No output SER filename provided.");
+        }
+
+        const char *record_filename = per_camera(record_filenames, i);
+        if (record_filename != nullptr) {
+            check_if_file_exists(record_filename);
+            UsbRecordHeader_t header;
+            header.VendorID = ZWO_VID;
+            header.ProductID = camera::usb_product_id(pipeline);
+            header.ImageWidth = full_frame.width;
+            header.ImageHeight = full_frame.height;
+            header.IsColor = (CamInfo.IsColorCam == ASI_TRUE) ? 1 : 0;
+            header.BytesPerPixel = camera::bytes_per_pixel(pipeline);
+            header.TransferLength = pipeline.frames.front().bufferSizeBytes();
+            strncpy(header.Instrument, CamInfo.Name, sizeof(header.Instrument) - 1);
+            camera::enable_recording(pipeline);
+            pipeline.record_thread = std::thread(record_usb, &pipeline, record_filename, header);
+            place_thread(pipeline, pipeline.record_thread, "record");
+            pipeline.log->info("Recording raw USB stream to {}.", record_filename);
+        }
+
+        // 0 writes every frame with write() from the disk thread
+        const char *value = per_camera(uring_depths, i);
+        int uring_depth = value ? std::stoi(value) : URING_DEPTH_DEFAULT;
+        if (uring_depth < 0 || uring_depth > 4096)
+        {
+            errx(1, "Error: uring_depth must be between 0 and 4096");
+        }
+        SegmentLimits limits;
+        if ((value = per_camera(segment_options, i)))
+        {
+            limits = segment_limits(value);
+        }
+        if (limits.max_frames > 0 && limits.max_frames < (int64_t)ser_files.size())
+        {
+            errx(1, "Error: segments must have at least one frame per stripe");
+        }
+        pipeline.disk_thread = std::thread(
+            write_to_disk,
+            &pipeline,
+            std::move(ser_files),
+            uring_depth,
+            limits
+        );
+        pipeline.agc_thread = std::thread(agc, &pipeline);
+        pipeline.control_thread = std::thread(control, &pipeline);
+        place_thread(pipeline, pipeline.disk_thread, "disk");
+        place_thread(pipeline, pipeline.agc_thread, "agc");
+        place_thread(pipeline, pipeline.control_thread, "control");
+    }
+
+    std::thread preview_thread(preview, all_pipelines, tracking_roi);
     set_thread_name(preview_thread.native_handle(), "preview");
-    set_thread_name(agc_thread.native_handle(), "agc");
+    if (const char *value = per_camera(thread_options["preview"], 0))
+    {
+        apply_placement(preview_thread.native_handle(), parse_placement(value), "preview");
+    }
 
-    // Get frames from camera and dispatch them to the other threads
-    camera::run_camera(CamInfo);
+    // Get frames from each camera (or recording) and dispatch them to the other threads
+    replays_remaining = replay ? num_cameras : 0;
+    for (auto &pipeline : pipelines)
+    {
+        if (replay)
+        {
+            pipeline.camera_thread = std::thread(replay_camera, &pipeline, replay_fast);
+        }
+        else
+        {
+            pipeline.camera_thread = std::thread(
+                capture_camera,
+                &pipeline,
+                num_transfers[pipeline.index]
+            );
+        }
+        place_thread(pipeline, pipeline.camera_thread, "cam");
+    }
 
-    spdlog::info("Main (camera) thread done, waiting for others to finish.");
+    // Threads that libasicamera2 started while the cameras were opened are still named after the
+    // main thread at the time
+    if (const char *value = per_camera(thread_options["sdk"], 0))
+    {
+        int count = apply_placement_by_name("libasicamera2", parse_placement(value));
+        spdlog::info("Applied sdk_thread placement to {} libasicamera2 threads.", count);
+    }
+    log_thread_placement();
 
-    write_to_disk_thread.join();
+    spdlog::info("Main thread waiting for pipelines to finish.");
+
+    for (auto &pipeline : pipelines)
+    {
+        pipeline.camera_thread.join();
+        pipeline.disk_thread.join();
+        pipeline.agc_thread.join();
+        pipeline.control_thread.join();
+        if (pipeline.record_thread.joinable())
+        {
+            pipeline.record_thread.join();
+        }
+    }
     preview_thread.join();
-    agc_thread.join();
 
+    for (auto &pipeline : pipelines)
+    {
+        // Frame buffers may belong to the USB device handle so they must be freed before it is
+        // closed
+        pipeline.releaseFrames();
+        if (!replay)
+        {
+            camera::close_camera(pipeline);
+        }
+    }
+
+    if (!trace_filename.empty())
+    {
+        trace::write(trace_filename.c_str());
+    }
+
+    rtlog::stop();
     spdlog::info("Main thread ending.");
 
     return 0;
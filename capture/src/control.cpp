@@ -0,0 +1,109 @@
+#include "control.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "camera.h"
+#include "Pipeline.h"
+
+
+// All threads should end gracefully when this is true
+extern std::atomic_bool end_program;
+
+
+// Queue a new value for a camera control to be applied by the pipeline's control thread. Does not
+// block on the camera.
+void request_control_value(Pipeline &pipeline, ASI_CONTROL_TYPE control, long value)
+{
+    std::unique_lock<std::mutex> control_lock(pipeline.control_mutex);
+    pipeline.pending_controls[control] = value;
+    control_lock.unlock();
+    pipeline.control_cv.notify_one();
+}
+
+
+static void log_control_value(Pipeline &pipeline, ASI_CONTROL_TYPE control, long value)
+{
+    switch (control)
+    {
+        case ASI_GAIN:
+            pipeline.log->info("Camera gain set to {:03d}", value);
+            break;
+        case ASI_EXPOSURE:
+            pipeline.log->info("Camera exposure time set to {:6.3f} ms", (float)value / 1.0e3);
+            break;
+        default:
+            pipeline.log->info("Camera control {} set to {}", (int)control, value);
+            break;
+    }
+}
+
+
+/*
+ * This function is intended to be run as a thread. It owns all calls to `ASISetControlValue()`
+ * once streaming has started so that a slow round-trip to the camera never delays the thread that
+ * reaps and resubmits USB transfers. Requests that pile up while a batch is being applied are
+ * coalesced so that only the most recent value of each control is sent to the camera.
+ */
+void control(Pipeline *pipeline)
+{
+    pipeline->log->info("Control thread id: {}", syscall(SYS_gettid));
+    const int camera_id = pipeline->camera.camera_id;
+
+    // Most recent value successfully applied for each control
+    std::map<ASI_CONTROL_TYPE, long> applied_controls;
+
+    // Initial settings
+    request_control_value(*pipeline, ASI_GAIN, pipeline->camera_gain);
+    request_control_value(*pipeline, ASI_EXPOSURE, pipeline->camera_exposure_us);
+
+    std::map<ASI_CONTROL_TYPE, long> batch;
+    while (!end_program)
+    {
+        std::unique_lock<std::mutex> control_lock(pipeline->control_mutex);
+        pipeline->control_cv.wait(
+            control_lock,
+            [&]{return !pipeline->pending_controls.empty() || end_program;}
+        );
+        if (end_program)
+        {
+            break;
+        }
+        batch.swap(pipeline->pending_controls);
+        control_lock.unlock();
+
+        for (auto [control_type, value] : batch)
+        {
+            auto applied = applied_controls.find(control_type);
+            if (applied != applied_controls.end() && applied->second == value)
+            {
+                continue;
+            }
+
+            // A negative ID means there is no camera attached (replaying a recording)
+            ASI_ERROR_CODE ret = (camera_id < 0) ?
+                ASI_SUCCESS : ASISetControlValue(camera_id, control_type, value, ASI_FALSE);
+            if (ret != ASI_SUCCESS)
+            {
+                pipeline->log->error("ASISetControlValue returned  {}", camera::asi_error_str(ret));
+                continue;
+            }
+            applied_controls[control_type] = value;
+            if (control_type == ASI_GAIN)
+            {
+                pipeline->camera_gain_applied = value;
+            }
+            else if (control_type == ASI_EXPOSURE)
+            {
+                pipeline->camera_exposure_us_applied = value;
+            }
+            log_control_value(*pipeline, control_type, value);
+        }
+        batch.clear();
+    }
+
+    pipeline->log->info("Control thread ending.");
+}
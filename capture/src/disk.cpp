@@ -1,84 +1,444 @@
 #include "disk.h"
-#include <deque>
+#include <algorithm>
 #include <atomic>
-#include <mutex>
 #include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unistd.h>
 #include <err.h>
 #include <spdlog/spdlog.h>
 #include <sys/syscall.h>
-#include <sys/statvfs.h>
+#include "DiskMonitor.h"
 #include "Frame.h"
+#include "Pipeline.h"
+#include "placement.h"
+#include "Ring.h"
+#include "rtlog.h"
+#include "UringWriter.h"
 
 
-constexpr int64_t MIN_FREE_DISK_SPACE_BYTES = 100 << 20; // 100 MiB
-
 extern std::atomic_bool end_program;
 
-extern std::mutex to_disk_deque_mutex;
-extern std::condition_variable to_disk_deque_cv;
-extern std::deque<Frame *> to_disk_deque;
 
-extern std::atomic_bool disk_file_exists;
-extern std::atomic_bool disk_write_enabled;
+/*
+ * Closes finished SER segments on a thread of its own. Writing the trailer of a long segment,
+ * giving back its unused preallocated space and closing it can take a while, and the threads
+ * writing frames must not stall at a segment boundary. Files are closed in the order they are
+ * handed over; the destructor waits for all of them.
+ */
+class SegmentCloser
+{
+public:
+    explicit SegmentCloser(Pipeline &p) :
+        log_(p.log),
+        thread_(&SegmentCloser::run, this)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "closer%d", p.index);
+        set_thread_name(thread_.native_handle(), name);
+        auto placement = p.placements.find("housekeeping");
+        place_housekeeping_thread(
+            thread_.native_handle(),
+            name,
+            (placement != p.placements.end()) ? placement->second : ThreadPlacement()
+        );
+    }
 
+    ~SegmentCloser()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
 
-// Writes frames of data to disk as quickly as possible. Run as a thread.
-void write_to_disk(SERFile *ser_file)
+    // Any thread. The file must not be using a writer any more (see SERFile::releaseWriter()).
+    void close(std::unique_ptr<SERFile> file)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            files_.push_back(std::move(file));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            cv_.wait(lock, [this]{return !files_.empty() || stopping_;});
+            if (files_.empty())
+            {
+                return;
+            }
+            std::unique_ptr<SERFile> file = std::move(files_.front());
+            files_.pop_front();
+
+            lock.unlock();
+            log_->info("Closing finished SER segment {}.", file->FILENAME);
+            file.reset();
+            lock.lock();
+        }
+    }
+
+    std::shared_ptr<spdlog::logger> log_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<SERFile>> files_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+
+// True if a segment that already holds frames frames of frame_bytes each, the first of which
+// arrived at start_ns, has no room under the limits for another that arrived at utc_ns. A segment
+// always takes min_frames frames, however small the limits: at least one so that none is left
+// without frames, and one per stripe so that every stripe's file of the segment gets one.
+static bool segment_full(
+    const SegmentLimits &limits,
+    int64_t frames,
+    int64_t min_frames,
+    size_t frame_bytes,
+    int64_t start_ns,
+    int64_t utc_ns
+)
 {
-    spdlog::info("Disk thread id: {}", syscall(SYS_gettid));
+    if (frames < min_frames)
+    {
+        return false;
+    }
+
+    // Header, frames and trailer
+    int64_t bytes = sizeof(SERHeader_t) + (frames + 1) * (frame_bytes + sizeof(int64_t));
+    return (limits.max_frames > 0 && frames >= limits.max_frames) ||
+        (limits.max_bytes > 0 && bytes > limits.max_bytes) ||
+        (limits.max_ns > 0 && utc_ns - start_ns >= limits.max_ns);
+}
 
-    struct statvfs disk_stats;
-    int32_t frame_count = 0;
+
+// Continue in a new segment for frames of the given size. The finished segment goes to closer;
+// the new one takes over its writer.
+static void next_segment(
+    Pipeline &p,
+    std::unique_ptr<SERFile> &ser_file,
+    SegmentCloser &closer,
+    int32_t width,
+    int32_t height
+)
+{
+    std::unique_ptr<SERFile> next = ser_file->nextSegment(width, height);
+    ser_file->releaseWriter();
+    closer.close(std::move(ser_file));
+    ser_file = std::move(next);
+    RTLOG_INFO(p.log, "Writing to new SER segment {}.", ser_file->FILENAME);
+}
+
+
+// What the disk thread hands a stripe writer: a frame, or word that the frame size has changed
+// and the stripe must go on in a new segment, or both
+struct StripeItem
+{
+    FrameRef frame;
+
+    // Non-zero to start a new segment for frames of this size before writing frame (if any)
+    int32_t new_width = 0;
+    int32_t new_height = 0;
+};
+
+// One file of a striped recording and the thread that writes it
+struct Stripe
+{
+    std::unique_ptr<SERFile> file;
+    SpscRing<StripeItem> ring;
+    std::thread thread;
+
+    Stripe(std::unique_ptr<SERFile> file, size_t ring_capacity) :
+        file(std::move(file)),
+        ring(ring_capacity)
+    {}
+};
+
+
+static std::unique_ptr<UringWriter> make_writer(Pipeline &p, SERFile &file, unsigned uring_depth)
+{
+    std::unique_ptr<UringWriter> writer;
+    if (!file.directIo() && uring_depth > 0)
+    {
+        writer = UringWriter::create(p, uring_depth);
+        file.setWriter(writer.get());
+    }
+    return writer;
+}
+
+
+// Body of a stripe writer thread. Writes the frames the disk thread queues for the stripe to the
+// stripe's own file.
+static void write_stripe(
+    Pipeline *pipeline,
+    Stripe *stripe,
+    unsigned uring_depth,
+    SegmentCloser *closer
+)
+{
+    Pipeline &p = *pipeline;
+    p.log->info("Stripe writer for {} thread id: {}", stripe->file->FILENAME, syscall(SYS_gettid));
+
+    std::unique_ptr<UringWriter> writer = make_writer(p, *stripe->file, uring_depth);
 
     while (!end_program)
     {
-        // Get next frame from deque
-        std::unique_lock<std::mutex> to_disk_deque_lock(to_disk_deque_mutex);
-        to_disk_deque_cv.wait(
-            to_disk_deque_lock,
-            [&]{return !to_disk_deque.empty() || end_program;}
-        );
+        while (writer != nullptr && writer->inFlight() > 0 && stripe->ring.empty())
+        {
+            writer->reap(true);
+        }
+
+        stripe->ring.waitNotEmpty([]{return (bool)end_program;});
         if (end_program)
         {
             break;
         }
-        Frame *frame = to_disk_deque.back();
-        to_disk_deque.pop_back();
-        to_disk_deque_lock.unlock();
+        StripeItem item;
+        if (!stripe->ring.pop(item))
+        {
+            continue;
+        }
+
+        if (item.new_width != 0)
+        {
+            next_segment(p, stripe->file, *closer, item.new_width, item.new_height);
+        }
 
-        if (disk_write_enabled && ser_file != nullptr)
+        if (item.frame)
         {
-            // Check free disk space (but not every single frame)
-            if (frame_count % 100 == 0)
+            item.frame.setHolder("disk stripe");
+            stripe->file->addFrame(std::move(item.frame));
+        }
+    }
+
+    // The file waits for its writes in flight when it is closed, so it must go before the writer
+    stripe->file.reset();
+    writer.reset();
+}
+
+
+// Start a writer thread for each of the files of a striped recording
+static std::vector<std::unique_ptr<Stripe>> start_stripes(
+    Pipeline &p,
+    std::vector<std::unique_ptr<SERFile>> &ser_files,
+    unsigned uring_depth,
+    SegmentCloser &closer
+)
+{
+    // Room for every frame in the pool with a new-segment item ahead of each, plus the item for a
+    // segment that has no frame yet. Segments reached through the limits hold a frame for every
+    // stripe (see segment_full()), so only frame size changes coming faster than one frame per
+    // stripe can queue more, and then the disk thread waits for room.
+    const size_t ring_capacity = 2 * p.frames.size() + 1;
+
+    std::vector<std::unique_ptr<Stripe>> stripes;
+    for (auto &file : ser_files)
+    {
+        stripes.emplace_back(new Stripe(std::move(file), ring_capacity));
+        Stripe &stripe = *stripes.back();
+        stripe.thread = std::thread(write_stripe, &p, &stripe, uring_depth, &closer);
+
+        char name[16];
+        snprintf(name, sizeof(name), "stripe%d.%zu", p.index, stripes.size() - 1);
+        set_thread_name(stripe.thread.native_handle(), name);
+        auto placement = p.placements.find("stripe");
+        if (placement != p.placements.end())
+        {
+            apply_placement(stripe.thread.native_handle(), placement->second, name);
+        }
+    }
+    return stripes;
+}
+
+
+// Writes frames of data to disk as quickly as possible. Run as a thread. The thread owns the SER
+// file and rolls over to a new segment whenever the frame geometry changes (see
+// camera::request_roi()) or the segment reaches one of segment_limits. With several files it
+// instead deals the frames out to one writer thread per file, round-robin, restarting from the
+// first file in each segment so that ser_merge can put them back in order.
+void write_to_disk(
+    Pipeline *pipeline,
+    std::vector<std::unique_ptr<SERFile>> ser_files,
+    unsigned uring_depth,
+    SegmentLimits segment_limits
+)
+{
+    Pipeline &p = *pipeline;
+    p.log->info("Disk thread id: {}", syscall(SYS_gettid));
+
+    // Declared first so that it is the last to go, once every file has been handed to it
+    SegmentCloser closer(p);
+
+    std::unique_ptr<SERFile> ser_file;
+    std::unique_ptr<UringWriter> writer;
+    std::vector<std::unique_ptr<Stripe>> stripes;
+    std::unique_ptr<DiskMonitor> monitor;
+    int32_t width = 0;
+    int32_t height = 0;
+    size_t next_stripe = 0;
+    if (!ser_files.empty())
+    {
+        width = ser_files.front()->imageWidth();
+        height = ser_files.front()->imageHeight();
+
+        // Segments are always created alongside the first files, so these cover all of them
+        std::vector<std::string> paths;
+        for (const auto &file : ser_files)
+        {
+            paths.push_back(file->FILENAME);
+        }
+        monitor = std::make_unique<DiskMonitor>(p, paths);
+    }
+    if (ser_files.size() == 1)
+    {
+        ser_file = std::move(ser_files.front());
+        writer = make_writer(p, *ser_file, uring_depth);
+    }
+    else if (ser_files.size() > 1)
+    {
+        stripes = start_stripes(p, ser_files, uring_depth, closer);
+    }
+
+    // Frames in the current segment (across all stripes), and when the first of them arrived
+    int64_t segment_frames = 0;
+    int64_t segment_start_ns = 0;
+
+    while (!end_program)
+    {
+        // Frames being written go back to the pool as their writes complete, so only sleep on
+        // the ring once there are none left in flight
+        while (writer != nullptr && writer->inFlight() > 0 && p.to_disk_ring.empty())
+        {
+            writer->reap(true);
+        }
+
+        // Get next frame from ring
+        p.to_disk_ring.waitNotEmpty([]{return (bool)end_program;});
+        if (end_program)
+        {
+            break;
+        }
+        FrameRef frame;
+        if (!p.to_disk_ring.pop(frame))
+        {
+            continue;
+        }
+        frame.setHolder("disk");
+
+        // With the DROP_OLDEST pool policy, frames are discarded from the head of the ring
+        // unwritten while the pool is low so that the camera thread keeps getting buffers
+        const bool drop = p.pool_policy == PoolPolicy::DROP_OLDEST &&
+            p.unused_ring.size() < p.pool_low_water;
+
+        if (drop && p.disk_write_enabled)
+        {
+            p.frames_dropped++;
+        }
+        else if (p.disk_write_enabled && (ser_file != nullptr || !stripes.empty()))
+        {
+            // The monitor thread keeps track of free space, so this costs no system call
+            if (!monitor->spaceOk())
+            {
+                RTLOG_WARN(
+                    p.log,
+                    "Disk is nearly full or can't be checked! Disabled writes: frames going to "
+                    "bit bucket!"
+                );
+                p.disk_write_enabled = false;
+            }
+
+            const bool new_size = frame->metadata_.width != width ||
+                frame->metadata_.height != height;
+            if (new_size || segment_full(
+                segment_limits,
+                segment_frames,
+                std::max<int64_t>(1, stripes.size()),
+                frame->imageSizeBytes(),
+                segment_start_ns,
+                frame->metadata_.utc_ns
+            ))
             {
-                if (statvfs(ser_file->FILENAME.c_str(), &disk_stats) != 0)
+                width = frame->metadata_.width;
+                height = frame->metadata_.height;
+                if (new_size)
                 {
-                    char buf[256];
-                    spdlog::error(
-                        "Tried to check disk space with statvfs but the call failed: {}",
-                        strerror_r(errno, buf, sizeof(buf))
-                    );
+                    RTLOG_INFO(p.log, "Frame size changed to {}x{}.", width, height);
                 }
                 else
                 {
-                    int64_t free_bytes = disk_stats.f_bsize * disk_stats.f_bavail;
-                    if (free_bytes <= MIN_FREE_DISK_SPACE_BYTES)
+                    RTLOG_INFO(
+                        p.log,
+                        "SER segment limit reached after {} frames.",
+                        segment_frames
+                    );
+                }
+                segment_frames = 0;
+
+                // Stripes start their new segments together, beginning with the first stripe
+                if (ser_file != nullptr)
+                {
+                    next_segment(p, ser_file, closer, width, height);
+                }
+                // Losing one of these would put the stripes' segment numbers out of step, so wait
+                // for the stripe writer to make room rather than drop it
+                for (auto &stripe : stripes)
+                {
+                    if (!stripe->ring.push({FrameRef(), width, height}))
                     {
-                        spdlog::warn(
-                            "Disk is nearly full! Disabled writes: frames going to bit bucket!"
-                        );
-                        disk_write_enabled = false;
+                        RTLOG_WARN(p.log, "Stripe ring is full; waiting to start a new segment.");
+                        while (!stripe->ring.push({FrameRef(), width, height}) && !end_program)
+                        {
+                            std::this_thread::yield();
+                        }
                     }
                 }
+                next_stripe = 0;
             }
+            if (segment_frames == 0)
+            {
+                segment_start_ns = frame->metadata_.utc_ns;
+            }
+            segment_frames++;
 
-            ser_file->addFrame(*frame);
+            if (ser_file != nullptr)
+            {
+                ser_file->addFrame(std::move(frame));
+            }
+            else
+            {
+                Stripe &stripe = *stripes[next_stripe];
+                next_stripe = (next_stripe + 1) % stripes.size();
+                frame.setHolder("to-stripe ring");
+                if (!stripe.ring.push({std::move(frame)}))
+                {
+                    RTLOG_ERROR(p.log, "Stripe ring is full; this should never happen.");
+                }
+            }
         }
 
-        frame->decrRefCount();
-        frame_count++;
+        frame.reset();
     }
 
-    spdlog::info("Disk thread ending.");
+    for (auto &stripe : stripes)
+    {
+        stripe->ring.notify();
+        stripe->thread.join();
+    }
+
+    // The file waits for its writes in flight when it is closed, so it must go before the writer
+    ser_file.reset();
+    writer.reset();
+
+    p.log->info("Disk thread ending.");
 }
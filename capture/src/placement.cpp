@@ -0,0 +1,352 @@
+#include "placement.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <err.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+struct PolicyName
+{
+    const char *name;
+    int policy;
+};
+
+static const PolicyName POLICY_NAMES[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR},
+};
+
+
+static const char *policy_name(int policy)
+{
+    for (const auto &entry : POLICY_NAMES)
+    {
+        if (entry.policy == policy)
+        {
+            return entry.name;
+        }
+    }
+    return "?";
+}
+
+
+cpu_set_t parse_cpus(const char *list)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    const char *c = list;
+    while (*c != '\0')
+    {
+        int first;
+        int last;
+        int consumed;
+        if (sscanf(c, "%d-%d%n", &first, &last, &consumed) == 2)
+        {
+            c += consumed;
+        }
+        else if (sscanf(c, "%d%n", &first, &consumed) == 1)
+        {
+            last = first;
+            c += consumed;
+        }
+        else
+        {
+            errx(1, "Error: cannot parse CPU list '%s'", list);
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            errx(1, "Error: invalid CPU range in '%s'", list);
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+        if (*c == '+')
+        {
+            c++;
+        }
+        else if (*c != '\0')
+        {
+            errx(1, "Error: cannot parse CPU list '%s'", list);
+        }
+    }
+    return cpus;
+}
+
+
+std::string format_cpus(const cpu_set_t &cpus)
+{
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &cpus))
+        {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus))
+        {
+            last++;
+        }
+        list += (list.empty() ? "" : "+") + std::to_string(cpu);
+        if (last > cpu)
+        {
+            list += "-" + std::to_string(last);
+        }
+        cpu = last;
+    }
+    return list.empty() ? "none" : list;
+}
+
+
+ThreadPlacement parse_placement(const char *spec, const ThreadPlacement &defaults)
+{
+    ThreadPlacement placement = defaults;
+
+    std::string sched(spec);
+    size_t at = sched.find('@');
+    if (at != std::string::npos)
+    {
+        placement.cpus = parse_cpus(sched.c_str() + at + 1);
+        sched.resize(at);
+    }
+    if (sched.empty())
+    {
+        return placement;
+    }
+
+    std::string name = sched.substr(0, sched.find(':'));
+    placement.policy = -1;
+    for (const auto &entry : POLICY_NAMES)
+    {
+        if (name == entry.name)
+        {
+            placement.policy = entry.policy;
+        }
+    }
+    if (placement.policy == -1)
+    {
+        errx(1, "Error: unknown scheduling policy in '%s'", spec);
+    }
+
+    placement.priority = 0;
+    if (name.size() < sched.size())
+    {
+        char *end;
+        placement.priority = strtol(sched.c_str() + name.size() + 1, &end, 10);
+        if (*end != '\0')
+        {
+            errx(1, "Error: cannot parse priority in '%s'", spec);
+        }
+    }
+    if (placement.priority < sched_get_priority_min(placement.policy) ||
+        placement.priority > sched_get_priority_max(placement.policy))
+    {
+        errx(
+            1,
+            "Error: priority for policy %s must be between %d and %d",
+            name.c_str(),
+            sched_get_priority_min(placement.policy),
+            sched_get_priority_max(placement.policy)
+        );
+    }
+    return placement;
+}
+
+
+void set_thread_name(pthread_t thread, const char *name)
+{
+    if ((errno = pthread_setname_np(thread, name)))
+    {
+        char buf[256];
+        spdlog::error(
+            "Failed to set thread name to '{}': {}",
+            name,
+            strerror_r(errno, buf, sizeof(buf))
+        );
+    }
+}
+
+
+// Exit with a message if one of the scheduling calls failed (err is an errno value)
+static void check_placement_result(int err, const char *what, const char *name)
+{
+    if (err != 0)
+    {
+        char buf[256];
+        spdlog::critical(
+            "Failed to set {} of thread '{}': {}",
+            what,
+            name,
+            strerror_r(err, buf, sizeof(buf))
+        );
+        exit(1);
+    }
+}
+
+
+void apply_placement(pthread_t thread, const ThreadPlacement &placement, const char *name)
+{
+    if (CPU_COUNT(&placement.cpus) > 0)
+    {
+        int err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &placement.cpus);
+        check_placement_result(err, "CPU affinity", name);
+    }
+    if (placement.policy != -1)
+    {
+        sched_param param;
+        param.sched_priority = placement.priority;
+        int err = pthread_setschedparam(thread, placement.policy, &param);
+        check_placement_result(err, "scheduling policy", name);
+    }
+}
+
+
+void place_housekeeping_thread(
+    pthread_t thread,
+    const char *name,
+    const ThreadPlacement &placement
+)
+{
+    ThreadPlacement housekeeping = placement;
+    if (housekeeping.policy == -1)
+    {
+        housekeeping.policy = SCHED_OTHER;
+        housekeeping.priority = 0;
+    }
+
+    // What a thread started by the disk thread inherits depends on whether the disk thread has
+    // been placed yet. The main thread's id is the process id.
+    if (CPU_COUNT(&housekeeping.cpus) == 0 &&
+        sched_getaffinity(getpid(), sizeof(cpu_set_t), &housekeeping.cpus) != 0)
+    {
+        CPU_ZERO(&housekeeping.cpus);
+    }
+    apply_placement(thread, housekeeping, name);
+}
+
+
+// Calls fn(tid, name) for every thread of this process
+template <typename Function>
+static void for_each_thread(Function fn)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == nullptr)
+    {
+        char buf[256];
+        spdlog::error("Cannot list threads: {}", strerror_r(errno, buf, sizeof(buf)));
+        return;
+    }
+    while (dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        pid_t tid = atoi(entry->d_name);
+
+        char path[64];
+        char name[32] = "";
+        snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+        FILE *comm = fopen(path, "r");
+        if (comm == nullptr)
+        {
+            // The thread ended while the directory was being read
+            continue;
+        }
+        if (fgets(name, sizeof(name), comm) != nullptr)
+        {
+            name[strcspn(name, "\n")] = '\0';
+        }
+        fclose(comm);
+
+        fn(tid, name);
+    }
+    closedir(dir);
+}
+
+
+int apply_placement_by_name(const char *name, const ThreadPlacement &placement)
+{
+    int count = 0;
+    for_each_thread([&](pid_t tid, const char *thread_name)
+    {
+        if (strcmp(thread_name, name) != 0 || tid == syscall(SYS_gettid))
+        {
+            return;
+        }
+        if (CPU_COUNT(&placement.cpus) > 0)
+        {
+            int ret = sched_setaffinity(tid, sizeof(cpu_set_t), &placement.cpus);
+            check_placement_result((ret == 0) ? 0 : errno, "CPU affinity", name);
+        }
+        if (placement.policy != -1)
+        {
+            sched_param param;
+            param.sched_priority = placement.priority;
+            int ret = sched_setscheduler(tid, placement.policy, &param);
+            check_placement_result((ret == 0) ? 0 : errno, "scheduling policy", name);
+        }
+        count++;
+    });
+    return count;
+}
+
+
+void log_thread_placement()
+{
+    // Same list syntax as the kernel's except that ranges are separated by commas
+    cpu_set_t isolated;
+    CPU_ZERO(&isolated);
+    FILE *file = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (file != nullptr)
+    {
+        char list[256] = "";
+        if (fgets(list, sizeof(list), file) != nullptr)
+        {
+            list[strcspn(list, "\n")] = '\0';
+            for (char *c = list; *c != '\0'; c++)
+            {
+                *c = (*c == ',') ? '+' : *c;
+            }
+            isolated = parse_cpus(list);
+        }
+        fclose(file);
+    }
+    spdlog::info(
+        "Isolated CPUs: {}. Thread placement:",
+        (CPU_COUNT(&isolated) > 0) ? format_cpus(isolated) : "none"
+    );
+
+    for_each_thread([&](pid_t tid, const char *name)
+    {
+        int policy = sched_getscheduler(tid);
+        sched_param param = {};
+        sched_getparam(tid, &param);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        sched_getaffinity(tid, sizeof(cpus), &cpus);
+
+        cpu_set_t not_isolated;
+        CPU_XOR(&not_isolated, &cpus, &isolated);
+        CPU_AND(&not_isolated, &not_isolated, &cpus);
+
+        spdlog::info(
+            "  {:<15} tid {:>7}: {:<5} priority {:>2}, CPUs {}{}",
+            name,
+            tid,
+            policy_name(policy),
+            param.sched_priority,
+            format_cpus(cpus),
+            (CPU_COUNT(&isolated) > 0 && CPU_COUNT(&not_isolated) == 0) ? " (isolated)" : ""
+        );
+    });
+}
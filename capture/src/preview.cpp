@@ -1,17 +1,19 @@
 #include "preview.h"
+#include <algorithm>
 #include <cmath>
 #include <deque>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
 #include <unistd.h>
 #include <spdlog/spdlog.h>
+#include <string>
 #include <sys/syscall.h>
-#include <spdlog/spdlog.h>
+#include <vector>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include "Frame.h"
 #include "camera.h"
+#include "control.h"
+#include "Pipeline.h"
 
 
 using namespace std::chrono;
@@ -20,27 +22,6 @@ using namespace std::chrono;
 // All threads should end gracefully when this is true
 extern std::atomic_bool end_program;
 
-// Estimated rate of frames received from the camera
-extern std::atomic<float> camera_frame_rate;
-
-// AGC enable state
-extern std::atomic_bool agc_enabled;
-
-// AGC outputs (possibly under manual control here)
-extern std::atomic_int camera_gain;
-extern std::atomic_int camera_exposure_us;
-
-// disk write state
-extern std::atomic_bool disk_file_exists;
-extern std::atomic_bool disk_write_enabled;
-
-extern std::mutex to_preview_deque_mutex;
-extern std::condition_variable to_preview_deque_cv;
-extern std::deque<Frame *> to_preview_deque;
-
-// trackbar positions
-int gain_trackbar_pos;
-int exposure_trackbar_pos;
 
 constexpr char PREVIEW_WINDOW_NAME[] = "Live Preview";
 constexpr char HISTOGRAM_WINDOW_NAME[] = "Histogram";
@@ -49,8 +30,32 @@ constexpr char HISTOGRAM_WINDOW_NAME[] = "Histogram";
 // Calculating the histogram is a non-trivial computational load
 constexpr double HISTOGRAM_UPDATE_PERIOD_S = 0.25;
 
+// Number of capture timestamps used in calculating the preview frame rate
+constexpr int NUM_FRAMERATE_FRAMES = 10;
+
+
+// The preview and histogram windows for one pipeline
+struct PreviewWindows
+{
+    Pipeline *pipeline;
+    std::string preview_name;
+    std::string histogram_name;
+
+    // trackbar positions
+    int gain_trackbar_pos;
+    int exposure_trackbar_pos;
+
+    std::deque<int64_t> timestamps = std::deque<int64_t>(NUM_FRAMERATE_FRAMES, 0);
+    steady_clock::time_point last_histogram_update = steady_clock::now();
+    bool preview_window_open = true;
+    bool histogram_window_open = true;
+
+    // Geometry of the most recent frame shown; width is 0 until the first frame arrives
+    camera::Roi last_roi = {0, 0, 0, 0};
+};
 
-void make_histogram(cv::Mat &src)
+
+void make_histogram(cv::Mat &src, const std::string &window_name)
 {
     using namespace cv;
 
@@ -67,7 +72,7 @@ void make_histogram(cv::Mat &src)
     calcHist(&src, 1, channels, Mat(), hist, 1, histSize, ranges, true, false);
 
     // plot histogram on logarithmic y-axis
-    double maxVal = log10(Frame::WIDTH * Frame::HEIGHT);
+    double maxVal = log10(src.total());
     int scale = 2;
     int height = 256;
     Mat histImg = Mat::zeros(height, 256*scale, CV_8UC3);
@@ -83,265 +88,404 @@ void make_histogram(cv::Mat &src)
             -1
         );
     }
-    imshow(HISTOGRAM_WINDOW_NAME, histImg);
+    imshow(window_name, histImg);
 }
 
 
 void gain_trackbar_callback(int pos, void *userdata)
 {
-    gain_trackbar_pos = std::clamp(pos, camera::GAIN_MIN, camera::GAIN_MAX);
+    PreviewWindows &windows = *(PreviewWindows *)userdata;
+    Pipeline &pipeline = *windows.pipeline;
+    windows.gain_trackbar_pos = std::clamp(pos, camera::GAIN_MIN, camera::GAIN_MAX);
 
     // Gain under manual control
-    if (!agc_enabled)
+    if (!pipeline.agc_enabled)
     {
-        camera_gain = gain_trackbar_pos;
+        pipeline.camera_gain = windows.gain_trackbar_pos;
+        request_control_value(pipeline, ASI_GAIN, pipeline.camera_gain);
     }
 }
 
 void exposure_trackbar_callback(int pos, void *userdata)
 {
-    exposure_trackbar_pos = std::clamp(pos, camera::EXPOSURE_MIN_US, camera::EXPOSURE_MAX_US);
+    PreviewWindows &windows = *(PreviewWindows *)userdata;
+    Pipeline &pipeline = *windows.pipeline;
+    windows.exposure_trackbar_pos = std::clamp(
+        pos,
+        camera::EXPOSURE_MIN_US,
+        camera::EXPOSURE_MAX_US
+    );
 
     // Exposure time under manual control
-    if (!agc_enabled)
+    if (!pipeline.agc_enabled)
     {
-        camera_exposure_us = exposure_trackbar_pos;
+        pipeline.camera_exposure_us = windows.exposure_trackbar_pos;
+        request_control_value(pipeline, ASI_EXPOSURE, pipeline.camera_exposure_us);
     }
 }
 
 void agc_mode_trackbar_callback(int pos, void *userdata)
 {
+    PreviewWindows &windows = *(PreviewWindows *)userdata;
+    Pipeline &pipeline = *windows.pipeline;
+
     // AGC is being disabled so update gain and exposure time to trackbar positions
-    if (agc_enabled == true && pos == 1)
+    if (pipeline.agc_enabled == true && pos == 1)
     {
-        camera_gain = gain_trackbar_pos;
-        camera_exposure_us = exposure_trackbar_pos;
+        pipeline.camera_gain = windows.gain_trackbar_pos;
+        pipeline.camera_exposure_us = windows.exposure_trackbar_pos;
+        request_control_value(pipeline, ASI_GAIN, pipeline.camera_gain);
+        request_control_value(pipeline, ASI_EXPOSURE, pipeline.camera_exposure_us);
     }
-    agc_enabled = (pos == 1) ? true : false;
+    pipeline.agc_enabled = (pos == 1) ? true : false;
 }
 
 
-void preview(bool color)
+static void create_windows(PreviewWindows &windows)
 {
-    spdlog::info("Preview thread id: {}", syscall(SYS_gettid));
+    Pipeline &pipeline = *windows.pipeline;
+    const char *preview_name = windows.preview_name.c_str();
+    const char *histogram_name = windows.histogram_name.c_str();
 
-    cv::namedWindow(PREVIEW_WINDOW_NAME, cv::WINDOW_NORMAL);
-    cv::resizeWindow(PREVIEW_WINDOW_NAME, 640, 480);
-    cv::namedWindow(HISTOGRAM_WINDOW_NAME, 1);
+    cv::namedWindow(preview_name, cv::WINDOW_NORMAL);
+    cv::resizeWindow(preview_name, 640, 480);
+    cv::namedWindow(histogram_name, 1);
 
     cv::createTrackbar(
         "agc mode",
-        HISTOGRAM_WINDOW_NAME,
+        histogram_name,
         nullptr,
         1,
         agc_mode_trackbar_callback,
-        nullptr
+        &windows
     );
 
-    gain_trackbar_pos = camera_gain;
+    windows.gain_trackbar_pos = pipeline.camera_gain;
     cv::createTrackbar(
         "gain",
-        HISTOGRAM_WINDOW_NAME,
-        &gain_trackbar_pos,
+        histogram_name,
+        &windows.gain_trackbar_pos,
         camera::GAIN_MAX,
         gain_trackbar_callback,
-        nullptr
+        &windows
     );
 
-    exposure_trackbar_pos = camera_exposure_us;
+    windows.exposure_trackbar_pos = pipeline.camera_exposure_us;
     cv::createTrackbar(
         "exposure time [us]",
-        HISTOGRAM_WINDOW_NAME,
-        &exposure_trackbar_pos,
+        histogram_name,
+        &windows.exposure_trackbar_pos,
         camera::EXPOSURE_MAX_US,
         exposure_trackbar_callback,
-        nullptr
+        &windows
     );
+}
 
-    // deque of 10 timestamps for use in calculating frame rate
-    constexpr int NUM_FRAMERATE_FRAMES = 10;
-    std::deque<steady_clock::time_point> timestamps(NUM_FRAMERATE_FRAMES, steady_clock::now());
 
-    auto last_histogram_update = steady_clock::now();
-    bool preview_window_open = true;
-    bool histogram_window_open = true;
+// Update the windows belonging to the pipeline that frame came from
+static void show_frame(PreviewWindows &windows, Frame *frame)
+{
+    Pipeline &pipeline = *windows.pipeline;
+    const char *preview_name = windows.preview_name.c_str();
+    const char *histogram_name = windows.histogram_name.c_str();
 
-    while (!end_program)
+    const int width = frame->metadata_.width;
+    const int height = frame->metadata_.height;
+    windows.last_roi = {width, height, frame->metadata_.start_x, frame->metadata_.start_y};
+
+    cv::Mat img_raw;
+    if (frame->metadata_.bytes_per_pixel == 2)
     {
-        // Get frame from deque
-        std::unique_lock<std::mutex> to_preview_deque_lock(to_preview_deque_mutex);
-        to_preview_deque_cv.wait(
-            to_preview_deque_lock,
-            [&]{return !to_preview_deque.empty() || end_program;}
-        );
-        if (end_program)
+        // Keep the most significant byte of each 16-bit pixel for display. convertTo() is
+        // vectorized, which matters at full frame size and high frame rates.
+        cv::Mat img_raw16(height, width, CV_16UC1, (void *)(frame->frame_buffer_));
+        img_raw16.convertTo(img_raw, CV_8U, 1.0 / 256.0);
+    }
+    else
+    {
+        img_raw = cv::Mat(height, width, CV_8UC1, (void *)(frame->frame_buffer_));
+    }
+
+    // Calculate framerate over last NUM_FRAMERATE_FRAMES
+    auto &timestamps = windows.timestamps;
+    timestamps.push_front(frame->metadata_.monotonic_raw_ns);
+    timestamps.pop_back();
+    duration<float> elapsed = nanoseconds(timestamps.front() - timestamps.back());
+    float preview_frame_rate = (float)(NUM_FRAMERATE_FRAMES - 1) / elapsed.count();
+
+    // Check if the preview window is actually still open
+    if (windows.preview_window_open)
+    {
+        try
         {
-            break;
+            // Should throw cv::Exception if the window was closed
+            cv::getWindowImageRect(preview_name);
         }
-        while (to_preview_deque.size() > 1)
+        catch (cv::Exception &e)
         {
-            // Discard all but most recent frame
-            to_preview_deque.back()->decrRefCount();
-            to_preview_deque.pop_back();
+            pipeline.log->warn("Preview window closed.");
+            windows.preview_window_open = false;
         }
-        Frame *frame = to_preview_deque.back();
-        to_preview_deque.pop_back();
-        to_preview_deque_lock.unlock();
+    }
 
-        if (preview_window_open == false && histogram_window_open == false)
+    if (windows.preview_window_open)
+    {
+        char window_title[512];
+        if (pipeline.disk_file_exists)
         {
-            // both windows were closed by the user; no need for this thread anymore
-            frame->decrRefCount();
-            break;
+            snprintf(
+                window_title,
+                sizeof(window_title),
+                "%s %.1f FPS (%.1f FPS from camera) frame %u, %dx%d, gain %d, %.3f ms %s",
+                preview_name,
+                preview_frame_rate,
+                (float)pipeline.camera_frame_rate,
+                frame->metadata_.sensor_index,
+                width,
+                height,
+                frame->metadata_.gain,
+                frame->metadata_.exposure_us / 1.0e3,
+                (pipeline.disk_write_enabled) ? (
+                    "writing frames to disk (press s to pause)"
+                ) : (
+                    "disk write paused (press s to resume)"
+                )
+            );
+        }
+        else
+        {
+            snprintf(
+                window_title,
+                sizeof(window_title),
+                "%s %.1f FPS (%.1f FPS from camera) frame %u, %dx%d, gain %d, %.3f ms",
+                preview_name,
+                preview_frame_rate,
+                (float)pipeline.camera_frame_rate,
+                frame->metadata_.sensor_index,
+                width,
+                height,
+                frame->metadata_.gain,
+                frame->metadata_.exposure_us / 1.0e3
+            );
         }
+        cv::setWindowTitle(preview_name, window_title);
 
-        cv::Mat img_raw(Frame::HEIGHT, Frame::WIDTH, CV_8UC1, (void *)(frame->frame_buffer_));
+        // Debayer if color camera
+        cv::Mat img_preview;
+        if (pipeline.CamInfo.IsColorCam == ASI_TRUE)
+        {
+            cv::cvtColor(img_raw, img_preview, cv::COLOR_BayerBG2BGR);
+        }
+        else
+        {
+            // Must make a copy so that crosshairs added later do not modify the original frame.
+            // Modifications to the original frame could end up being written to disk.
+            img_preview = img_raw.clone();
+        }
 
-        // Calculate framerate over last NUM_FRAMERATE_FRAMES
-        auto now = steady_clock::now();
-        timestamps.push_front(now);
-        auto then = timestamps.back();
-        timestamps.pop_back();
-        duration<float> elapsed = now - then;
-        float preview_frame_rate = (float)(NUM_FRAMERATE_FRAMES - 1) / elapsed.count();
-
-        // Check if the preview window is actually still open
-        if (preview_window_open)
+        // Add grey crosshairs
+        cv::line(
+            img_preview,
+            cv::Point(width / 2, 0),
+            cv::Point(width / 2, height - 1),
+            cv::Scalar(50, 50, 50),
+            1
+        );
+        cv::line(
+            img_preview,
+            cv::Point(0, height / 2),
+            cv::Point(width - 1, height / 2),
+            cv::Scalar(50, 50, 50),
+            1
+        );
+
+        // Show image with crosshairs in a window
+        cv::imshow(preview_name, img_preview);
+    }
+
+    // Check if the histogram window is actually still open
+    if (windows.histogram_window_open)
+    {
+        try
         {
-            try
-            {
-                // Should throw cv::Exception if the window was closed
-                cv::getWindowImageRect(PREVIEW_WINDOW_NAME);
-            }
-            catch (cv::Exception &e)
-            {
-                spdlog::warn("Preview window closed.");
-                preview_window_open = false;
-            }
+            // Should throw cv::Exception if the window was closed
+            cv::getWindowImageRect(histogram_name);
+        }
+        catch (cv::Exception &e)
+        {
+            pipeline.log->warn("Histogram window closed.");
+            windows.histogram_window_open = false;
         }
+    }
 
-        if (preview_window_open)
+    if (windows.histogram_window_open)
+    {
+        // Display histogram
+        auto now = steady_clock::now();
+        elapsed = now - windows.last_histogram_update;
+        if (elapsed.count() >= HISTOGRAM_UPDATE_PERIOD_S)
         {
-            char window_title[512];
-            if (disk_file_exists)
-            {
-                sprintf(
-                    window_title,
-                    "%s %.1f FPS (%.1f FPS from camera) %s",
-                    PREVIEW_WINDOW_NAME,
-                    preview_frame_rate,
-                    (float)camera_frame_rate,
-                    (disk_write_enabled) ? (
-                        "writing frames to disk (press s to pause)"
-                    ) : (
-                        "disk write paused (press s to resume)"
-                    )
-                );
-            }
-            else
-            {
-                sprintf(
-                    window_title,
-                    "%s %.1f FPS (%.1f FPS from camera)",
-                    PREVIEW_WINDOW_NAME,
-                    preview_frame_rate,
-                    (float)camera_frame_rate
-                );
-            }
-            cv::setWindowTitle(PREVIEW_WINDOW_NAME, window_title);
+            make_histogram(img_raw, windows.histogram_name);
+            windows.last_histogram_update = now;
+        }
+    }
+
+    if (pipeline.agc_enabled)
+    {
+        cv::setTrackbarPos("exposure time [us]", histogram_name, pipeline.camera_exposure_us);
+        cv::setTrackbarPos("gain", histogram_name, pipeline.camera_gain);
+    }
+}
 
-            // Debayer if color camera
-            cv::Mat img_preview;
-            if (color)
-            {
-                cv::cvtColor(img_raw, img_preview, cv::COLOR_BayerBG2BGR);
-            }
-            else
-            {
-                // Must make a copy so that crosshairs added later do not modify the original frame.
-                // Modifications to the original frame could end up being written to disk.
-                img_preview = img_raw.clone();
-            }
 
-            // Add grey crosshairs
-            cv::line(
-                img_preview,
-                cv::Point(Frame::WIDTH / 2, 0),
-                cv::Point(Frame::WIDTH / 2, Frame::HEIGHT - 1),
-                cv::Scalar(50, 50, 50),
-                1
+static void toggle_disk_write(Pipeline &pipeline)
+{
+    if (pipeline.disk_file_exists) {
+        pipeline.disk_write_enabled = !pipeline.disk_write_enabled;
+        if (pipeline.disk_write_enabled)
+        {
+            pipeline.log->info(
+                "Resumed writing frames to disk. "
+                "Press s with preview window in focus to stop."
             );
-            cv::line(
-                img_preview,
-                cv::Point(0, Frame::HEIGHT / 2),
-                cv::Point(Frame::WIDTH - 1, Frame::HEIGHT / 2),
-                cv::Scalar(50, 50, 50),
-                1
+        }
+        else
+        {
+            pipeline.log->info(
+                "Paused writing frames to disk. "
+                "Press s with preview window in focus to resume."
             );
-
-            // Show image with crosshairs in a window
-            cv::imshow(PREVIEW_WINDOW_NAME, img_preview);
         }
+    } else {
+        pipeline.log->warn("No SER output filename was provided! Not writing to disk.");
+    }
+}
+
+
+static void toggle_roi(PreviewWindows &windows, camera::Roi tracking_roi)
+{
+    Pipeline &pipeline = *windows.pipeline;
+    const camera::Roi &last = windows.last_roi;
+    if (last.width == 0)
+    {
+        return;
+    }
+
+    camera::Roi full = camera::full_frame_roi(pipeline);
+    if (last.width == full.width && last.height == full.height)
+    {
+        // Center the tracking ROI on the crosshairs of the current frame
+        camera::Roi roi = tracking_roi;
+        roi.start_x = last.start_x + (last.width - roi.width) / 2;
+        roi.start_y = last.start_y + (last.height - roi.height) / 2;
+        pipeline.log->info(
+            "Switching to {}x{} tracking ROI. Press r with preview window in focus to "
+            "return to full frame.",
+            roi.width,
+            roi.height
+        );
+        camera::request_roi(pipeline, roi);
+    }
+    else
+    {
+        pipeline.log->info("Switching to full frame.");
+        camera::request_roi(pipeline, full);
+    }
+}
+
+
+/*
+ * Runs the preview and histogram windows for every pipeline. HighGUI is not thread safe so there
+ * is one preview thread however many cameras are running. Keys pressed in any preview window apply
+ * to all cameras. Pressing r toggles between the full frame and tracking_roi centered on the
+ * crosshairs, which allows a much higher frame rate for small targets. Only the size of
+ * tracking_roi is used.
+ */
+void preview(std::vector<Pipeline *> pipelines, camera::Roi tracking_roi)
+{
+    spdlog::info("Preview thread id: {}", syscall(SYS_gettid));
+
+    // Window names only need telling apart when there is more than one camera
+    std::deque<PreviewWindows> all_windows;
+    for (auto pipeline : pipelines)
+    {
+        std::string suffix = (pipelines.size() > 1) ? (" " + pipeline->log->name()) : "";
+        all_windows.push_back(PreviewWindows{
+            pipeline,
+            PREVIEW_WINDOW_NAME + suffix,
+            HISTOGRAM_WINDOW_NAME + suffix
+        });
+        create_windows(all_windows.back());
+    }
 
-        // Check if the histogram window is actually still open
-        if (histogram_window_open)
+    auto any_frame_queued = [&]{
+        return std::any_of(
+            pipelines.begin(),
+            pipelines.end(),
+            [](Pipeline *pipeline){return !pipeline->to_preview_ring.empty();}
+        );
+    };
+
+    std::vector<FrameRef> frames;
+    while (!end_program)
+    {
+        // Get frames from the pipelines' rings, at most one per pipeline
+        preview_doorbell.wait([&]{return any_frame_queued() || end_program;});
+        if (end_program)
         {
-            try
-            {
-                // Should throw cv::Exception if the window was closed
-                cv::getWindowImageRect(HISTOGRAM_WINDOW_NAME);
-            }
-            catch (cv::Exception &e)
+            break;
+        }
+        frames.clear();
+        for (auto pipeline : pipelines)
+        {
+            FrameRef frame;
+            if (pipeline->to_preview_ring.pop(frame))
             {
-                spdlog::warn("Histogram window closed.");
-                histogram_window_open = false;
+                frame.setHolder("preview");
+                frames.push_back(std::move(frame));
             }
         }
 
-        if (histogram_window_open)
+        bool any_window_open = false;
+        for (auto &windows : all_windows)
         {
-            // Display histogram
-            now = steady_clock::now();
-            elapsed = now - last_histogram_update;
-            if (elapsed.count() >= HISTOGRAM_UPDATE_PERIOD_S)
-            {
-                make_histogram(img_raw);
-                last_histogram_update = now;
-            }
+            any_window_open |= windows.preview_window_open || windows.histogram_window_open;
+        }
+        if (!any_window_open)
+        {
+            // all windows were closed by the user; no need for this thread anymore
+            break;
         }
 
-        if (agc_enabled)
+        for (auto &frame : frames)
         {
-            cv::setTrackbarPos("exposure time [us]", HISTOGRAM_WINDOW_NAME, camera_exposure_us);
-            cv::setTrackbarPos("gain", HISTOGRAM_WINDOW_NAME, camera_gain);
+            for (auto &windows : all_windows)
+            {
+                if (windows.pipeline == &frame->pipeline())
+                {
+                    show_frame(windows, frame.get());
+                }
+            }
         }
 
         char key = (char)cv::waitKey(1);
 
         if (key == 's')
         {
-            if (disk_file_exists) {
-                disk_write_enabled = !disk_write_enabled;
-                if (disk_write_enabled)
-                {
-                    spdlog::info(
-                        "Resumed writing frames to disk. "
-                        "Press s with preview window in focus to stop."
-                    );
-                }
-                else
-                {
-                    spdlog::info(
-                        "Paused writing frames to disk. "
-                        "Press s with preview window in focus to resume."
-                    );
-                }
-            } else {
-                spdlog::warn("No SER output filename was provided! Not writing to disk.");
+            for (auto pipeline : pipelines)
+            {
+                toggle_disk_write(*pipeline);
+            }
+        }
+        else if (key == 'r')
+        {
+            for (auto &windows : all_windows)
+            {
+                toggle_roi(windows, tracking_roi);
             }
         }
 
-        frame->decrRefCount();
+        frames.clear();
     }
 
     spdlog::info("Preview thread ending.");
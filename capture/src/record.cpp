@@ -0,0 +1,85 @@
+#include "record.h"
+#include <atomic>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "Frame.h"
+#include "Pipeline.h"
+
+
+extern std::atomic_bool end_program;
+
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n = write(fd, buf, len);
+    if (n < 0)
+    {
+        char errbuf[256];
+        spdlog::critical("USB record write failed: {}", strerror_r(errno, errbuf, sizeof(errbuf)));
+        exit(1);
+    }
+    else if (n != static_cast<ssize_t>(len))
+    {
+        spdlog::critical("USB record write incomplete ({}/{})", n, len);
+        exit(1);
+    }
+}
+
+
+/*
+ * Writes every completed bulk transfer, including failed ones, to a raw USB stream recording so
+ * the exact sequence and timing of deliveries can be replayed later with camera::run_replay().
+ * Run as a thread. The camera thread dispatches frames to this thread via a lock-free ring in the
+ * order their transfers completed.
+ */
+void record_usb(Pipeline *pipeline, const char *filename, UsbRecordHeader_t header)
+{
+    Pipeline &p = *pipeline;
+    p.log->info("Record thread id: {}", syscall(SYS_gettid));
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        char buf[256];
+        p.log->critical("open({}) failed: {}", filename, strerror_r(errno, buf, sizeof(buf)));
+        exit(1);
+    }
+    write_all(fd, &header, sizeof(header));
+
+    int64_t record_count = 0;
+    while (true)
+    {
+        // Get next frame from ring. Unlike the other consumers this one drains the ring before
+        // ending so that the recording is complete.
+        p.to_record_ring.waitNotEmpty([]{return (bool)end_program;});
+        FrameRef frame;
+        if (!p.to_record_ring.pop(frame))
+        {
+            break;
+        }
+        frame.setHolder("record");
+
+        const FrameMetadata &metadata = frame->metadata_;
+        UsbRecordEntry_t entry;
+        entry.MonotonicRawNs = metadata.monotonic_raw_ns;
+        entry.UtcNs = metadata.utc_ns;
+        entry.Gain = metadata.gain;
+        entry.ExposureUs = metadata.exposure_us;
+        entry.Status = metadata.transfer_status;
+        entry.ActualLength = std::min<int32_t>(metadata.actual_length, frame->imageSizeBytes());
+        entry.Width = metadata.width;
+        entry.Height = metadata.height;
+        entry.StartX = metadata.start_x;
+        entry.StartY = metadata.start_y;
+        write_all(fd, &entry, sizeof(entry));
+        write_all(fd, frame->frame_buffer_, entry.ActualLength);
+
+        frame.reset();
+        record_count++;
+    }
+
+    (void)close(fd);
+    p.log->info("Record thread ending; {} transfers recorded to {}.", record_count, filename);
+}
@@ -0,0 +1,193 @@
+#include "rtlog.h"
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include "placement.h"
+#include "Ring.h"
+
+
+// Records each thread can have waiting for the logger thread
+constexpr size_t QUEUE_CAPACITY = 256;
+
+// How often the logger thread looks for records, and reports suppressed messages
+constexpr std::chrono::milliseconds POLL_PERIOD(10);
+constexpr std::chrono::seconds REPORT_PERIOD(1);
+
+
+// One per thread that has logged through rtlog. Never freed, since the logger thread may
+// still be reading one whose thread has ended.
+struct LogQueue
+{
+    SpscRing<rtlog::Record> ring{QUEUE_CAPACITY};
+    std::atomic<int64_t> lost = 0;
+    LogQueue *next = nullptr;
+};
+
+// Lists that only ever grow, pushed onto with compare-and-swap
+static std::atomic<LogQueue *> queues = nullptr;
+static std::atomic<rtlog::Site *> sites = nullptr;
+
+static thread_local LogQueue *thread_queue = nullptr;
+
+static std::atomic_bool logger_running = false;
+static std::atomic_bool logger_stopping = false;
+static std::mutex start_stop_mutex;
+static std::thread logger_thread;
+
+template <typename T>
+static void list_push(std::atomic<T *> &head, T *item)
+{
+    item->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(item->next, item, std::memory_order_release)) {}
+}
+
+
+// Hand every queued record to spdlog
+static void drain()
+{
+    for (LogQueue *queue = queues.load(std::memory_order_acquire); queue; queue = queue->next)
+    {
+        rtlog::Record record;
+        while (queue->ring.pop(record))
+        {
+            record.logger->log(
+                record.time,
+                spdlog::source_loc{},
+                record.level,
+                spdlog::string_view_t(record.text, record.length)
+            );
+        }
+        int64_t lost = queue->lost.exchange(0, std::memory_order_relaxed);
+        if (lost > 0)
+        {
+            spdlog::warn("{} log messages lost to a full log queue.", lost);
+        }
+    }
+}
+
+
+static void report_suppressed()
+{
+    for (rtlog::Site *site = sites.load(std::memory_order_acquire); site; site = site->next)
+    {
+        int64_t suppressed = site->suppressed.exchange(0, std::memory_order_acquire);
+        if (suppressed > 0)
+        {
+            site->logger.load(std::memory_order_relaxed)->log(
+                site->level.load(std::memory_order_relaxed),
+                "Suppressed {} more messages like \"{}\".",
+                suppressed,
+                site->format.load(std::memory_order_relaxed)
+            );
+        }
+    }
+}
+
+
+static void run_logger()
+{
+    auto last_report = std::chrono::steady_clock::now();
+    while (!logger_stopping)
+    {
+        drain();
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= REPORT_PERIOD)
+        {
+            report_suppressed();
+            last_report = now;
+        }
+        std::this_thread::sleep_for(POLL_PERIOD);
+    }
+    drain();
+    report_suppressed();
+}
+
+
+void rtlog::start()
+{
+    std::lock_guard<std::mutex> lock(start_stop_mutex);
+    if (logger_running)
+    {
+        return;
+    }
+    logger_stopping = false;
+    logger_thread = std::thread(run_logger);
+    set_thread_name(logger_thread.native_handle(), "logger");
+    place_housekeeping_thread(logger_thread.native_handle(), "logger");
+
+    logger_running = true;
+
+    static bool at_exit_registered = false;
+    if (!at_exit_registered)
+    {
+        at_exit_registered = true;
+        atexit(stop);
+    }
+}
+
+void rtlog::stop()
+{
+    std::lock_guard<std::mutex> lock(start_stop_mutex);
+    if (!logger_running)
+    {
+        return;
+    }
+
+    // From here on messages go straight to spdlog; the logger thread passes on what is queued
+    logger_running = false;
+    logger_stopping = true;
+    logger_thread.join();
+}
+
+bool rtlog::running()
+{
+    return logger_running.load(std::memory_order_relaxed);
+}
+
+bool rtlog::admit(
+    Site &site,
+    spdlog::logger *logger,
+    spdlog::level::level_enum level,
+    const char *format
+)
+{
+    if (!site.listed.exchange(true, std::memory_order_relaxed))
+    {
+        list_push(sites, &site);
+    }
+
+    // The coarse clock is read without a system call and is plenty for counting per second
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t second = site.second.load(std::memory_order_relaxed);
+    if (second != ts.tv_sec &&
+        site.second.compare_exchange_strong(second, ts.tv_sec, std::memory_order_relaxed))
+    {
+        site.count.store(0, std::memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) < SITE_BURST)
+    {
+        return true;
+    }
+
+    site.format.store(format, std::memory_order_relaxed);
+    site.logger.store(logger, std::memory_order_relaxed);
+    site.level.store(level, std::memory_order_relaxed);
+    site.suppressed.fetch_add(1, std::memory_order_release);
+    return false;
+}
+
+void rtlog::push(Record &record)
+{
+    if (thread_queue == nullptr)
+    {
+        thread_queue = new LogQueue;
+        list_push(queues, thread_queue);
+    }
+    if (!thread_queue->ring.push(std::move(record)))
+    {
+        thread_queue->lost.fetch_add(1, std::memory_order_relaxed);
+    }
+}
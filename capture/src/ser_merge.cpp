@@ -0,0 +1,285 @@
+// Rebuilds a single SER file from the stripes of a striped recording (see the stripes option of
+// capture). Usage:
+//
+// ser_merge [output.ser] [stripe0.ser] [stripe1.ser] ...
+//
+// The stripes must be listed in stripe order. Frame n of the recording is frame n / N of stripe
+// n % N where N is the number of stripes, so the stripes' frame counts may differ by at most one.
+// Frames are copied with copy_file_range() so that on most filesystems the data never passes
+// through user space; where that isn't possible (e.g. stripes on different filesystems with an
+// older kernel) they are copied with pread() and pwrite(). The merged timestamp trailer is written
+// only if every stripe has one. A stripe file that doesn't exist is taken to have no frames, since
+// capture deletes files it wrote no frames to.
+
+// C
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// C++
+#include <algorithm>
+#include <vector>
+
+// Linux
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// BSD
+#include <err.h>
+
+#include "SERFile.h"
+
+
+struct StripeFile
+{
+    const char *filename;
+    int fd = -1;
+    SERHeader_t header;
+    bool has_trailer = false;
+};
+
+
+// Copy length bytes from in_fd at in_offset to out_fd at out_offset
+static void copy_range(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, size_t length)
+{
+    // Cleared for good the first time the kernel can't do the copy itself
+    static bool in_kernel = true;
+    static std::vector<uint8_t> buffer(1 << 20);
+
+    while (length > 0 && in_kernel)
+    {
+        off64_t in_off = in_offset;
+        off64_t out_off = out_offset;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, length, 0);
+        if (n < 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            warn("copy_file_range not usable; copying through user space instead");
+            in_kernel = false;
+            break;
+        }
+        else if (n < 0)
+        {
+            err(1, "copy_file_range failed");
+        }
+        else if (n == 0)
+        {
+            errx(1, "Unexpected end of stripe file");
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+
+    while (length > 0)
+    {
+        ssize_t n = pread(in_fd, buffer.data(), std::min(length, buffer.size()), in_offset);
+        if (n < 0)
+        {
+            err(1, "read failed");
+        }
+        else if (n == 0)
+        {
+            errx(1, "Unexpected end of stripe file");
+        }
+        ssize_t written = pwrite(out_fd, buffer.data(), n, out_offset);
+        if (written < 0)
+        {
+            err(1, "write failed");
+        }
+        else if (written != n)
+        {
+            errx(1, "write incomplete (%zd/%zd)", written, n);
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        errx(1, "Usage: %s [output.ser] [stripe0.ser] [stripe1.ser] ...", argv[0]);
+    }
+    const char *output_filename = argv[1];
+    const int num_stripes = argc - 2;
+
+    // Read and check every stripe's header against the first one that exists
+    std::vector<StripeFile> stripes(num_stripes);
+    const SERHeader_t *reference = nullptr;
+    size_t bytes_per_frame = 0;
+    int64_t total_frames = 0;
+    bool add_trailer = true;
+    for (int i = 0; i < num_stripes; i++)
+    {
+        StripeFile &stripe = stripes[i];
+        stripe.filename = argv[i + 2];
+        stripe.fd = open(stripe.filename, O_RDONLY);
+        if (stripe.fd < 0 && errno == ENOENT)
+        {
+            warnx("%s does not exist; taking it to be an empty stripe", stripe.filename);
+            stripe.header.FrameCount = 0;
+            continue;
+        }
+        else if (stripe.fd < 0)
+        {
+            err(1, "open(%s) failed", stripe.filename);
+        }
+
+        ssize_t n = pread(stripe.fd, &stripe.header, sizeof(SERHeader_t), 0);
+        if (n != sizeof(SERHeader_t) ||
+            memcmp(stripe.header.FileID, SERHeader_t().FileID, sizeof(stripe.header.FileID)) != 0)
+        {
+            errx(1, "%s is not a SER file", stripe.filename);
+        }
+
+        const SERHeader_t &h = stripe.header;
+        if (reference == nullptr)
+        {
+            reference = &h;
+            bytes_per_frame = (size_t)h.ImageWidth * h.ImageHeight *
+                ((h.PixelDepthPerPlane - 1) / 8 + 1);
+            if (h.ColorID == RGB || h.ColorID == BGR)
+            {
+                bytes_per_frame *= 3;
+            }
+        }
+        else if (h.ColorID != reference->ColorID ||
+            h.LittleEndian != reference->LittleEndian ||
+            h.ImageWidth != reference->ImageWidth ||
+            h.ImageHeight != reference->ImageHeight ||
+            h.PixelDepthPerPlane != reference->PixelDepthPerPlane)
+        {
+            errx(1, "%s does not have the same image format as the other stripes", stripe.filename);
+        }
+
+        struct stat st;
+        if (fstat(stripe.fd, &st) != 0)
+        {
+            err(1, "stat(%s) failed", stripe.filename);
+        }
+        const int64_t data_end = sizeof(SERHeader_t) + (int64_t)h.FrameCount * bytes_per_frame;
+        if (st.st_size == data_end + (int64_t)sizeof(int64_t) * h.FrameCount)
+        {
+            stripe.has_trailer = true;
+        }
+        else if (st.st_size != data_end)
+        {
+            errx(
+                1,
+                "%s is %jd bytes, which doesn't match its %d frames; was the recording cut short?",
+                stripe.filename,
+                (intmax_t)st.st_size,
+                (int)h.FrameCount
+            );
+        }
+        add_trailer = add_trailer && stripe.has_trailer;
+        total_frames += h.FrameCount;
+    }
+    if (reference == nullptr)
+    {
+        errx(1, "None of the stripes exist");
+    }
+
+    // Round-robin means the first stripes have one frame more than the rest, if any
+    for (int i = 0; i < num_stripes; i++)
+    {
+        int64_t expected = (total_frames > i) ?
+            (total_frames - i + num_stripes - 1) / num_stripes : 0;
+        if (stripes[i].header.FrameCount != expected)
+        {
+            errx(
+                1,
+                "%s has %d frames but should have %jd if the %jd frames were striped across %d "
+                "files in this order",
+                stripes[i].filename,
+                (int)stripes[i].header.FrameCount,
+                (intmax_t)expected,
+                (intmax_t)total_frames,
+                num_stripes
+            );
+        }
+    }
+
+    int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out_fd < 0)
+    {
+        err(1, "open(%s) failed", output_filename);
+    }
+
+    // The first stripe got the first frame, so its start time is the recording's
+    SERHeader_t header = *reference;
+    header.FrameCount = total_frames;
+    if (pwrite(out_fd, &header, sizeof(SERHeader_t), 0) != sizeof(SERHeader_t))
+    {
+        err(1, "Writing header of %s failed", output_filename);
+    }
+
+    for (int64_t frame = 0; frame < total_frames; frame++)
+    {
+        const StripeFile &stripe = stripes[frame % num_stripes];
+        copy_range(
+            stripe.fd,
+            sizeof(SERHeader_t) + (frame / num_stripes) * bytes_per_frame,
+            out_fd,
+            sizeof(SERHeader_t) + frame * bytes_per_frame,
+            bytes_per_frame
+        );
+    }
+
+    // Interleave the stripes' trailers the same way
+    if (add_trailer)
+    {
+        std::vector<std::vector<int64_t>> timestamps(num_stripes);
+        for (int i = 0; i < num_stripes; i++)
+        {
+            const StripeFile &stripe = stripes[i];
+            timestamps[i].resize(stripe.header.FrameCount);
+            size_t length = sizeof(int64_t) * timestamps[i].size();
+            int64_t offset = sizeof(SERHeader_t) +
+                (int64_t)stripe.header.FrameCount * bytes_per_frame;
+            if (length > 0 &&
+                pread(stripe.fd, timestamps[i].data(), length, offset) != (ssize_t)length)
+            {
+                err(1, "Reading trailer of %s failed", stripe.filename);
+            }
+        }
+        std::vector<int64_t> trailer(total_frames);
+        for (int64_t frame = 0; frame < total_frames; frame++)
+        {
+            trailer[frame] = timestamps[frame % num_stripes][frame / num_stripes];
+        }
+        size_t length = sizeof(int64_t) * trailer.size();
+        int64_t offset = sizeof(SERHeader_t) + total_frames * bytes_per_frame;
+        if (pwrite(out_fd, trailer.data(), length, offset) != (ssize_t)length)
+        {
+            err(1, "Writing trailer of %s failed", output_filename);
+        }
+    }
+
+    if (close(out_fd) != 0)
+    {
+        err(1, "close(%s) failed", output_filename);
+    }
+    for (auto &stripe : stripes)
+    {
+        if (stripe.fd >= 0)
+        {
+            (void)close(stripe.fd);
+        }
+    }
+
+    printf(
+        "Merged %jd frames from %d stripes into %s%s.\n",
+        (intmax_t)total_frames,
+        num_stripes,
+        output_filename,
+        add_trailer ? "" : " (without timestamp trailer)"
+    );
+    return 0;
+}
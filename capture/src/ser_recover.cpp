@@ -0,0 +1,138 @@
+// Finishes a SER file that capture never closed, e.g. because it crashed or the machine lost power.
+// Usage:
+//
+// ser_recover [capture.ser]
+//
+// While a SER file is being written, capture keeps the frame timestamps in a side file named after
+// it (capture.ser.timestamps) and the frame count in the header may be stale. This sets the frame
+// count to the number of complete frames that have a timestamp, cuts off anything after the last
+// of them, appends the timestamp trailer and deletes the side file, leaving a SER file like one
+// that was closed normally.
+
+// C
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Linux
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// BSD
+#include <err.h>
+
+#include "SERFile.h"
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        errx(1, "Usage: %s [capture.ser]", argv[0]);
+    }
+    const char *filename = argv[1];
+    const std::string timestamps_filename = std::string(filename) + ".timestamps";
+
+    int fd = open(filename, O_RDWR);
+    if (fd < 0)
+    {
+        err(1, "open(%s) failed", filename);
+    }
+    SERHeader_t header;
+    if (pread(fd, &header, sizeof(SERHeader_t), 0) != sizeof(SERHeader_t) ||
+        memcmp(header.FileID, SERHeader_t().FileID, sizeof(header.FileID)) != 0)
+    {
+        errx(1, "%s is not a SER file", filename);
+    }
+    size_t bytes_per_frame = (size_t)header.ImageWidth * header.ImageHeight *
+        ((header.PixelDepthPerPlane - 1) / 8 + 1);
+    if (header.ColorID == RGB || header.ColorID == BGR)
+    {
+        bytes_per_frame *= 3;
+    }
+    if (bytes_per_frame == 0)
+    {
+        errx(1, "%s has no image size in its header", filename);
+    }
+
+    int timestamps_fd = open(timestamps_filename.c_str(), O_RDONLY);
+    if (timestamps_fd < 0 && errno == ENOENT)
+    {
+        errx(1, "%s not found; was %s closed normally?", timestamps_filename.c_str(), filename);
+    }
+    else if (timestamps_fd < 0)
+    {
+        err(1, "open(%s) failed", timestamps_filename.c_str());
+    }
+
+    struct stat st;
+    if (fstat(timestamps_fd, &st) != 0)
+    {
+        err(1, "stat(%s) failed", timestamps_filename.c_str());
+    }
+    std::vector<int64_t> timestamps(st.st_size / sizeof(int64_t));
+    size_t length = sizeof(int64_t) * timestamps.size();
+    if (pread(timestamps_fd, timestamps.data(), length, 0) != (ssize_t)length)
+    {
+        err(1, "Reading %s failed", timestamps_filename.c_str());
+    }
+    (void)close(timestamps_fd);
+
+    // The side file is extended ahead of the timestamps with zeros, which no real timestamp is
+    auto end = std::find(timestamps.begin(), timestamps.end(), 0);
+    timestamps.erase(end, timestamps.end());
+
+    if (fstat(fd, &st) != 0)
+    {
+        err(1, "stat(%s) failed", filename);
+    }
+    const int64_t frames_in_file = (st.st_size > (off_t)sizeof(SERHeader_t)) ?
+        (st.st_size - sizeof(SERHeader_t)) / bytes_per_frame : 0;
+    const int64_t frame_count = std::min<int64_t>(frames_in_file, timestamps.size());
+    if (frames_in_file != (int64_t)timestamps.size())
+    {
+        warnx(
+            "%s holds %jd complete frames and %zu timestamps; keeping the first %jd",
+            filename,
+            (intmax_t)frames_in_file,
+            timestamps.size(),
+            (intmax_t)frame_count
+        );
+    }
+
+    header.FrameCount = frame_count;
+    if (pwrite(fd, &header, sizeof(SERHeader_t), 0) != sizeof(SERHeader_t))
+    {
+        err(1, "Writing header of %s failed", filename);
+    }
+    const int64_t data_end = sizeof(SERHeader_t) + frame_count * bytes_per_frame;
+    if (ftruncate(fd, data_end) != 0)
+    {
+        err(1, "Truncating %s failed", filename);
+    }
+    length = sizeof(int64_t) * frame_count;
+    if (pwrite(fd, timestamps.data(), length, data_end) != (ssize_t)length)
+    {
+        err(1, "Writing trailer of %s failed", filename);
+    }
+    if (fsync(fd) != 0 || close(fd) != 0)
+    {
+        err(1, "Closing %s failed", filename);
+    }
+
+    // Only once the trailer is safely in the SER file
+    if (unlink(timestamps_filename.c_str()) != 0)
+    {
+        warn("Unable to delete %s", timestamps_filename.c_str());
+    }
+
+    printf("Recovered %jd frames in %s.\n", (intmax_t)frame_count, filename);
+    return 0;
+}
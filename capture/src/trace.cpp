@@ -0,0 +1,183 @@
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <pthread.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+std::atomic_bool trace::tracing = false;
+
+
+// One per thread that has recorded an event. Never freed: the thread may have ended by the time
+// the trace is written.
+struct TraceBuffer
+{
+    std::unique_ptr<trace::Event[]> events{new trace::Event[trace::EVENTS_PER_THREAD]};
+
+    // Events recorded so far; the latest EVENTS_PER_THREAD of them are in events
+    uint64_t count = 0;
+
+    pid_t tid;
+    char thread_name[16];
+    TraceBuffer *next = nullptr;
+};
+
+static std::atomic<TraceBuffer *> buffers = nullptr;
+static thread_local TraceBuffer *thread_buffer = nullptr;
+
+
+static TraceBuffer *new_buffer()
+{
+    auto buffer = new TraceBuffer;
+    buffer->tid = syscall(SYS_gettid);
+    if (pthread_getname_np(pthread_self(), buffer->thread_name, sizeof(buffer->thread_name)) != 0)
+    {
+        snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%d", (int)buffer->tid);
+    }
+
+    buffer->next = buffers.load(std::memory_order_relaxed);
+    while (!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release)) {}
+    return buffer;
+}
+
+
+void trace::enable()
+{
+    tracing = true;
+}
+
+void trace::record(const Event &event)
+{
+    if (thread_buffer == nullptr)
+    {
+        thread_buffer = new_buffer();
+    }
+    thread_buffer->events[thread_buffer->count % EVENTS_PER_THREAD] = event;
+    thread_buffer->count++;
+}
+
+bool trace::write(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == nullptr)
+    {
+        char buf[256];
+        spdlog::error(
+            "Could not write trace to {}: {}",
+            filename,
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        return false;
+    }
+
+    // Times are given relative to the earliest event kept, in microseconds
+    int64_t origin_ns = INT64_MAX;
+    for (TraceBuffer *b = buffers.load(std::memory_order_acquire); b; b = b->next)
+    {
+        uint64_t first = b->count - std::min<uint64_t>(b->count, EVENTS_PER_THREAD);
+        for (uint64_t i = first; i < b->count; i++)
+        {
+            origin_ns = std::min(origin_ns, b->events[i % EVENTS_PER_THREAD].start_ns);
+        }
+    }
+
+    const int pid = getpid();
+    size_t written = 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (TraceBuffer *b = buffers.load(std::memory_order_acquire); b; b = b->next)
+    {
+        fprintf(
+            file,
+            "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s\"}},\n",
+            pid,
+            (int)b->tid,
+            b->thread_name
+        );
+
+        uint64_t first = b->count - std::min<uint64_t>(b->count, EVENTS_PER_THREAD);
+        for (uint64_t i = first; i < b->count; i++)
+        {
+            const Event &e = b->events[i % EVENTS_PER_THREAD];
+            const double ts = (e.start_ns - origin_ns) / 1e3;
+            char common[96];
+            snprintf(
+                common,
+                sizeof(common),
+                "\"pid\": %d, \"tid\": %d, \"ts\": %.3f",
+                pid,
+                (int)b->tid,
+                ts
+            );
+
+            switch (e.kind)
+            {
+                case Kind::FRAME_TAKEN:
+                    fprintf(
+                        file,
+                        "{\"name\": \"frame\", \"cat\": \"frame\", \"ph\": \"b\", \"id\": \"%p\", "
+                        "%s, \"args\": {\"holder\": \"%s\"}},\n",
+                        e.frame, common, e.name
+                    );
+                    break;
+                case Kind::FRAME_RETURNED:
+                    fprintf(
+                        file,
+                        "{\"name\": \"frame\", \"cat\": \"frame\", \"ph\": \"e\", \"id\": \"%p\", "
+                        "%s, \"args\": {\"released by\": \"%s\"}},\n",
+                        e.frame, common, e.name
+                    );
+                    break;
+                case Kind::FRAME_SHARED:
+                case Kind::FRAME_HOLDER:
+                case Kind::FRAME_RELEASED:
+                {
+                    const char *verb = (e.kind == Kind::FRAME_RELEASED) ? "released by " : "";
+                    fprintf(
+                        file,
+                        "{\"name\": \"%s%s\", \"cat\": \"frame\", \"ph\": \"n\", \"id\": \"%p\", "
+                        "%s},\n",
+                        verb, e.name, e.frame, common
+                    );
+                    fprintf(
+                        file,
+                        "{\"name\": \"%s%s\", \"cat\": \"holder\", \"ph\": \"i\", \"s\": \"t\", "
+                        "%s, \"args\": {\"frame\": \"%p\"}},\n",
+                        verb, e.name, common, e.frame
+                    );
+                    break;
+                }
+                case Kind::SPAN:
+                    fprintf(
+                        file,
+                        "{\"name\": \"%s\", \"cat\": \"span\", \"ph\": \"X\", %s, \"dur\": %.3f, "
+                        "\"args\": {\"frame\": \"%p\"}},\n",
+                        e.name, common, e.duration_ns / 1e3, e.frame
+                    );
+                    break;
+            }
+            written++;
+        }
+    }
+
+    // JSON doesn't allow a comma after the last element, so end with an empty metadata event
+    fprintf(file, "{\"name\": \"trace_end\", \"ph\": \"M\", \"pid\": %d, \"args\": {}}\n]}\n", pid);
+
+    if (fclose(file) != 0)
+    {
+        char buf[256];
+        spdlog::error(
+            "Could not write trace to {}: {}",
+            filename,
+            strerror_r(errno, buf, sizeof(buf))
+        );
+        return false;
+    }
+    spdlog::info("Wrote {} trace events to {}.", written, filename);
+    return true;
+}
@@ -1,124 +1,625 @@
+// HOW TO BUILD:
+// g++ -std=c++17 -O2 -Wall -o write_benchmark write_benchmark.cpp -pthread
+// or, to include io_uring:
+// g++ -std=c++17 -O2 -Wall -DHAVE_LIBURING -o write_benchmark write_benchmark.cpp -pthread -luring
+//
+// HOW TO USE:
+// ./write_benchmark dir=[directory list] [width=N] [height=N] [bytes_per_pixel=N] [seconds=S]
+//     [mode=buffered|direct|sync|direct_sync] [batch=N] [uring_depth=N] [fallocate=0|1] [files=N]
+//     [fps=F] [keep=0|1]
+//
+// Writes dummy camera frames to disk as fast as it can and measures how steadily they go out, to
+// qualify a disk for a camera before relying on it for a night of capture. Every option except dir,
+// fps and keep takes a comma-separated list, and one run is made for every combination, e.g.
+// mode=buffered,direct uring_depth=0,8 is four runs of seconds each. For each run the results are
+// printed to stdout as one element of a JSON array:
+//
+// - frame period percentiles (p50, p99, p99.9, max) in ms, i.e. the time the writer took per frame;
+// - sustained throughput in MB/s (10^6 bytes) while writing, and including the final fsync() that
+//   gets buffered data onto the disk;
+// - with fps given, whether the disk keeps up with that frame rate: the sustained frame rate
+//   including the fsync() must reach it and 99.9 % of frame periods must fit in one frame time.
+//
+// mode is how the files are opened: through the page cache, with O_DIRECT (frame size rounded up to
+// a multiple of 4096 bytes), with O_SYNC, or both. batch writes that many frames per pwritev().
+// uring_depth keeps that many writes in flight with io_uring instead of writing synchronously.
+// fallocate reserves space ahead of the frames in 512 MiB chunks like capture does. files writes
+// that many files at once from a thread each, like the stripes option of capture; directories
+// listed in dir (joined by +) get them in turn. With several files a frame period is the time a
+// writer took per frame divided by the number of files, since each writes one frame in files.
+// The files are deleted after each run unless keep=1.
+
 // C
-#include <cstdlib>
-#include <cstdio>
+#include <cerrno>
+#include <climits>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 
 // C++
 #include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Linux
-#include <unistd.h>
 #include <fcntl.h>
-#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 // BSD
 #include <err.h>
 
 
-static constexpr size_t round_up_to_multiple(size_t val, size_t mult)
+// O_DIRECT transfers must start at aligned offsets and addresses and cover whole blocks
+static constexpr size_t ALIGN = 4096;
+
+// Same as SERFile
+static constexpr int64_t PREALLOCATE_CHUNK_BYTES = 512 << 20;
+
+// Frames are written from a few buffers of random data in turn, so that a disk that compresses or
+// deduplicates can't make the benchmark look better than real frames would
+static constexpr int NUM_BUFFERS = 4;
+
+// Options that take a list of values to sweep, and their defaults
+static const std::vector<std::pair<const char *, const char *>> SWEEP_OPTIONS = {
+    {"width", "3096"},
+    {"height", "2080"},
+    {"bytes_per_pixel", "1"},
+    {"seconds", "10"},
+    {"mode", "buffered"},
+    {"batch", "1"},
+    {"uring_depth", "0"},
+    {"fallocate", "1"},
+    {"files", "1"},
+};
+
+
+struct Config
+{
+    int width;
+    int height;
+    int bytes_per_pixel;
+    double seconds;
+    std::string mode;
+    int batch;
+    int uring_depth;
+    bool fallocate;
+    int files;
+};
+
+
+// What one writer thread saw
+struct WriterResult
 {
-    size_t rem = (val % mult);
+    std::vector<double> periods_ns;
+    int64_t frames = 0;
+};
+
 
-    if (rem == 0)
+static int64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t)ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+
+static std::vector<std::string> split(const char *list, char separator)
+{
+    std::vector<std::string> values;
+    std::string value;
+    for (const char *c = list; ; c++)
     {
-        return val;
+        if (*c == separator || *c == '\0')
+        {
+            values.push_back(value);
+            value.clear();
+            if (*c == '\0')
+            {
+                break;
+            }
+        }
+        else
+        {
+            value += *c;
+        }
     }
-    else
+    return values;
+}
+
+
+// Times the writes of one file. Each completed write of k frames adds k frame periods, sharing out
+// the time since the previous write completed.
+class Timer
+{
+public:
+    Timer(WriterResult &result, int files) :
+        result_(result),
+        files_(files),
+        last_ns_(now_ns())
+    {}
+
+    void completed(int frames)
     {
-    //    static_assert((val + (mult - rem)) % mult == 0, "");
-        return val + (mult - rem);
+        int64_t now = now_ns();
+        double period = (double)(now - last_ns_) / frames / files_;
+        result_.periods_ns.insert(result_.periods_ns.end(), frames, period);
+        result_.frames += frames;
+        last_ns_ = now;
     }
-}
 
-static uint64_t timespec_to_nanosec(const timespec *tp)
+private:
+    WriterResult &result_;
+    const int files_;
+    int64_t last_ns_;
+};
+
+
+class Preallocator
 {
-    uint64_t ns_sec  = (uint64_t)tp->tv_sec * 1'000'000'000ULL;
-    uint64_t ns_nsec = (uint64_t)tp->tv_nsec;
+public:
+    Preallocator(int fd, bool enabled) : fd_(fd), enabled_(enabled) {}
 
-    return ns_sec + ns_nsec;
+    void reserve(int64_t end)
+    {
+        while (enabled_ && end > end_)
+        {
+            if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, end_, PREALLOCATE_CHUNK_BYTES) != 0)
+            {
+                warn("fallocate failed; continuing without it");
+                enabled_ = false;
+                return;
+            }
+            end_ += PREALLOCATE_CHUNK_BYTES;
+        }
+    }
+
+private:
+    const int fd_;
+    bool enabled_;
+    int64_t end_ = 0;
+};
+
+
+// Fill iov with the frames of a batch starting with frame number first
+static void fill_batch(
+    iovec *iov,
+    const Config &config,
+    const std::vector<uint8_t *> &buffers,
+    size_t frame_bytes,
+    int64_t first
+)
+{
+    for (int i = 0; i < config.batch; i++)
+    {
+        iov[i].iov_base = buffers[(first + i) % buffers.size()];
+        iov[i].iov_len = frame_bytes;
+    }
 }
 
-static uint64_t get_timestamp()
+
+static void write_sync(
+    const Config &config,
+    int fd,
+    const std::vector<uint8_t *> &buffers,
+    size_t frame_bytes,
+    int64_t deadline_ns,
+    WriterResult &result
+)
 {
-    timespec t;
+    Timer timer(result, config.files);
+    Preallocator preallocator(fd, config.fallocate);
+    const size_t batch_bytes = config.batch * frame_bytes;
+    std::vector<iovec> iov(config.batch);
+    int64_t offset = 0;
+    while (now_ns() < deadline_ns)
+    {
+        fill_batch(iov.data(), config, buffers, frame_bytes, result.frames);
+        preallocator.reserve(offset + batch_bytes);
+        ssize_t n = pwritev(fd, iov.data(), config.batch, offset);
+        if (n < 0)
+        {
+            err(1, "write failed");
+        }
+        else if (n != (ssize_t)batch_bytes)
+        {
+            errx(1, "write incomplete (%zd/%zu)", n, batch_bytes);
+        }
+        offset += batch_bytes;
+        timer.completed(config.batch);
+    }
+}
 
-    if (clock_gettime(CLOCK_MONOTONIC_RAW, &t) < 0)
+
+#ifdef HAVE_LIBURING
+static void write_uring(
+    const Config &config,
+    int fd,
+    const std::vector<uint8_t *> &buffers,
+    size_t frame_bytes,
+    int64_t deadline_ns,
+    WriterResult &result
+)
+{
+    io_uring ring;
+    int ret = io_uring_queue_init(config.uring_depth, &ring, 0);
+    if (ret < 0)
+    {
+        errno = -ret;
+        err(1, "io_uring_queue_init failed");
+    }
+
+    Timer timer(result, config.files);
+    Preallocator preallocator(fd, config.fallocate);
+    const size_t batch_bytes = config.batch * frame_bytes;
+
+    // Each write in flight has a slot of iovecs, which must stay put until it completes
+    std::vector<iovec> iov(config.uring_depth * config.batch);
+    std::vector<int> free_slots;
+    for (int slot = config.uring_depth - 1; slot >= 0; slot--)
     {
-        err(1, "clock_gettime failed");
+        free_slots.push_back(slot);
+    }
+
+    int64_t offset = 0;
+    int64_t frames_submitted = 0;
+    int in_flight = 0;
+    while (true)
+    {
+        const bool writing = now_ns() < deadline_ns;
+        while (writing && !free_slots.empty())
+        {
+            int slot = free_slots.back();
+            free_slots.pop_back();
+            iovec *slot_iov = &iov[slot * config.batch];
+            fill_batch(slot_iov, config, buffers, frame_bytes, frames_submitted);
+            preallocator.reserve(offset + batch_bytes);
+            io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_writev(sqe, fd, slot_iov, config.batch, offset);
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(static_cast<uintptr_t>(slot)));
+            offset += batch_bytes;
+            frames_submitted += config.batch;
+            in_flight++;
+        }
+        if (in_flight == 0)
+        {
+            break;
+        }
+
+        io_uring_cqe *cqe;
+        ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret >= 0)
+        {
+            ret = io_uring_wait_cqe(&ring, &cqe);
+        }
+        if (ret < 0)
+        {
+            errno = -ret;
+            err(1, "io_uring wait failed");
+        }
+        if (cqe->res < 0)
+        {
+            errno = -cqe->res;
+            err(1, "write failed");
+        }
+        else if (cqe->res != (int)batch_bytes)
+        {
+            errx(1, "write incomplete (%d/%zu)", cqe->res, batch_bytes);
+        }
+        auto slot = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe));
+        free_slots.push_back(static_cast<int>(slot));
+        io_uring_cqe_seen(&ring, cqe);
+        in_flight--;
+        timer.completed(config.batch);
     }
 
-    return timespec_to_nanosec(&t);
+    io_uring_queue_exit(&ring);
 }
+#endif
+
 
-int main()
+static Config parse_config(const std::map<std::string, std::string> &values)
 {
-    constexpr char FILE_NAME[] = "/home/rgottula/Desktop/test.bin";
+    Config config;
+    config.width = std::stoi(values.at("width"));
+    config.height = std::stoi(values.at("height"));
+    config.bytes_per_pixel = std::stoi(values.at("bytes_per_pixel"));
+    config.seconds = std::stod(values.at("seconds"));
+    config.mode = values.at("mode");
+    config.batch = std::stoi(values.at("batch"));
+    config.uring_depth = std::stoi(values.at("uring_depth"));
+    config.fallocate = std::stoi(values.at("fallocate")) != 0;
+    config.files = std::stoi(values.at("files"));
 
-    // O_DIRECT requires that calls to write(2) have a size that's a multiple
-    // of the sector size or whatever; so we specify that sort of thing here
-    constexpr size_t ALIGN = 4096;
+    if (config.width < 1 || config.height < 1 || config.bytes_per_pixel < 1)
+    {
+        errx(1, "width, height and bytes_per_pixel must be at least 1");
+    }
+    if (config.seconds <= 0.0 || config.batch < 1 || config.files < 1)
+    {
+        errx(1, "seconds, batch and files must be positive");
+    }
+    if (config.batch > IOV_MAX)
+    {
+        errx(1, "batch must be at most %d", IOV_MAX);
+    }
+    if (config.mode != "buffered" && config.mode != "direct" && config.mode != "sync" &&
+        config.mode != "direct_sync")
+    {
+        errx(
+            1,
+            "mode must be buffered, direct, sync or direct_sync, not '%s'",
+            config.mode.c_str()
+        );
+    }
+#ifdef HAVE_LIBURING
+    if (config.uring_depth < 0 || config.uring_depth > 4096)
+    {
+        errx(1, "uring_depth must be between 0 and 4096");
+    }
+#else
+    if (config.uring_depth != 0)
+    {
+        errx(1, "uring_depth needs io_uring; build with -DHAVE_LIBURING -luring");
+    }
+#endif
+    return config;
+}
 
-    constexpr int WIDTH  = 3096;
-    constexpr int HEIGHT = 2080;
-    constexpr size_t IMAGE_SIZE_BYTES = round_up_to_multiple(WIDTH * HEIGHT, ALIGN);
 
-    auto frame_data = (uint8_t *)aligned_alloc(ALIGN, IMAGE_SIZE_BYTES);
+// Run one configuration and print its results as a JSON object
+static void run(
+    const Config &config,
+    const std::vector<std::string> &dirs,
+    double target_fps,
+    bool keep
+)
+{
+    const bool direct = config.mode == "direct" || config.mode == "direct_sync";
+    const bool sync = config.mode == "sync" || config.mode == "direct_sync";
+    size_t frame_bytes = (size_t)config.width * config.height * config.bytes_per_pixel;
+    if (direct)
+    {
+        frame_bytes = round_up(frame_bytes, ALIGN);
+    }
 
-    // Randomize the frame data buffer to prevent any shenanigans (e.g. compression)
-    // that the disk might be doing to optimize for certain data patterns
-    std::srand(std::time(0));
-    std::generate_n(frame_data, IMAGE_SIZE_BYTES, []{ return (uint8_t)std::rand(); });
+    std::vector<uint8_t *> buffers;
+    std::mt19937_64 random(now_ns());
+    for (int i = 0; i < NUM_BUFFERS; i++)
+    {
+        auto buffer = (uint8_t *)aligned_alloc(ALIGN, round_up(frame_bytes, ALIGN));
+        if (buffer == nullptr)
+        {
+            errx(1, "Could not allocate frame buffers");
+        }
+        for (size_t j = 0; j < frame_bytes; j += sizeof(uint64_t))
+        {
+            uint64_t value = random();
+            memcpy(buffer + j, &value, std::min(sizeof(value), frame_bytes - j));
+        }
+        buffers.push_back(buffer);
+    }
 
-    // O_DIRECT: bypass the OS's page cache and write directly to the disk
-    // O_SYNC:   require every call to write(2) to completely sync to disk before returning
     int flags = O_WRONLY | O_CREAT | O_TRUNC;
-    flags |= O_DIRECT;
-//    flags |= O_SYNC;
-
-    int fd = open(FILE_NAME, flags, 0644);
-    if (fd < 0)
+    flags |= direct ? O_DIRECT : 0;
+    flags |= sync ? O_SYNC : 0;
+    std::vector<std::string> filenames;
+    std::vector<int> fds;
+    for (int i = 0; i < config.files; i++)
     {
-        err(1, "open(%s) failed", FILE_NAME);
+        const std::string &dir = dirs[i % dirs.size()];
+        filenames.push_back(dir + "/write_benchmark" + std::to_string(i) + ".bin");
+        int fd = open(filenames.back().c_str(), flags, 0644);
+        if (fd < 0)
+        {
+            err(1, "open(%s) failed", filenames.back().c_str());
+        }
+        fds.push_back(fd);
     }
 
-    // Make sure that the disk is fully sync'd up before we begin
-    (void)syncfs(fd);
+    // Make sure that the disks are fully sync'd up before we begin
+    for (int fd : fds)
+    {
+        (void)syncfs(fd);
+    }
     (void)usleep(1 * 1'000'000);
 
-    // Write dummy frames to disk as fast as possible
-    constexpr int MAX_FRAMES = 60*10;
+    std::vector<WriterResult> results(config.files);
+    std::vector<std::thread> threads;
+    const int64_t start_ns = now_ns();
+    const int64_t deadline_ns = start_ns + (int64_t)(config.seconds * 1e9);
+    for (int i = 0; i < config.files; i++)
+    {
+        auto writer = write_sync;
+#ifdef HAVE_LIBURING
+        if (config.uring_depth > 0)
+        {
+            writer = write_uring;
+        }
+#endif
+        threads.emplace_back(
+            writer,
+            std::cref(config),
+            fds[i],
+            std::cref(buffers),
+            frame_bytes,
+            deadline_ns,
+            std::ref(results[i])
+        );
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    const int64_t written_ns = now_ns();
+    for (int fd : fds)
+    {
+        if (fsync(fd) != 0)
+        {
+            err(1, "fsync failed");
+        }
+    }
+    const int64_t synced_ns = now_ns();
+
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        (void)close(fds[i]);
+        if (!keep && unlink(filenames[i].c_str()) != 0)
+        {
+            warn("Unable to delete %s", filenames[i].c_str());
+        }
+    }
+    for (auto buffer : buffers)
+    {
+        free(buffer);
+    }
+
+    std::vector<double> periods;
+    int64_t frames = 0;
+    for (auto &result : results)
+    {
+        periods.insert(periods.end(), result.periods_ns.begin(), result.periods_ns.end());
+        frames += result.frames;
+    }
+    std::sort(periods.begin(), periods.end());
+    auto pct_ms = [&](double p)
+    {
+        return periods[std::min(periods.size() - 1, (size_t)(p * periods.size()))] / 1e6;
+    };
+    const double bytes = (double)frames * frame_bytes;
+    const double mb_per_s = bytes / 1e6 / ((written_ns - start_ns) / 1e9);
+    const double mb_per_s_with_fsync = bytes / 1e6 / ((synced_ns - start_ns) / 1e9);
+    const double fps = frames / ((synced_ns - start_ns) / 1e9);
 
-    uint64_t timestamps[MAX_FRAMES + 1];
-    for (int i = 0; i < MAX_FRAMES; i++)
+    printf(
+        "  {\"width\": %d, \"height\": %d, \"bytes_per_pixel\": %d, \"frame_bytes\": %zu, "
+        "\"seconds\": %g, \"mode\": \"%s\", \"batch\": %d, \"uring_depth\": %d, "
+        "\"fallocate\": %s, \"files\": %d, \"frames\": %jd, "
+        "\"period_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f}, "
+        "\"mb_per_s\": %.1f, \"mb_per_s_with_fsync\": %.1f, \"fps\": %.1f",
+        config.width,
+        config.height,
+        config.bytes_per_pixel,
+        frame_bytes,
+        config.seconds,
+        config.mode.c_str(),
+        config.batch,
+        config.uring_depth,
+        config.fallocate ? "true" : "false",
+        config.files,
+        (intmax_t)frames,
+        pct_ms(0.50),
+        pct_ms(0.99),
+        pct_ms(0.999),
+        periods.back() / 1e6,
+        mb_per_s,
+        mb_per_s_with_fsync,
+        fps
+    );
+    if (target_fps > 0.0)
     {
-        timestamps[i] = get_timestamp();
+        const bool keeps_up = fps >= target_fps && pct_ms(0.999) <= 1e3 / target_fps;
+        printf(", \"target_fps\": %g, \"keeps_up\": %s", target_fps, keeps_up ? "true" : "false");
+    }
+    printf("}");
+    fflush(stdout);
+}
 
-        ssize_t n = write(fd, frame_data, IMAGE_SIZE_BYTES);
-        if (n < 0)
+
+int main(int argc, char *argv[])
+{
+    std::map<std::string, std::vector<std::string>> sweep;
+    for (auto [name, value] : SWEEP_OPTIONS)
+    {
+        sweep[name] = {value};
+    }
+    std::vector<std::string> dirs;
+    double target_fps = 0.0;
+    bool keep = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *equals = strchr(argv[i], '=');
+        const std::string name = equals ? std::string(argv[i], equals - argv[i]) : argv[i];
+        if (equals != nullptr && name == "dir")
         {
-            err(1, "write failed");
+            dirs = split(equals + 1, '+');
+        }
+        else if (equals != nullptr && name == "fps")
+        {
+            target_fps = std::stod(equals + 1);
+        }
+        else if (equals != nullptr && name == "keep")
+        {
+            keep = std::stoi(equals + 1) != 0;
+        }
+        else if (equals != nullptr && sweep.count(name))
+        {
+            sweep[name] = split(equals + 1, ',');
         }
-        else if (n != IMAGE_SIZE_BYTES)
+        else
         {
-            errx(1, "write incomplete (%zd/%zu)", n, IMAGE_SIZE_BYTES);
+            errx(
+                1,
+                "Usage: %s dir=[directory list] [width=N] [height=N] [bytes_per_pixel=N] "
+                "[seconds=S] [mode=buffered|direct|sync|direct_sync] [batch=N] [uring_depth=N] "
+                "[fallocate=0|1] [files=N] [fps=F] [keep=0|1]\n"
+                "All options except dir, fps and keep take a comma-separated list of values to "
+                "sweep. Directories are joined by +.",
+                argv[0]
+            );
         }
     }
-    timestamps[MAX_FRAMES] = get_timestamp();
-
-    (void)close(fd);
+    if (dirs.empty())
+    {
+        errx(1, "dir must be given: the directory (or + separated directories) to write to");
+    }
 
-    double max_period = 0.0;
-    double elapsed = (double)(timestamps[MAX_FRAMES] - timestamps[0]) / 1.0e9;
-    for (int i = 0; i < MAX_FRAMES; i++)
+    // Check every combination before spending any time on the first
+    std::vector<std::map<std::string, std::string>> runs(1);
+    for (auto [name, unused] : SWEEP_OPTIONS)
     {
-        double frame_period = (double)(timestamps[i + 1] - timestamps[i]) / 1.0e9;
-        max_period = std::max(max_period, frame_period);
-        printf("frame %d had period %f ms (%f FPS)\n", i, frame_period * 1.0e3, 1.0 / frame_period);
+        std::vector<std::map<std::string, std::string>> expanded;
+        for (const auto &partial : runs)
+        {
+            for (const auto &value : sweep[name])
+            {
+                expanded.push_back(partial);
+                expanded.back()[name] = value;
+            }
+        }
+        runs = std::move(expanded);
+    }
+    std::vector<Config> configs;
+    for (const auto &values : runs)
+    {
+        configs.push_back(parse_config(values));
     }
 
-    printf("max: %f ms, average: %f ms, total elapsed: %f s\n", max_period * 1.0e3, elapsed / (double)MAX_FRAMES * 1.0e3, elapsed);
+    printf("[\n");
+    for (size_t i = 0; i < configs.size(); i++)
+    {
+        fprintf(stderr, "Run %zu of %zu...\n", i + 1, configs.size());
+        run(configs[i], dirs, target_fps, keep);
+        printf(i + 1 < configs.size() ? ",\n" : "\n");
+    }
+    printf("]\n");
 
     return 0;
 }
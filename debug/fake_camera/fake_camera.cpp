@@ -0,0 +1,594 @@
+// HOW TO BUILD:
+// g++ -std=c++17 -fPIC -shared -Wl,--no-undefined -ldl -Wall -O2 -g -I../../1.18/linux_sdk/include -o libfake_camera.so fake_camera.cpp
+
+// HOW TO USE:
+// LD_PRELOAD=libfake_camera.so <program command line>
+//
+// Stands in for both the ASI library and the parts of libusb that capture uses, so the capture
+// pipeline can be driven end to end without a camera attached. Bulk transfers submitted on the
+// camera's endpoint are completed from libusb_handle_events*() at the configured frame rate with
+// ASI178-style frames (sync words and an incrementing frame index). Frames that come due while no
+// transfer is queued are lost, as they would be on the real hardware, and the next transfer to
+// complete reports LIBUSB_TRANSFER_OVERFLOW.
+//
+// Configured with environment variables (an "EVERY" value of N injects the fault into every Nth
+// frame; 0 disables it):
+//
+// FAKE_CAMERA_FPS            full frame rate (default 60; 0 delivers as fast as transfers are queued).
+//                            Scales with the ROI height set by ASISetROIFormat() like a real sensor.
+// FAKE_CAMERA_WIDTH          sensor width reported by ASIGetCameraProperty (default 3096)
+// FAKE_CAMERA_HEIGHT         sensor height reported by ASIGetCameraProperty (default 2080)
+// FAKE_CAMERA_COLOR          1 for a color camera (default 1)
+// FAKE_CAMERA_FILL           1 to write a test pattern into every frame, not just the header
+// FAKE_CAMERA_DMA            1 to let libusb_dev_mem_alloc() succeed (default 0)
+// FAKE_CAMERA_STALL_EVERY    complete with LIBUSB_TRANSFER_STALL
+// FAKE_CAMERA_OVERFLOW_EVERY complete with LIBUSB_TRANSFER_OVERFLOW
+// FAKE_CAMERA_SHORT_EVERY    complete with only half of the requested bytes
+// FAKE_CAMERA_DROP_EVERY     skip two frame indices, as if the camera dropped frames
+// FAKE_CAMERA_PAUSE_EVERY    stop delivering frames for FAKE_CAMERA_PAUSE_MS (default 100)
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libusb-1.0/libusb.h>
+#include "ASICamera2.h"
+
+#include <chrono>
+#include <deque>
+#include <thread>
+
+
+using namespace std::chrono;
+
+
+// https://en.wikipedia.org/wiki/ANSI_escape_code#Colors
+enum
+{
+	C_BRIGHT_RED     = 91,
+	C_BRIGHT_GREEN   = 92,
+	C_BRIGHT_YELLOW  = 93,
+	C_BRIGHT_CYAN    = 96,
+};
+
+static void msg(int color, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void msg(int color, const char *fmt, ...)
+{
+	char fmt_color[8192];
+	snprintf(fmt_color, sizeof(fmt_color), "\e[%dm" "%s" "\e[0m", color, fmt);
+
+	va_list va;
+	va_start(va, fmt);
+	vfprintf(stderr, fmt_color, va);
+	va_end(va);
+}
+
+
+static long env_long(const char *name, long def)
+{
+	const char *val = getenv(name);
+	return (val != NULL) ? strtol(val, NULL, 0) : def;
+}
+
+
+// Opaque in libusb.h, so the shim is free to define them
+struct libusb_context { int unused; };
+struct libusb_device { int unused; };
+struct libusb_device_handle { int unused; };
+
+static libusb_context fake_context;
+static libusb_device fake_device;
+static libusb_device_handle fake_handle;
+
+// The fake device pretends to be this node in /dev/bus/usb
+static constexpr int FAKE_BUS  = 1;
+static constexpr int FAKE_ADDR = 42;
+static constexpr uint16_t ZWO_VID = 0x03c3;
+static constexpr uint16_t ASI178MC_PID = 0x178a;
+
+// Valid ASI178 frames start and end with these big-endian words and carry a little-endian frame
+// index in bytes 2 and 3
+static constexpr uint16_t SYNC_START = 0x7e5a;
+static constexpr uint16_t SYNC_END   = 0xf03c;
+
+
+static struct
+{
+	bool loaded = false;
+	double fps;
+	long width;
+	long height;
+	bool color;
+	bool fill;
+	bool dma;
+	long stall_every;
+	long overflow_every;
+	long short_every;
+	long drop_every;
+	long pause_every;
+	long pause_ms;
+} config;
+
+static void load_config()
+{
+	if (config.loaded) return;
+	config.fps            = (double)env_long("FAKE_CAMERA_FPS", 60);
+	config.width          = env_long("FAKE_CAMERA_WIDTH", 3096);
+	config.height         = env_long("FAKE_CAMERA_HEIGHT", 2080);
+	config.color          = env_long("FAKE_CAMERA_COLOR", 1) != 0;
+	config.fill           = env_long("FAKE_CAMERA_FILL", 0) != 0;
+	config.dma            = env_long("FAKE_CAMERA_DMA", 0) != 0;
+	config.stall_every    = env_long("FAKE_CAMERA_STALL_EVERY", 0);
+	config.overflow_every = env_long("FAKE_CAMERA_OVERFLOW_EVERY", 0);
+	config.short_every    = env_long("FAKE_CAMERA_SHORT_EVERY", 0);
+	config.drop_every     = env_long("FAKE_CAMERA_DROP_EVERY", 0);
+	config.pause_every    = env_long("FAKE_CAMERA_PAUSE_EVERY", 0);
+	config.pause_ms       = env_long("FAKE_CAMERA_PAUSE_MS", 100);
+	config.loaded = true;
+
+	msg(C_BRIGHT_CYAN, "fake_camera: %ldx%ld %s at %.1f FPS\n",
+		config.width, config.height, config.color ? "color" : "mono", config.fps);
+}
+
+
+// Frame generator state. Everything below is only touched from the thread that submits transfers
+// and handles events, which in capture is the camera thread.
+static std::deque<libusb_transfer *> pending_transfers;
+static std::deque<libusb_transfer *> cancelled_transfers;
+static bool streaming = false;
+static steady_clock::time_point next_frame_due;
+static uint16_t frame_index = 0;
+static bool overflow_pending = false;
+
+// Set through the ASI ROI functions
+static int roi_width = 0;
+static int roi_height = 0;
+static int roi_bin = 1;
+static ASI_IMG_TYPE roi_img_type = ASI_IMG_RAW8;
+static int roi_start_x = 0;
+static int roi_start_y = 0;
+
+static struct
+{
+	long generated;
+	long delivered;
+	long lost;
+	long stalls;
+	long overflows;
+	long shorts;
+	long drops;
+	long pauses;
+} stats;
+
+// File descriptor standing in for the usbfs node the ASI library would have opened
+static int fake_usbfs_fd = -1;
+
+
+__attribute__((destructor)) static void print_stats()
+{
+	if (!config.loaded) return;
+	msg(C_BRIGHT_CYAN, "fake_camera: %ld frames generated, %ld delivered, %ld lost with no transfer queued; "
+		"injected %ld stalls, %ld overflows, %ld short transfers, %ld drops, %ld pauses\n",
+		stats.generated, stats.delivered, stats.lost, stats.stalls, stats.overflows, stats.shorts,
+		stats.drops, stats.pauses);
+}
+
+
+static bool every(long n, long count)
+{
+	return n > 0 && count % n == 0;
+}
+
+
+static void fill_frame(libusb_transfer *transfer)
+{
+	uint8_t *buf = transfer->buffer;
+	int len = transfer->length;
+
+	if (config.fill) {
+		for (int i = 0; i < len; i++) {
+			buf[i] = (uint8_t)(i + frame_index);
+		}
+	}
+
+	buf[0] = SYNC_START >> 8;
+	buf[1] = SYNC_START & 0xff;
+	buf[2] = frame_index & 0xff;
+	buf[3] = frame_index >> 8;
+	buf[len - 2] = SYNC_END >> 8;
+	buf[len - 1] = SYNC_END & 0xff;
+}
+
+
+// Completes the transfer at the head of the queue with the next frame
+static void deliver_frame()
+{
+	libusb_transfer *transfer = pending_transfers.front();
+	pending_transfers.pop_front();
+
+	long n = ++stats.generated;
+	frame_index += every(config.drop_every, n) ? 3 : 1;
+	stats.drops += every(config.drop_every, n) ? 1 : 0;
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->actual_length = transfer->length;
+
+	if (overflow_pending || every(config.overflow_every, n)) {
+		transfer->status = LIBUSB_TRANSFER_OVERFLOW;
+		transfer->actual_length = 0;
+		overflow_pending = false;
+		stats.overflows++;
+	} else if (every(config.stall_every, n)) {
+		transfer->status = LIBUSB_TRANSFER_STALL;
+		transfer->actual_length = 0;
+		stats.stalls++;
+	} else {
+		fill_frame(transfer);
+		if (every(config.short_every, n)) {
+			transfer->actual_length = transfer->length / 2;
+			stats.shorts++;
+		}
+	}
+
+	if (every(config.pause_every, n)) {
+		next_frame_due += milliseconds(config.pause_ms);
+		stats.pauses++;
+	}
+
+	stats.delivered++;
+	transfer->callback(transfer);
+}
+
+
+static int handle_events(struct timeval *tv)
+{
+	auto deadline = steady_clock::now() + seconds(tv->tv_sec) + microseconds(tv->tv_usec);
+
+	// Cancellations complete on the next pass through the event loop, as with real libusb
+	if (!cancelled_transfers.empty()) {
+		std::deque<libusb_transfer *> cancelled;
+		cancelled.swap(cancelled_transfers);
+		for (auto transfer : cancelled) {
+			transfer->status = LIBUSB_TRANSFER_CANCELLED;
+			transfer->actual_length = 0;
+			transfer->callback(transfer);
+		}
+		return LIBUSB_SUCCESS;
+	}
+
+	if (!streaming) {
+		std::this_thread::sleep_until(deadline);
+		return LIBUSB_SUCCESS;
+	}
+
+	// Readout time is proportional to the number of rows
+	double row_fraction = (roi_height > 0) ? (double)roi_height * roi_bin / config.height : 1.0;
+	auto period = duration_cast<steady_clock::duration>(
+		duration<double>((config.fps > 0.0) ? row_fraction / config.fps : 0.0));
+
+	// Frames that came due while nothing was queued on the endpoint are gone
+	auto now = steady_clock::now();
+	while (pending_transfers.empty() && next_frame_due <= now) {
+		stats.generated++;
+		stats.lost++;
+		frame_index++;
+		overflow_pending = true;
+		next_frame_due += period;
+	}
+
+	if (pending_transfers.empty()) {
+		std::this_thread::sleep_until(std::min(deadline, next_frame_due));
+		return LIBUSB_SUCCESS;
+	}
+
+	if (next_frame_due > deadline) {
+		std::this_thread::sleep_until(deadline);
+		return LIBUSB_SUCCESS;
+	}
+
+	std::this_thread::sleep_until(next_frame_due);
+	do {
+		deliver_frame();
+		next_frame_due += period;
+	} while (!pending_transfers.empty() && next_frame_due <= steady_clock::now());
+
+	return LIBUSB_SUCCESS;
+}
+
+
+// ASI library =====================================================================================
+
+extern "C" int ASIGetNumOfConnectedCameras()
+{
+	load_config();
+	return 1;
+}
+
+extern "C" ASI_ERROR_CODE ASIGetCameraProperty(ASI_CAMERA_INFO *pASICameraInfo, int iCameraIndex)
+{
+	load_config();
+	if (iCameraIndex != 0) return ASI_ERROR_INVALID_INDEX;
+
+	memset(pASICameraInfo, 0, sizeof(*pASICameraInfo));
+	snprintf(pASICameraInfo->Name, sizeof(pASICameraInfo->Name), "ZWO ASI178%s (fake)",
+		config.color ? "MC" : "MM");
+	pASICameraInfo->CameraID = 0;
+	pASICameraInfo->MaxWidth = config.width;
+	pASICameraInfo->MaxHeight = config.height;
+	pASICameraInfo->IsColorCam = config.color ? ASI_TRUE : ASI_FALSE;
+	pASICameraInfo->BayerPattern = ASI_BAYER_RG;
+	pASICameraInfo->SupportedBins[0] = 1;
+	pASICameraInfo->SupportedBins[1] = 2;
+	pASICameraInfo->SupportedVideoFormat[0] = ASI_IMG_RAW8;
+	pASICameraInfo->SupportedVideoFormat[1] = ASI_IMG_RAW16;
+	pASICameraInfo->SupportedVideoFormat[2] = ASI_IMG_END;
+	pASICameraInfo->PixelSize = 2.4;
+	pASICameraInfo->IsUSB3Host = ASI_TRUE;
+	pASICameraInfo->IsUSB3Camera = ASI_TRUE;
+	pASICameraInfo->BitDepth = 14;
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASIOpenCamera(int iCameraID)
+{
+	load_config();
+	if (iCameraID != 0) return ASI_ERROR_INVALID_ID;
+	if (fake_usbfs_fd < 0) {
+		fake_usbfs_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	}
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASIInitCamera(int iCameraID)
+{
+	return (iCameraID == 0) ? ASI_SUCCESS : ASI_ERROR_INVALID_ID;
+}
+
+extern "C" ASI_ERROR_CODE ASICloseCamera(int iCameraID)
+{
+	if (fake_usbfs_fd >= 0) {
+		close(fake_usbfs_fd);
+		fake_usbfs_fd = -1;
+	}
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASISetROIFormat(int iCameraID, int iWidth, int iHeight, int iBin, ASI_IMG_TYPE Img_type)
+{
+	msg(C_BRIGHT_CYAN, "fake_camera: ROI %dx%d bin %d type %d\n", iWidth, iHeight, iBin, (int)Img_type);
+	if (iBin < 1 || iWidth % 8 != 0 || iHeight % 2 != 0 || iWidth * iBin > config.width ||
+		iHeight * iBin > config.height) {
+		return ASI_ERROR_INVALID_SIZE;
+	}
+	roi_width = iWidth;
+	roi_height = iHeight;
+	roi_bin = iBin;
+	roi_img_type = Img_type;
+	roi_start_x = (config.width / iBin - iWidth) / 2;
+	roi_start_y = (config.height / iBin - iHeight) / 2;
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASIGetROIFormat(int iCameraID, int *piWidth, int *piHeight, int *piBin, ASI_IMG_TYPE *pImg_type)
+{
+	*piWidth = roi_width;
+	*piHeight = roi_height;
+	*piBin = roi_bin;
+	*pImg_type = roi_img_type;
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASISetStartPos(int iCameraID, int iStartX, int iStartY)
+{
+	if (iStartX < 0 || iStartY < 0 || iStartX + roi_width > config.width / roi_bin ||
+		iStartY + roi_height > config.height / roi_bin) {
+		return ASI_ERROR_OUTOF_BOUNDARY;
+	}
+	msg(C_BRIGHT_CYAN, "fake_camera: start position %d,%d\n", iStartX, iStartY);
+	roi_start_x = iStartX;
+	roi_start_y = iStartY;
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASIGetStartPos(int iCameraID, int *piStartX, int *piStartY)
+{
+	*piStartX = roi_start_x;
+	*piStartY = roi_start_y;
+	return ASI_SUCCESS;
+}
+
+extern "C" ASI_ERROR_CODE ASISetControlValue(int iCameraID, ASI_CONTROL_TYPE ControlType, long lValue, ASI_BOOL bAuto)
+{
+	return ASI_SUCCESS;
+}
+
+
+// libc ============================================================================================
+
+// capture finds the device the ASI library opened by reading the links in /proc/self/fd, so make
+// the placeholder descriptor look like a usbfs node
+static ssize_t (*REAL__readlink)(const char *pathname, char *buf, size_t bufsiz) = NULL;
+extern "C" ssize_t readlink(const char *pathname, char *buf, size_t bufsiz)
+{
+	if (REAL__readlink == NULL) {
+		REAL__readlink = reinterpret_cast<decltype(REAL__readlink)>(dlsym(RTLD_NEXT, "readlink"));
+	}
+
+	char fake_path[64];
+	snprintf(fake_path, sizeof(fake_path), "/proc/self/fd/%d", fake_usbfs_fd);
+	if (fake_usbfs_fd >= 0 && strcmp(pathname, fake_path) == 0) {
+		char link[64];
+		int len = snprintf(link, sizeof(link), "/dev/bus/usb/%03d/%03d", FAKE_BUS, FAKE_ADDR);
+		len = std::min((size_t)len, bufsiz);
+		memcpy(buf, link, len);
+		return len;
+	}
+
+	return REAL__readlink(pathname, buf, bufsiz);
+}
+
+
+// libusb ==========================================================================================
+
+extern "C" int libusb_init(libusb_context **ctx)
+{
+	load_config();
+	if (ctx != NULL) *ctx = &fake_context;
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" void libusb_exit(libusb_context *ctx)
+{
+}
+
+extern "C" ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	*list = (libusb_device **)calloc(2, sizeof(libusb_device *));
+	(*list)[0] = &fake_device;
+	return 1;
+}
+
+extern "C" void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+extern "C" uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+	return FAKE_BUS;
+}
+
+extern "C" uint8_t libusb_get_port_number(libusb_device *dev)
+{
+	return 1;
+}
+
+extern "C" uint8_t libusb_get_device_address(libusb_device *dev)
+{
+	return FAKE_ADDR;
+}
+
+extern "C" int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = sizeof(*desc);
+	desc->bcdUSB = 0x0300;
+	desc->idVendor = ZWO_VID;
+	desc->idProduct = ASI178MC_PID;
+	desc->bNumConfigurations = 1;
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+	*dev_handle = &fake_handle;
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" void libusb_close(libusb_device_handle *dev_handle)
+{
+	streaming = false;
+}
+
+extern "C" int libusb_reset_device(libusb_device_handle *dev_handle)
+{
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" int libusb_clear_halt(libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	// ASI178 vendor requests to start and stop streaming
+	if (request_type == 0x40 && bRequest == 0xa9) {
+		streaming = true;
+		next_frame_due = steady_clock::now();
+	} else if (request_type == 0x40 && bRequest == 0xaa) {
+		streaming = false;
+	}
+
+	if ((request_type & 0x80) != 0) {
+		memset(data, 0, wLength);
+		return wLength;
+	}
+	return 0;
+}
+
+extern "C" struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return (libusb_transfer *)calloc(1, sizeof(libusb_transfer) + iso_packets * sizeof(libusb_iso_packet_descriptor));
+}
+
+extern "C" void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	free(transfer);
+}
+
+extern "C" int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	if (transfer->length < 4) return LIBUSB_ERROR_INVALID_PARAM;
+	pending_transfers.push_back(transfer);
+	return LIBUSB_SUCCESS;
+}
+
+extern "C" int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	for (auto it = pending_transfers.begin(); it != pending_transfers.end(); ++it) {
+		if (*it == transfer) {
+			pending_transfers.erase(it);
+			cancelled_transfers.push_back(transfer);
+			return LIBUSB_SUCCESS;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+extern "C" int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	if (completed != NULL && *completed) return LIBUSB_SUCCESS;
+	return handle_events(tv);
+}
+
+extern "C" int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	return handle_events(tv);
+}
+
+extern "C" int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+	struct timeval tv = {60, 0};
+	if (completed != NULL && *completed) return LIBUSB_SUCCESS;
+	return handle_events(&tv);
+}
+
+extern "C" int libusb_handle_events(libusb_context *ctx)
+{
+	struct timeval tv = {60, 0};
+	return handle_events(&tv);
+}
+
+extern "C" unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle, size_t length)
+{
+	if (!config.dma) return NULL;
+	void *buf = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (buf == MAP_FAILED) ? NULL : (unsigned char *)buf;
+}
+
+extern "C" int libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer, size_t length)
+{
+	return (munmap(buffer, length) == 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_OTHER;
+}